@@ -0,0 +1,125 @@
+/*
+ * arena.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdlib.h>
+#include "arena.h"
+#include "utility.h"
+
+// Chunks start small so little trees stay little, then double up to the max.
+#define MIN_CHUNK_SIZE ((size_t)1 << 14)
+#define MAX_CHUNK_SIZE ((size_t)1 << 20)
+
+void arena_init(ARENA *arena) {
+    arena->chunks = NULL;
+    arena->chunk_sizes = NULL;
+    arena->n_chunks = arena->max_chunks = 0;
+    arena->n_used = 0;
+    arena->n_system_allocs = 0;
+    arena_reset(arena);
+}
+
+void arena_reset(ARENA *arena) {
+    arena->n_used = 0;
+    arena->next = NULL;
+    arena->n_free_bytes = 0;
+    arena->chunk_size = MIN_CHUNK_SIZE;
+    for (int i = 0; i < ARENA_N_CLASSES; i++)
+        arena->free_lists[i] = NULL;
+}
+
+void arena_clear(ARENA *arena) {
+    for (int i = 0; i < arena->n_chunks; i++)
+        Free(arena->chunks[i]);
+    Free(arena->chunks);
+    Free(arena->chunk_sizes);
+    arena_init(arena);
+}
+
+int arena_size_class(size_t size) {
+    int size_class = 0;
+    while (arena_class_size(size_class) < size)
+        size_class++;
+    return size_class;
+}
+
+// Swap chunks j and k.
+static void swap_chunks(ARENA *arena, int j, int k) {
+    void *chunk = arena->chunks[j];
+    size_t size = arena->chunk_sizes[j];
+    arena->chunks[j] = arena->chunks[k];
+    arena->chunk_sizes[j] = arena->chunk_sizes[k];
+    arena->chunks[k] = chunk;
+    arena->chunk_sizes[k] = size;
+}
+
+// Get a new chunk of at least the given size, reusing a kept one if there's one
+// big enough, otherwise from the system. Its actual size is returned in size.
+// Returns NULL if allocation fails with an allocation flag set.
+static char *new_chunk(ARENA *arena, size_t *size) {
+    for (int k = arena->n_used; k < arena->n_chunks; k++)
+        if (arena->chunk_sizes[k] >= *size) {
+            swap_chunks(arena, k, arena->n_used);
+            *size = arena->chunk_sizes[arena->n_used];
+            return arena->chunks[arena->n_used++];
+        }
+    if (arena->n_chunks == arena->max_chunks) {
+        int max_chunks = 8 + 2 * arena->max_chunks;
+        RenewArray(arena->chunks, max_chunks);
+        RenewArray(arena->chunk_sizes, max_chunks);
+        if (allocation_failed_p())
+            return NULL;
+        arena->max_chunks = max_chunks;
+    }
+    char *chunk = safe_malloc(*size, __FILE__, __LINE__);
+    if (!chunk)
+        return NULL;
+    arena->chunks[arena->n_chunks] = chunk;
+    arena->chunk_sizes[arena->n_chunks] = *size;
+    swap_chunks(arena, arena->n_chunks++, arena->n_used);
+    arena->n_system_allocs++;
+    return arena->chunks[arena->n_used++];
+}
+
+void *arena_alloc(ARENA *arena, int size_class) {
+    void *p = arena->free_lists[size_class];
+    if (p) {
+        arena->free_lists[size_class] = *(void**)p;
+        return p;
+    }
+    size_t size = arena_class_size(size_class);
+
+    // Blocks too big to share a chunk get their own.
+    if (size > MAX_CHUNK_SIZE / 4)
+        return new_chunk(arena, &size);
+
+    if (arena->n_free_bytes < size) {
+        // Put the rest of the current chunk on free lists rather than waste it.
+        for (int c = size_class - 1; c >= 0; c--)
+            if (arena->n_free_bytes >= arena_class_size(c)) {
+                arena_free(arena, arena->next, c);
+                arena->next += arena_class_size(c);
+                arena->n_free_bytes -= arena_class_size(c);
+            }
+        size_t chunk_size = arena->chunk_size;
+        char *chunk = new_chunk(arena, &chunk_size);
+        if (!chunk)
+            return NULL;
+        arena->next = chunk;
+        arena->n_free_bytes = chunk_size;
+        if (arena->chunk_size < MAX_CHUNK_SIZE)
+            arena->chunk_size *= 2;
+    }
+    p = arena->next;
+    arena->next += size;
+    arena->n_free_bytes -= size;
+    return p;
+}
+
+void arena_free(ARENA *arena, void *p, int size_class) {
+    *(void**)p = arena->free_lists[size_class];
+    arena->free_lists[size_class] = p;
+}
@@ -0,0 +1,64 @@
+/*
+ * arena.h
+ *
+ * A simple arena for many small blocks with short and uneven lives, such as
+ * quadtree nodes and their marker lists. Blocks are carved from large chunks
+ * and come in power of two size classes. Freed blocks go on a free list for
+ * their class and are reused. Everything is released at once when the arena
+ * is cleared, or kept for reuse when it's reset.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include "namespace.h"
+
+// Size classes run from 16 bytes to 2^(ARENA_MIN_SHIFT + ARENA_N_CLASSES - 1).
+#define ARENA_MIN_SHIFT 4
+#define ARENA_N_CLASSES 28
+
+typedef struct arena_s {
+    void **chunks;                      // everything obtained from the system,
+    size_t *chunk_sizes;                // with sizes
+    int n_chunks, max_chunks;
+    int n_used;                         // chunks in use; the rest are kept for reuse
+    char *next;                         // unused part of the newest chunk
+    size_t n_free_bytes;
+    size_t chunk_size;                  // size of the next chunk to allocate
+    void *free_lists[ARENA_N_CLASSES];  // freed blocks, linked through their first word
+    long n_system_allocs;               // number of chunks ever allocated
+} ARENA;
+
+#define ARENA_DECL(Name) ARENA Name[1]; arena_init(Name)
+
+#define arena_init(A) NAME(arena_init)(A)
+void arena_init(ARENA *arena);
+
+// Free all chunks, returning the arena to the initialized state.
+#define arena_clear(A) NAME(arena_clear)(A)
+void arena_clear(ARENA *arena);
+
+// Forget all blocks, but keep the chunks to carve new ones from.
+#define arena_reset(A) NAME(arena_reset)(A)
+void arena_reset(ARENA *arena);
+
+// Return the size class for blocks of at least the given number of bytes.
+#define arena_size_class(Size) NAME(arena_size_class)(Size)
+int arena_size_class(size_t size);
+
+#define arena_class_size(Class) ((size_t)1 << ((Class) + ARENA_MIN_SHIFT))
+
+// Return a block of the given size class, or NULL if allocation fails with
+// an allocation flag set. See utility.h.
+#define arena_alloc(A, Class) NAME(arena_alloc)(A, Class)
+void *arena_alloc(ARENA *arena, int size_class);
+
+// Return a block of the given size class to the arena for reuse.
+#define arena_free(A, P, Class) NAME(arena_free)(A, P, Class)
+void arena_free(ARENA *arena, void *p, int size_class);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,291 @@
+/*
+ * bench.c
+ *
+ * A standalone merge benchmark, built only with LULU_BENCH. See the bench
+ * task in the Rakefile. Each dataset at each size is generated from a seed,
+ * so runs are reproducible, then merged and compressed in a child process
+ * of its own, so peak RSS is that of the one run. Results are printed one
+ * JSON object per line:
+ *
+ *   {"dataset":"uniform","n":100000,"seed":1,"threads":1,"kind":"circle",
+ *    "markers":153444,"clusters":46556,"setup":0.002,"index":0.018,...}
+ *
+ * The phase times and work counts are the merge stats of stats.h, so the
+ * benchmark is built with LULU_MERGE_STATS too. With more than one thread,
+ * phase times are summed over threads, but the total is wall time.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifdef LULU_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "merger.h"
+#include "utility.h"
+
+#ifndef LULU_MERGE_STATS
+#error "the benchmark needs LULU_MERGE_STATS"
+#endif
+
+// Sizes of datasets when none are given.
+static int default_sizes[] = { 10000, 100000, 1000000 };
+
+// In the overlapping dataset every marker overlaps every other, so merges
+// cost O(n^2 log n). Larger sizes are skipped.
+#define OVERLAPPING_MAX_MARKERS 10000
+
+// A splitmix64 generator, so datasets are the same with any C library.
+typedef struct rng_s {
+    uint64_t state;
+} RNG;
+
+static uint64_t rng_next(RNG *rng) {
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1).
+static double rng_double(RNG *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Standard normal by the Box-Muller transform.
+static double rng_normal(RNG *rng) {
+    double u = 1 - rng_double(rng);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * rng_double(rng));
+}
+
+// Markers are spread over a square with side growing as the square root of
+// their number, so density, and so overlap, is the same at every size.
+static double extent(int n) {
+    return 10 * sqrt(n);
+}
+
+// Sizes of most datasets are uniform integers in [1, 64].
+static double uniform_size(RNG *rng) {
+    return 1 + (int)(64 * rng_double(rng));
+}
+
+static void set_uniform(MARKER_INFO *info, MARKER *markers, int n, RNG *rng) {
+    double side = extent(n);
+    for (int i = 0; i < n; i++) {
+        double x = side * rng_double(rng), y = side * rng_double(rng);
+        mr_set(info, markers + i, x, y, uniform_size(rng));
+    }
+}
+
+// Gaussian clusters of about a thousand markers each.
+static void set_clustered(MARKER_INFO *info, MARKER *markers, int n, RNG *rng) {
+    double side = extent(n);
+    int n_centers = n / 1000 + 1;
+    NewArrayDecl(double, centers, 2 * n_centers);
+    for (int i = 0; i < 2 * n_centers; i++)
+        centers[i] = side * rng_double(rng);
+    for (int i = 0; i < n; i++) {
+        double *c = centers + 2 * (int)(n_centers * rng_double(rng));
+        double x = c[0] + 50 * rng_normal(rng), y = c[1] + 50 * rng_normal(rng);
+        mr_set(info, markers + i, x, y, uniform_size(rng));
+    }
+    Free(centers);
+}
+
+// Uniform positions with Pareto sizes of exponent 1.5, capped at 10000.
+static void set_power_law(MARKER_INFO *info, MARKER *markers, int n, RNG *rng) {
+    double side = extent(n);
+    for (int i = 0; i < n; i++) {
+        double x = side * rng_double(rng), y = side * rng_double(rng);
+        double size = pow(1 - rng_double(rng), -1 / 1.5);
+        mr_set(info, markers + i, x, y, size < 10000 ? size : 10000);
+    }
+}
+
+// Uniform markers at only one position in 16, so many coincide.
+static void set_coincident(MARKER_INFO *info, MARKER *markers, int n, RNG *rng) {
+    double side = extent(n);
+    int n_points = n / 16 + 1;
+    NewArrayDecl(double, points, 2 * n_points);
+    for (int i = 0; i < 2 * n_points; i++)
+        points[i] = side * rng_double(rng);
+    for (int i = 0; i < n; i++) {
+        double *p = points + 2 * (int)(n_points * rng_double(rng));
+        mr_set(info, markers + i, p[0], p[1], uniform_size(rng));
+    }
+    Free(points);
+}
+
+// Markers with centers in a unit square, so all overlap.
+static void set_overlapping(MARKER_INFO *info, MARKER *markers, int n, RNG *rng) {
+    for (int i = 0; i < n; i++) {
+        double x = rng_double(rng), y = rng_double(rng);
+        mr_set(info, markers + i, x, y, uniform_size(rng));
+    }
+}
+
+typedef struct dataset_s {
+    const char *name;
+    void (*set)(MARKER_INFO *info, MARKER *markers, int n, RNG *rng);
+    int max_markers;
+} DATASET;
+
+static DATASET datasets[] = {
+    { "uniform", set_uniform, INT32_MAX },
+    { "clustered", set_clustered, INT32_MAX },
+    { "power_law", set_power_law, INT32_MAX },
+    { "coincident", set_coincident, INT32_MAX },
+    { "overlapping", set_overlapping, OVERLAPPING_MAX_MARKERS },
+};
+
+// Squeeze out deleted markers as the gem's compress does, returning how many are left.
+static MARKER_ID compress(MARKER *markers, MARKER_ID n_markers) {
+    MARKER_ID dst = 0;
+    for (MARKER_ID src = 0; src < n_markers; src++)
+        if (!mr_deleted_p(markers + src)) {
+            if (src != dst)
+                markers[dst] = markers[src];
+            mr_reset_parts(markers + dst);
+            dst++;
+        }
+    return dst;
+}
+
+// Generate one dataset, merge and compress it, and print the results.
+static void run(DATASET *dataset, int n, uint64_t seed, int n_threads, MARKER_KIND kind) {
+    MARKER_INFO_DECL(info);
+    mr_info_set(info, kind, 1);
+    info->n_threads = n_threads;
+    RNG rng[1] = {{ seed ^ (uint64_t)n }};
+    NewArrayDecl(MARKER, markers, 2 * n - 1);
+    dataset->set(info, markers, n, rng);
+
+    MERGE_WORKSPACE_DECL(workspace);
+    allocation_count = allocation_bytes = 0;
+    stats_start();
+    double start = wall_seconds();
+    MARKER_ID n_markers = merge_markers_in(workspace, info, markers, n, NULL);
+    double compress_start = wall_seconds();
+    MARKER_ID n_clusters = compress(markers, n_markers);
+    double stop = wall_seconds();
+    STATS_DECL(stats);
+    stats_flush(stats);
+
+    struct rusage usage[1];
+    getrusage(RUSAGE_SELF, usage);
+    uint64_t *phases = stats->phase_ns;
+    printf("{\"dataset\":\"%s\",\"n\":%d,\"seed\":%llu,\"threads\":%d,\"kind\":\"%s\","
+            "\"markers\":%" PRI_MARKER_ID ",\"clusters\":%" PRI_MARKER_ID ","
+            "\"setup\":%.6f,\"index\":%.6f,\"nearest\":%.6f,\"loop\":%.6f,\"compress\":%.6f,\"total\":%.6f,"
+            "\"peak_rss_kb\":%ld,\"allocations\":%zu,\"allocated_bytes\":%zu,"
+            "\"nearest_searches\":%llu,\"nodes_visited\":%llu,\"distances\":%llu,\"heap_sifts\":%llu}\n",
+            dataset->name, n, (unsigned long long)seed, n_threads, kind == SQUARE ? "square" : "circle",
+            n_markers, n_clusters,
+            1e-9 * phases[PHASE_SETUP], 1e-9 * phases[PHASE_INDEX],
+            1e-9 * phases[PHASE_NEAREST], 1e-9 * phases[PHASE_LOOP],
+            stop - compress_start, stop - start,
+            usage->ru_maxrss, allocation_count, allocation_bytes,
+            (unsigned long long)stats->nearest_searches, (unsigned long long)stats->nodes_visited,
+            (unsigned long long)stats->distances, (unsigned long long)stats->heap_sifts);
+    merge_workspace_clear(workspace);
+    Free(markers);
+}
+
+// Split a comma-separated list into at most max_items strings, returning how many.
+static int split(char *list, char **items, int max_items) {
+    int n = 0;
+    for (char *item = strtok(list, ","); item && n < max_items; item = strtok(NULL, ","))
+        items[n++] = item;
+    return n;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-s seed] [-t threads] [-k circle|square] [-n size,...] [-d dataset,...]\n"
+            "datasets: uniform, clustered, power_law, coincident, overlapping\n", program);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t seed = 1;
+    int n_threads = 1;
+    MARKER_KIND kind = CIRCLE;
+    int sizes[32], n_sizes = 0;
+    DATASET *selected[STATIC_ARRAY_SIZE(datasets)];
+    int n_selected = 0;
+    char *items[32];
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:k:n:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            if (n_threads < 1)
+                usage(argv[0]);
+            break;
+        case 'k':
+            if (strcmp(optarg, "square") == 0)
+                kind = SQUARE;
+            else if (strcmp(optarg, "circle") != 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            n_sizes = split(optarg, items, STATIC_ARRAY_SIZE(items));
+            for (int i = 0; i < n_sizes; i++)
+                if ((sizes[i] = atoi(items[i])) < 1)
+                    usage(argv[0]);
+            break;
+        case 'd':
+            n_selected = 0;
+            for (int n = split(optarg, items, STATIC_ARRAY_SIZE(items)), i = 0; i < n; i++) {
+                int k = 0;
+                while (k < STATIC_ARRAY_SIZE(datasets) && strcmp(items[i], datasets[k].name) != 0)
+                    k++;
+                if (k == STATIC_ARRAY_SIZE(datasets) || n_selected == STATIC_ARRAY_SIZE(selected))
+                    usage(argv[0]);
+                selected[n_selected++] = datasets + k;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n_sizes == 0) {
+        n_sizes = STATIC_ARRAY_SIZE(default_sizes);
+        CopyArray(sizes, default_sizes, n_sizes);
+    }
+    if (n_selected == 0) {
+        n_selected = STATIC_ARRAY_SIZE(datasets);
+        for (int k = 0; k < n_selected; k++)
+            selected[k] = datasets + k;
+    }
+
+    int status = 0;
+    for (int k = 0; k < n_selected; k++)
+        for (int i = 0; i < n_sizes; i++) {
+            if (sizes[i] > selected[k]->max_markers)
+                continue;
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                run(selected[k], sizes[i], seed, n_threads, kind);
+                exit(0);
+            }
+            int child_status;
+            if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || child_status != 0) {
+                fprintf(stderr, "%s: %s at %d failed\n", argv[0], selected[k]->name, sizes[i]);
+                status = 1;
+            }
+        }
+    return status;
+}
+
+#endif
@@ -3,6 +3,18 @@ require 'mkmf'
 # Turn off warnings about declarations mixed with code.
 $CFLAGS += ' -std=c99 -Wno-declaration-after-statement'
 
+# Parallel merges use POSIX threads.
+have_library('pthread', 'pthread_create')
+
+# Count the work merges do for MarkerList#merge_stats, at some cost in speed:
+#   gem install lulu -- --enable-merge-stats
+$CFLAGS += ' -DLULU_MERGE_STATS' if enable_config('merge-stats', false)
+
+# Index markers with 64-bit integers, so lists can pass 2^31 markers, at the
+# cost of 8 more bytes per marker and wider merge arrays:
+#   gem install lulu -- --enable-index64
+$CFLAGS += ' -DLULU_INDEX64' if enable_config('index64', false)
+
 # Select Ruby gem code
 $CFLAGS += ' -DLULU_GEM'
 
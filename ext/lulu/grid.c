@@ -0,0 +1,263 @@
+/*
+ * grid.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "grid.h"
+#include "scan.h"
+#include "utility.h"
+#include "stats.h"
+
+// Bytes per bucket list entry: an index and a shape.
+#define ENTRY_SIZE (sizeof(MARKER_ID) + 2 * sizeof(MARKER_COORD) + sizeof(MARKER_DISTANCE))
+
+// Size class of the arena block for a bucket list of the given capacity.
+#define LIST_SIZE_CLASS(Capacity) arena_size_class((Capacity) * ENTRY_SIZE)
+
+// Candidates are scanned in blocks of this many to bound the hit buffer.
+#define SCAN_BLOCK_SIZE 256
+
+static void init_bucket(GRID_BUCKET *bucket) {
+    bucket->markers = NULL;
+    bucket->xs = bucket->ys = NULL;
+    bucket->rs = NULL;
+    bucket->marker_count = bucket->markers_size = 0;
+}
+
+// Add a marker index and its shape to a bucket, growing it to the next
+// arena size class if it's full. Return 0, or -1 if allocation fails.
+static int add_marker(GRID *grid, GRID_BUCKET *bucket, MARKER_ID i) {
+    if (bucket->marker_count == bucket->markers_size) {
+        int size_class = bucket->markers_size > 0 ? LIST_SIZE_CLASS(bucket->markers_size) + 1 : LIST_SIZE_CLASS(2);
+        int markers_size = arena_class_size(size_class) / ENTRY_SIZE;
+        // An even capacity keeps 64-bit indices after float shapes aligned.
+        if (sizeof(MARKER_ID) > sizeof(MARKER_DISTANCE))
+            markers_size &= ~1;
+        MARKER_COORD *xs = arena_alloc(grid->arena, size_class);
+        if (!xs)
+            return -1;
+        MARKER_COORD *ys = xs + markers_size;
+        MARKER_DISTANCE *rs = ys + markers_size;
+        MARKER_ID *markers = (MARKER_ID*)(rs + markers_size);
+        if (bucket->marker_count > 0) {
+            CopyArray(xs, bucket->xs, bucket->marker_count);
+            CopyArray(ys, bucket->ys, bucket->marker_count);
+            CopyArray(rs, bucket->rs, bucket->marker_count);
+            CopyArray(markers, bucket->markers, bucket->marker_count);
+        }
+        if (bucket->markers_size > 0)
+            arena_free(grid->arena, bucket->xs, size_class - 1);
+        bucket->xs = xs;
+        bucket->ys = ys;
+        bucket->rs = rs;
+        bucket->markers = markers;
+        bucket->markers_size = markers_size;
+    }
+    MARKER_GEOMETRY *g = grid->geometry;
+    int k = bucket->marker_count++;
+    bucket->markers[k] = i;
+    bucket->xs[k] = mg_x(g, i);
+    bucket->ys[k] = mg_y(g, i);
+    bucket->rs[k] = mg_r(g, i);
+    return 0;
+}
+
+// Delete a marker index from a bucket by moving the last entry into its place.
+static void delete_marker(GRID_BUCKET *bucket, MARKER_ID i) {
+    for (int k = 0; k < bucket->marker_count; k++)
+        if (bucket->markers[k] == i) {
+            int last = --bucket->marker_count;
+            bucket->markers[k] = bucket->markers[last];
+            bucket->xs[k] = bucket->xs[last];
+            bucket->ys[k] = bucket->ys[last];
+            bucket->rs[k] = bucket->rs[last];
+            return;
+        }
+}
+
+// Return the lowest level with cells at least twice the given radius.
+static int level_for(GRID *grid, MARKER_DISTANCE r) {
+    int level = 0;
+    MARKER_DISTANCE half_side = 0.5 * grid->cell_size;
+    while (half_side < r && level < GRID_LEVELS - 1) {
+        half_side *= 2;
+        level++;
+    }
+    return level;
+}
+
+// Return the coordinate of the cell containing the given coordinate.
+static int64_t cell_of(MARKER_COORD v, MARKER_COORD origin, MARKER_DISTANCE side) {
+    return (int64_t)floor((v - origin) / side);
+}
+
+static GRID_BUCKET *bucket_for(GRID *grid, int level, int64_t cx, int64_t cy) {
+    uint64_t h = (uint64_t)cx * 0x9E3779B97F4A7C15ull ^ (uint64_t)cy * 0xC2B2AE3D27D4EB4Full ^ (uint64_t)level;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return grid->buckets + (h & grid->bucket_mask);
+}
+
+static GRID_BUCKET *bucket_of_marker(GRID *grid, MARKER_ID i, int *level) {
+    MARKER_GEOMETRY *g = grid->geometry;
+    *level = level_for(grid, mg_r(g, i));
+    MARKER_DISTANCE side = ldexp(grid->cell_size, *level);
+    return bucket_for(grid, *level,
+            cell_of(mg_x(g, i), grid->x, side), cell_of(mg_y(g, i), grid->y, side));
+}
+
+// Local struct to hold information about the nearest marker seen so far in a search.
+struct nearest_info {
+    MARKER_KIND kind;
+    MARKER_ID target, nearest;
+    MARKER_COORD x, y;
+    MARKER_DISTANCE r;
+    MARKER_DISTANCE distance;
+};
+
+// Update nearest information with the markers of a bucket. This is
+// update_nearest of the quadtree over a bucket rather than a node.
+static void update_nearest(GRID_BUCKET *bucket, struct nearest_info *nearest_info) {
+    MARKER_KIND kind = nearest_info->kind;
+    MARKER_COORD x = nearest_info->x;
+    MARKER_COORD y = nearest_info->y;
+    MARKER_DISTANCE r = nearest_info->r;
+    int hits[SCAN_BLOCK_SIZE];
+    STAT_ADD(nodes_visited, 1);
+    STAT_ADD(candidates, bucket->marker_count);
+    for (int k0 = 0; k0 < bucket->marker_count; k0 += SCAN_BLOCK_SIZE) {
+        int n = bucket->marker_count - k0;
+        if (n > SCAN_BLOCK_SIZE)
+            n = SCAN_BLOCK_SIZE;
+        int n_hits = scan_overlapping(kind, bucket->xs + k0, bucket->ys + k0, bucket->rs + k0, bucket->markers + k0, n,
+                x, y, r, nearest_info->target, hits);
+        STAT_ADD(distances, n_hits);
+        for (int h = 0; h < n_hits; h++) {
+            int k = k0 + hits[h];
+            MARKER_DISTANCE d;
+            if (kind == SQUARE) {
+                MARKER_DISTANCE r_sum = r + bucket->rs[k];
+                d = fmax(fabs(bucket->xs[k] - x) - r_sum, fabs(bucket->ys[k] - y) - r_sum);
+            } else {
+                MARKER_DISTANCE dx = bucket->xs[k] - x;
+                MARKER_DISTANCE dy = bucket->ys[k] - y;
+                d = sqrt(dx * dx + dy * dy) - r - bucket->rs[k];
+            }
+            MARKER_ID i = bucket->markers[k];
+            if (d < nearest_info->distance || (d == nearest_info->distance && i < nearest_info->nearest)) {
+                nearest_info->distance = d;
+                nearest_info->nearest = i;
+            }
+        }
+    }
+}
+
+void grid_init(GRID *grid) {
+    grid->x = grid->y = 0;
+    grid->cell_size = 1;
+    grid->info = NULL;
+    grid->geometry = NULL;
+    grid->buckets = NULL;
+    grid->bucket_mask = 0;
+    grid->max_buckets = 0;
+    for (int level = 0; level < GRID_LEVELS; level++) {
+        grid->level_counts[level] = 0;
+        grid->level_r_max[level] = 0;
+    }
+    arena_init(grid->arena);
+}
+
+void grid_setup(GRID *grid, MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE cell_size,
+        MARKER_ID max_markers, MARKER_INFO *info, MARKER_GEOMETRY *geometry) {
+    arena_reset(grid->arena);
+    grid->x = x;
+    grid->y = y;
+    grid->cell_size = cell_size > 0 ? cell_size : 1;
+    grid->info = info;
+    grid->geometry = geometry;
+    for (int level = 0; level < GRID_LEVELS; level++) {
+        grid->level_counts[level] = 0;
+        grid->level_r_max[level] = 0;
+    }
+    // About two buckets per marker keeps collisions rare.
+    unsigned n_buckets = 16;
+    while ((MARKER_ID)n_buckets < 2 * max_markers && n_buckets < (1u << 30))
+        n_buckets *= 2;
+    if (n_buckets > grid->max_buckets) {
+        Free(grid->buckets);
+        grid->max_buckets = 0;
+        NewArray(grid->buckets, n_buckets);
+        if (!grid->buckets) {
+            grid->bucket_mask = 0;
+            return;
+        }
+        grid->max_buckets = n_buckets;
+    }
+    for (unsigned i = 0; i < n_buckets; i++)
+        init_bucket(grid->buckets + i);
+    grid->bucket_mask = n_buckets - 1;
+}
+
+void grid_clear(GRID *grid) {
+    Free(grid->buckets);
+    arena_clear(grid->arena);
+    grid_init(grid);
+}
+
+void grid_insert(GRID *grid, MARKER_ID i) {
+    int level;
+    GRID_BUCKET *bucket = bucket_of_marker(grid, i, &level);
+    if (add_marker(grid, bucket, i) != 0)
+        return;
+    STAT_MAX(index_depth, level);
+    grid->level_counts[level]++;
+    if (mg_r(grid->geometry, i) > grid->level_r_max[level])
+        grid->level_r_max[level] = mg_r(grid->geometry, i);
+}
+
+void grid_delete(GRID *grid, MARKER_ID i) {
+    int level;
+    GRID_BUCKET *bucket = bucket_of_marker(grid, i, &level);
+    delete_marker(bucket, i);
+    grid->level_counts[level]--;
+}
+
+MARKER_ID grid_nearest(GRID *grid, MARKER_ID a) {
+    MARKER_GEOMETRY *g = grid->geometry;
+    struct nearest_info nearest_info[1] = {{
+        grid->info->kind, a, -1, mg_x(g, a), mg_y(g, a), mg_r(g, a), 0
+    }};
+    double n_buckets = (double)grid->bucket_mask + 1;
+    STAT_ADD(nearest_searches, 1);
+    for (int level = 0; level < GRID_LEVELS; level++) {
+        if (grid->level_counts[level] == 0)
+            continue;
+        // Any overlapping marker at this level has its center within reach.
+        MARKER_DISTANCE reach = nearest_info->r + grid->level_r_max[level];
+        MARKER_DISTANCE side = ldexp(grid->cell_size, level);
+        int64_t cx0 = cell_of(nearest_info->x - reach, grid->x, side);
+        int64_t cx1 = cell_of(nearest_info->x + reach, grid->x, side);
+        int64_t cy0 = cell_of(nearest_info->y - reach, grid->y, side);
+        int64_t cy1 = cell_of(nearest_info->y + reach, grid->y, side);
+        // When there are more cells than buckets, just look at every bucket.
+        // That covers every level at once.
+        if ((double)(cx1 - cx0 + 1) * (double)(cy1 - cy0 + 1) > n_buckets) {
+            nearest_info->distance = 0;
+            nearest_info->nearest = -1;
+            for (unsigned b = 0; b <= grid->bucket_mask; b++)
+                update_nearest(grid->buckets + b, nearest_info);
+            break;
+        }
+        for (int64_t cy = cy0; cy <= cy1; cy++)
+            for (int64_t cx = cx0; cx <= cx1; cx++)
+                update_nearest(bucket_for(grid, level, cx, cy), nearest_info);
+    }
+    return nearest_info->nearest;
+}
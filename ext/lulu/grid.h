@@ -0,0 +1,77 @@
+/*
+ * grid.h
+ *
+ * A multi-level spatial hash for finding nearest overlapping markers, an
+ * alternative to the quadtree when marker sizes are nearly uniform.
+ *
+ * Level k has square cells of side cell_size * 2^k. Each marker goes in the
+ * one cell of the lowest level with cells at least twice its radius, chosen
+ * by its center. So it's found by looking only in cells within its radius
+ * plus the largest radius at each level. Cells are hashed into a fixed table
+ * of buckets, so there's no bound on extent. Markers of colliding cells share
+ * buckets and are simply checked too.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef GRID_H_
+#define GRID_H_
+
+#include "namespace.h"
+#include "marker.h"
+#include "arena.h"
+
+#define GRID_LEVELS 48
+
+// A bucket of markers with their shapes packed for vector scans. All four
+// arrays are in one arena block starting at xs.
+typedef struct grid_bucket_s {
+    MARKER_ID *markers;
+    MARKER_COORD *xs, *ys;
+    MARKER_DISTANCE *rs;
+    int marker_count, markers_size;
+} GRID_BUCKET;
+
+typedef struct grid_s {
+    MARKER_COORD x, y;                  // origin of cell coordinates
+    MARKER_DISTANCE cell_size;          // side of level 0 cells
+    MARKER_INFO *info;
+    MARKER_GEOMETRY *geometry;
+    GRID_BUCKET *buckets;
+    unsigned bucket_mask;               // number of buckets less 1, a power of 2 less 1
+    unsigned max_buckets;               // number allocated
+    MARKER_ID level_counts[GRID_LEVELS]; // markers at each level
+    MARKER_DISTANCE level_r_max[GRID_LEVELS]; // largest radius ever inserted at each level
+    ARENA arena[1];                     // holds bucket lists
+} GRID;
+
+#define GRID_DECL(Name) GRID Name[1]; grid_init(Name)
+
+#define grid_init(G)  NAME(grid_init)(G)
+void grid_init(GRID *grid);
+
+// Set up an empty grid for about max_markers markers at once from the given
+// geometry. The geometry may be reallocated as it grows, but must keep the same address.
+// Memory of a grid set up before is reused.
+#define grid_setup(G, X, Y, CellSize, MaxMarkers, Info, Geometry) \
+    NAME(grid_setup)(G, X, Y, CellSize, MaxMarkers, Info, Geometry)
+void grid_setup(GRID *grid, MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE cell_size,
+        MARKER_ID max_markers, MARKER_INFO *info, MARKER_GEOMETRY *geometry);
+
+#define grid_clear(G) NAME(grid_clear)(G)
+void grid_clear(GRID *grid);
+
+#define grid_insert(G, I) NAME(grid_insert)(G, I)
+void grid_insert(GRID *grid, MARKER_ID i);
+
+#define grid_delete(G, I) NAME(grid_delete)(G, I)
+void grid_delete(GRID *grid, MARKER_ID i);
+
+// Return the index of the nearest marker in the grid overlapping marker a
+// and having a lower index, or -1 if there is none. Ties go to the lower
+// index, as with qt_nearest, so the two always agree.
+#define grid_nearest(G, A) NAME(grid_nearest)(G, A)
+MARKER_ID grid_nearest(GRID *grid, MARKER_ID a);
+
+#endif /* GRID_H_ */
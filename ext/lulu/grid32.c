@@ -0,0 +1,11 @@
+/*
+ * grid32.c
+ *
+ * The float32 build of grid.c. See namespace.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#define LULU_FLOAT32
+#include "grid.c"
@@ -0,0 +1,520 @@
+/*
+ * im.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "im.h"
+#include "merger.h"
+#include "utility.h"
+
+// Flag bits in marks.
+#define IN_QT   1   // The marker's footprint is in the quadtree.
+#define PLANNED 2   // The marker is a cluster planned for re-merging.
+
+#define fp_w(F) ((F)->x - (F)->r)
+#define fp_e(F) ((F)->x + (F)->r)
+#define fp_s(F) ((F)->y - (F)->r)
+#define fp_n(F) ((F)->y + (F)->r)
+
+// Set a footprint to the bounding square of the given marker.
+static void set_box(FOOTPRINT *footprint, MARKER *marker) {
+    footprint->x = mr_x(marker);
+    footprint->y = mr_y(marker);
+    footprint->r = mr_r(marker);
+}
+
+// Enlarge a footprint to also cover the given square.
+static void cover(FOOTPRINT *footprint, FOOTPRINT *square) {
+    MARKER_COORD w = fmin(fp_w(footprint), fp_w(square));
+    MARKER_COORD e = fmax(fp_e(footprint), fp_e(square));
+    MARKER_COORD s = fmin(fp_s(footprint), fp_s(square));
+    MARKER_COORD n = fmax(fp_n(footprint), fp_n(square));
+    footprint->x = 0.5 * (w + e);
+    footprint->y = 0.5 * (s + n);
+    // Pad for rounding so the square surely covers the bounds.
+    footprint->r = 0.5 * fmax(e - w, n - s) * (1 + 4 * MARKER_DISTANCE_EPSILON) + MARKER_DISTANCE_MIN;
+}
+
+// Set the footprint of a marker given the footprints of its parts, if any.
+static void set_footprint(FOOTPRINT *footprints, FOOTPRINT *footprint, MARKER *marker) {
+    set_box(footprint, marker);
+    if (mr_merged(marker)) {
+        cover(footprint, footprints + marker->part_a);
+        cover(footprint, footprints + marker->part_b);
+    }
+}
+
+static void get_footprint(INCREMENTAL_MERGE *im, MARKER_ID i, FOOTPRINT *footprint) {
+    footprint->x = mg_x(im->footprints, i);
+    footprint->y = mg_y(im->footprints, i);
+    footprint->r = mg_r(im->footprints, i);
+}
+
+static void put_footprint(INCREMENTAL_MERGE *im, MARKER_ID i, FOOTPRINT *footprint) {
+    mg_set(im->footprints, i, footprint->x, footprint->y, footprint->r, 0);
+}
+
+static int inside_qt_p(QUADTREE *qt, MARKER_GEOMETRY *footprints, MARKER_ID i) {
+    return mg_w(footprints, i) >= qt->x && mg_e(footprints, i) <= qt->x + qt->w &&
+           mg_s(footprints, i) >= qt->y && mg_n(footprints, i) <= qt->y + qt->h;
+}
+
+// Rebuild the quadtree of footprints of all clusters covered.
+static void rebuild_qt(INCREMENTAL_MERGE *im, MARKER *markers) {
+    qt_clear(im->qt);
+    MARKER_ID n_roots = 0;
+    MARKER_COORD w = 0, e = 0, s = 0, n = 0;
+    for (MARKER_ID i = 0; i < im->size; i++) {
+        im->marks[i] &= ~IN_QT;
+        if (!mr_deleted_p(markers + i)) {
+            MARKER_GEOMETRY *footprints = im->footprints;
+            if (n_roots++ == 0) {
+                w = mg_w(footprints, i);
+                e = mg_e(footprints, i);
+                s = mg_s(footprints, i);
+                n = mg_n(footprints, i);
+            } else {
+                w = fmin(w, mg_w(footprints, i));
+                e = fmax(e, mg_e(footprints, i));
+                s = fmin(s, mg_s(footprints, i));
+                n = fmax(n, mg_n(footprints, i));
+            }
+        }
+    }
+    // Leave a margin so a few new clusters outside the current ones don't force a rebuild.
+    MARKER_DISTANCE margin = 0.25 * fmax(e - w, n - s);
+    if (margin <= 0)
+        margin = 1;
+    qt_setup(im->qt, high_bit_position(n_roots) / 4 + 3,
+            w - margin, s - margin, e - w + 2 * margin, n - s + 2 * margin, im->qt_info, im->footprints);
+    for (MARKER_ID i = 0; i < im->size; i++)
+        if (!mr_deleted_p(markers + i)) {
+            qt_insert(im->qt, i);
+            im->marks[i] |= IN_QT;
+        }
+}
+
+// Insert the footprint of a new cluster into the quadtree.
+static void insert_footprint(INCREMENTAL_MERGE *im, MARKER *markers, MARKER_ID i) {
+    if (inside_qt_p(im->qt, im->footprints, i)) {
+        qt_insert(im->qt, i);
+        im->marks[i] |= IN_QT;
+    } else {
+        rebuild_qt(im, markers);
+    }
+}
+
+// Grow the per-marker arrays to cover at least n markers. Return 0, or -1 if
+// allocation failed with an allocation flag.
+static int reserve(INCREMENTAL_MERGE *im, MARKER_ID n) {
+    if (im->max_size < n) {
+        MARKER_ID max_size = 2 * im->max_size < n ? n : 2 * im->max_size;
+        RenewArray(im->parents, max_size);
+        RenewArray(im->marks, max_size);
+        mg_reserve(im->footprints, max_size);
+        if (allocation_failed_p())
+            return -1;
+        im->max_size = max_size;
+    }
+    return 0;
+}
+
+static MARKER_ID root_of(INCREMENTAL_MERGE *im, MARKER_ID i) {
+    while (im->parents[i] >= 0)
+        i = im->parents[i];
+    return i;
+}
+
+// Whether planning must stop, because it was canceled or ran out of memory.
+static int stopped_p(volatile int *cancel_p) {
+    return (cancel_p && *cancel_p) || allocation_failed_p();
+}
+
+static void enqueue(INCREMENTAL_MERGE *im, FOOTPRINT *footprint) {
+    EnsureArraySize(im->queue, im->max_queue, im->n_queue + 1);
+    if (allocation_failed_p())
+        return;
+    im->queue[im->n_queue++] = *footprint;
+}
+
+// Plan to re-merge the given cluster and check what its footprint intersects.
+static void add_root(INCREMENTAL_MERGE *im, MARKER_ID i) {
+    EnsureArraySize(im->roots, im->max_roots, im->n_roots + 1);
+    if (allocation_failed_p())
+        return;
+    im->marks[i] |= PLANNED;
+    im->roots[im->n_roots++] = i;
+    FOOTPRINT footprint[1];
+    get_footprint(im, i, footprint);
+    enqueue(im, footprint);
+}
+
+// Local struct for visiting intersecting footprints.
+struct close_info {
+    INCREMENTAL_MERGE *im;
+    MARKER *markers;
+};
+
+static void add_intersecting_root(MARKER_ID i, void *env) {
+    struct close_info *close_info = env;
+    INCREMENTAL_MERGE *im = close_info->im;
+    if (!(im->marks[i] & PLANNED) && !mr_deleted_p(close_info->markers + i))
+        add_root(im, i);
+}
+
+// Plan to re-merge all clusters with footprints intersecting those in the queue,
+// transitively, emptying the queue.
+static void close_roots(INCREMENTAL_MERGE *im, MARKER *markers) {
+    struct close_info close_info[1] = {{ im, markers }};
+    for (MARKER_ID i = 0; i < im->n_queue; i++) {
+        FOOTPRINT *footprint = im->queue + i;
+        qt_overlapping(im->qt, footprint->x, footprint->y, footprint->r, add_intersecting_root, close_info);
+    }
+    im->n_queue = 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    MARKER_ID x = *(const MARKER_ID*)a;
+    MARKER_ID y = *(const MARKER_ID*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Find the leaves of the planned clusters, leaving them in ascending order.
+static void collect_leaves(INCREMENTAL_MERGE *im, MARKER *markers) {
+    im->n_leaves = 0;
+    for (MARKER_ID k = 0; k < im->n_roots; k++) {
+        // Use the end of the leaves array as a stack of markers to visit.
+        MARKER_ID n_stack = 1;
+        EnsureArraySize(im->leaves, im->max_leaves, im->n_leaves + n_stack);
+        if (allocation_failed_p())
+            return;
+        im->leaves[im->n_leaves] = im->roots[k];
+        while (n_stack > 0) {
+            MARKER_ID i = im->leaves[im->n_leaves + --n_stack];
+            MARKER *marker = markers + i;
+            if (mr_merged(marker)) {
+                EnsureArraySize(im->leaves, im->max_leaves, im->n_leaves + n_stack + 2);
+                if (allocation_failed_p())
+                    return;
+                im->leaves[im->n_leaves + n_stack++] = marker->part_a;
+                im->leaves[im->n_leaves + n_stack++] = marker->part_b;
+            } else if (!mr_removed_p(marker)) {
+                // The stack is above this point, so move it up one.
+                EnsureArraySize(im->leaves, im->max_leaves, im->n_leaves + n_stack + 1);
+                if (allocation_failed_p())
+                    return;
+                memmove(im->leaves + im->n_leaves + 1, im->leaves + im->n_leaves, n_stack * sizeof *im->leaves);
+                im->leaves[im->n_leaves++] = i;
+            }
+        }
+    }
+    qsort(im->leaves, im->n_leaves, sizeof *im->leaves, compare_ids);
+}
+
+// Merge the leaves of the planned clusters in a separate array and queue the
+// footprints of the resulting clusters.
+static void merge_leaves(INCREMENTAL_MERGE *im, MARKER_INFO *info, MARKER *markers, volatile int *cancel_p) {
+    MARKER_ID m = im->n_leaves;
+    MARKER_ID needed_size = m > 0 ? 2 * m - 1 : 1;
+    if (im->max_merged < needed_size) {
+        RenewArray(im->merged, needed_size);
+        RenewArray(im->merged_footprints, needed_size);
+        if (allocation_failed_p())
+            return;
+        im->max_merged = needed_size;
+    }
+    for (MARKER_ID t = 0; t < m; t++) {
+        im->merged[t] = markers[im->leaves[t]];
+        im->merged[t].deleted_p = 0;
+        mr_reset_parts(im->merged + t);
+    }
+    im->n_merged = merge_markers_fast(info, im->merged, m, cancel_p);
+    if (stopped_p(cancel_p))
+        return;
+    for (MARKER_ID t = 0; t < im->n_merged; t++) {
+        set_footprint(im->merged_footprints, im->merged_footprints + t, im->merged + t);
+        if (!mr_deleted_p(im->merged + t))
+            enqueue(im, im->merged_footprints + t);
+    }
+}
+
+static void add_free_slot(INCREMENTAL_MERGE *im, MARKER_ID i) {
+    EnsureArraySize(im->free_slots, im->max_free, im->n_free + 1);
+    if (allocation_failed_p())
+        return;
+    im->free_slots[im->n_free++] = i;
+}
+
+// Find the first free slot not yet taken at or after position k of the free
+// list, or n_free if none is left. Taken slots point past themselves.
+static MARKER_ID find_free(MARKER_ID *next_free, MARKER_ID k) {
+    while (next_free[k] != k) {
+        next_free[k] = next_free[next_free[k]];
+        k = next_free[k];
+    }
+    return k;
+}
+
+// Take the first free slot after i, or return -1 if there's none.
+static MARKER_ID take_free_slot(INCREMENTAL_MERGE *im, MARKER_ID i) {
+    MARKER_ID lo = 0, hi = im->n_free;
+    while (lo < hi) {
+        MARKER_ID mid = lo + (hi - lo) / 2;
+        if (im->free_slots[mid] <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    MARKER_ID k = find_free(im->next_free, lo);
+    if (k == im->n_free)
+        return -1;
+    im->next_free[k] = k + 1;
+    return im->free_slots[k];
+}
+
+// Choose where the merged markers go. Leaves return to their own places. Each
+// new merged marker takes the first free slot after both its parts, so parts
+// still precede what they're merged into, or else goes at the end. Returns
+// the new number of markers. The slots and next_free arrays must be big enough.
+static MARKER_ID place_merged(INCREMENTAL_MERGE *im, MARKER_ID n_markers) {
+    MARKER_ID m = im->n_leaves;
+    qsort(im->free_slots, im->n_free, sizeof *im->free_slots, compare_ids);
+    for (MARKER_ID k = 0; k <= im->n_free; k++)
+        im->next_free[k] = k;
+    for (MARKER_ID t = 0; t < m; t++)
+        im->slots[t] = im->leaves[t];
+    MARKER_ID new_size = n_markers;
+    for (MARKER_ID t = m; t < im->n_merged; t++) {
+        MARKER *marker = im->merged + t;
+        MARKER_ID a = im->slots[marker->part_a], b = im->slots[marker->part_b];
+        MARKER_ID i = take_free_slot(im, a > b ? a : b);
+        im->slots[t] = i >= 0 ? i : new_size++;
+    }
+    // Keep the slots left free.
+    MARKER_ID n_free = 0;
+    for (MARKER_ID k = 0; k < im->n_free; k++)
+        if (im->next_free[k] == k)
+            im->free_slots[n_free++] = im->free_slots[k];
+    im->n_free = n_free;
+    return new_size;
+}
+
+void im_init(INCREMENTAL_MERGE *im) {
+    im->size = im->max_size = 0;
+    im->parents = NULL;
+    mg_init(im->footprints);
+    im->marks = NULL;
+    qt_init(im->qt);
+    mr_info_init(im->qt_info);
+    im->dirty = NULL;
+    im->n_dirty = im->max_dirty = 0;
+    im->roots = NULL;
+    im->n_roots = im->max_roots = 0;
+    im->leaves = NULL;
+    im->n_leaves = im->max_leaves = 0;
+    im->merged = NULL;
+    im->merged_footprints = NULL;
+    im->n_merged = im->max_merged = 0;
+    im->queue = NULL;
+    im->n_queue = im->max_queue = 0;
+    im->free_slots = NULL;
+    im->n_free = im->max_free = 0;
+    im->slots = NULL;
+    im->max_slots = 0;
+    im->next_free = NULL;
+    im->max_next_free = 0;
+}
+
+void im_clear(INCREMENTAL_MERGE *im) {
+    Free(im->parents);
+    mg_clear(im->footprints);
+    Free(im->marks);
+    qt_clear(im->qt);
+    Free(im->dirty);
+    Free(im->roots);
+    Free(im->leaves);
+    Free(im->merged);
+    Free(im->merged_footprints);
+    Free(im->queue);
+    Free(im->free_slots);
+    Free(im->slots);
+    Free(im->next_free);
+    im_init(im);
+}
+
+int im_prepare(INCREMENTAL_MERGE *im, MARKER *markers, MARKER_ID n_markers) {
+    im_clear(im);
+    if (reserve(im, n_markers) != 0)
+        return -1;
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        im->parents[i] = -1;
+        im->marks[i] = 0;
+    }
+    // Parts precede what they're merged into, so their footprints are ready first.
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        MARKER *marker = markers + i;
+        FOOTPRINT footprint[1];
+        set_box(footprint, marker);
+        if (mr_merged(marker)) {
+            FOOTPRINT part[1];
+            im->parents[marker->part_a] = im->parents[marker->part_b] = i;
+            get_footprint(im, marker->part_a, part);
+            cover(footprint, part);
+            get_footprint(im, marker->part_b, part);
+            cover(footprint, part);
+        }
+        put_footprint(im, i, footprint);
+        if (mr_discarded_p(marker))
+            add_free_slot(im, i);
+    }
+    im->size = n_markers;
+    rebuild_qt(im, markers);
+    if (allocation_failed_p()) {
+        im_clear(im);
+        return -1;
+    }
+    return 0;
+}
+
+void im_touch(INCREMENTAL_MERGE *im, MARKER_ID i) {
+    if (i < im->size) {
+        EnsureArraySize(im->dirty, im->max_dirty, im->n_dirty + 1);
+        im->dirty[im->n_dirty++] = i;
+    }
+}
+
+// Clear the PLANNED marks of the planned clusters.
+static void unmark_roots(INCREMENTAL_MERGE *im) {
+    for (MARKER_ID k = 0; k < im->n_roots; k++)
+        im->marks[im->roots[k]] &= ~PLANNED;
+}
+
+MARKER_ID im_plan(INCREMENTAL_MERGE *im, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers, volatile int *cancel_p) {
+    // Cover new leaves. They stay beyond im->size until the commit, so a plan
+    // that's never committed leaves them new.
+    MARKER_ID old_size = im->size;
+    im->n_roots = im->n_queue = 0;
+    if (reserve(im, n_markers) != 0)
+        return -1;
+    for (MARKER_ID i = old_size; i < n_markers; i++) {
+        FOOTPRINT footprint[1];
+        im->parents[i] = -1;
+        im->marks[i] = 0;
+        set_box(footprint, markers + i);
+        put_footprint(im, i, footprint);
+    }
+
+    // Plan to re-merge clusters holding changed leaves and the new leaves.
+    for (MARKER_ID k = 0; k < im->n_dirty; k++) {
+        MARKER_ID i = im->dirty[k];
+        MARKER_ID root = root_of(im, i);
+        if (!(im->marks[root] & PLANNED))
+            add_root(im, root);
+        // A moved leaf may now touch other clusters.
+        if (!mr_removed_p(markers + i)) {
+            FOOTPRINT box[1];
+            set_box(box, markers + i);
+            enqueue(im, box);
+        }
+    }
+    for (MARKER_ID i = old_size; i < n_markers; i++)
+        if (!mr_removed_p(markers + i))
+            add_root(im, i);
+
+    // Add clusters with intersecting footprints until the merged footprints
+    // intersect no others.
+    while (!stopped_p(cancel_p)) {
+        close_roots(im, markers);
+        collect_leaves(im, markers);
+        merge_leaves(im, info, markers, cancel_p);
+        MARKER_ID n_roots = im->n_roots;
+        close_roots(im, markers);
+        if (im->n_roots == n_roots)
+            break;
+    }
+    // The marks are needed only while planning, so the plan can be dropped.
+    unmark_roots(im);
+    return stopped_p(cancel_p) ? -1 : im->n_merged - im->n_leaves;
+}
+
+MARKER_ID im_commit(INCREMENTAL_MERGE *im, MARKER *markers, MARKER_ID n_markers) {
+    MARKER_ID m = im->n_leaves;
+    MARKER_ID new_size = n_markers + im->n_merged - m;
+    MARKER_ID old_n_free = im->n_free;
+    if (reserve(im, new_size) != 0) {
+        im_clear(im);
+        return -1;
+    }
+
+    // Remove the planned clusters from the quadtree and find their merged
+    // markers, to be discarded.
+    for (MARKER_ID k = 0; k < im->n_roots && !allocation_failed_p(); k++) {
+        MARKER_ID root = im->roots[k];
+        if (im->marks[root] & IN_QT)
+            qt_delete(im->qt, root);
+        im->marks[root] = 0;
+        MARKER_ID n_stack = 0;
+        EnsureArraySize(im->leaves, im->max_leaves, m + 1);
+        if (allocation_failed_p())
+            break;
+        im->leaves[m + n_stack++] = root;
+        while (n_stack > 0) {
+            MARKER_ID i = im->leaves[m + --n_stack];
+            MARKER *marker = markers + i;
+            im->parents[i] = -1;
+            if (mr_merged(marker)) {
+                EnsureArraySize(im->leaves, im->max_leaves, m + n_stack + 2);
+                add_free_slot(im, i);
+                if (allocation_failed_p())
+                    break;
+                im->leaves[m + n_stack++] = marker->part_a;
+                im->leaves[m + n_stack++] = marker->part_b;
+            }
+        }
+    }
+    EnsureArraySize(im->slots, im->max_slots, im->n_merged);
+    EnsureArraySize(im->next_free, im->max_next_free, im->n_free + 1);
+    if (allocation_failed_p()) {
+        im_clear(im);
+        return -1;
+    }
+
+    // Nothing is allocated from here until the quadtree is updated. Discard
+    // the merged markers found and copy back the merge result.
+    for (MARKER_ID k = old_n_free; k < im->n_free; k++)
+        mr_set_discarded(markers + im->free_slots[k]);
+    new_size = place_merged(im, n_markers);
+    #define MAPPED(T) (im->slots[T])
+    for (MARKER_ID t = 0; t < im->n_merged; t++) {
+        MARKER_ID i = MAPPED(t);
+        MARKER *marker = markers + i;
+        *marker = im->merged[t];
+        im->parents[i] = -1;
+        im->marks[i] = 0;
+        put_footprint(im, i, im->merged_footprints + t);
+        if (mr_merged(marker)) {
+            marker->part_a = MAPPED(marker->part_a);
+            marker->part_b = MAPPED(marker->part_b);
+            im->parents[marker->part_a] = im->parents[marker->part_b] = i;
+        }
+    }
+    im->size = new_size;
+    for (MARKER_ID t = 0; t < im->n_merged && !allocation_failed_p(); t++)
+        if (!mr_deleted_p(im->merged + t))
+            insert_footprint(im, markers, MAPPED(t));
+    #undef MAPPED
+
+    im->n_dirty = im->n_roots = 0;
+    // The markers are merged, but without the quadtree the next change must
+    // prepare again.
+    if (allocation_failed_p())
+        im_clear(im);
+    return new_size;
+}
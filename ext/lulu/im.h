@@ -0,0 +1,99 @@
+/*
+ * im.h
+ *
+ * Incremental merging. After markers are merged, some leaves (unmerged
+ * markers) may be moved or removed, and new ones added. Re-merging then
+ * redoes only the merges that could be affected by the changes.
+ *
+ * Each marker has a footprint: a square covering the marker and every marker
+ * merged to form it. If the footprints of two clusters don't intersect, no
+ * markers of one ever overlapped markers of the other, so neither could affect
+ * how the other was merged. Re-merging discards the merge trees of clusters
+ * holding changed leaves, along with the closure of clusters whose footprints
+ * intersect theirs before or after re-merging. Then it merges just their
+ * leaves. The result is the same as merging the whole list again, except
+ * possibly for which of exactly equal distances is taken first.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef IM_H_
+#define IM_H_
+
+#include "namespace.h"
+#include "marker.h"
+#include "qt.h"
+
+// A square given by center and half-side.
+typedef struct footprint_s {
+    MARKER_COORD x, y;
+    MARKER_DISTANCE r;
+} FOOTPRINT;
+
+typedef struct incremental_merge_s {
+    MARKER_ID size, max_size;   // markers covered by the arrays below, and their allocated size
+    MARKER_ID *parents;         // merged marker each marker is part of, or -1
+    MARKER_GEOMETRY footprints[1]; // footprint squares; deleted bits are unused
+    unsigned char *marks;       // flag bits for each marker
+    QUADTREE qt[1];             // footprints of clusters, i.e. undeleted markers
+    MARKER_INFO qt_info[1];
+    MARKER_ID *dirty;           // leaves moved or removed since the last merge
+    MARKER_ID n_dirty, max_dirty;
+    // The plan made by im_plan and carried out by im_commit.
+    MARKER_ID *roots;           // clusters to be re-merged
+    MARKER_ID n_roots, max_roots;
+    MARKER_ID *leaves;          // their leaves in ascending order
+    MARKER_ID n_leaves, max_leaves;
+    MARKER *merged;             // leaves merged in a separate array
+    FOOTPRINT *merged_footprints; // and their footprints
+    MARKER_ID n_merged, max_merged;
+    FOOTPRINT *queue;           // footprints to check for intersections
+    MARKER_ID n_queue, max_queue;
+    MARKER_ID *free_slots;      // places of discarded merged markers in ascending order
+    MARKER_ID n_free, max_free;
+    MARKER_ID *slots;           // places of the merged markers of the commit
+    MARKER_ID max_slots;
+    MARKER_ID *next_free;       // for each free slot, the first not yet taken at or after it
+    MARKER_ID max_next_free;
+} INCREMENTAL_MERGE;
+
+#define INCREMENTAL_MERGE_DECL(Name) INCREMENTAL_MERGE Name[1]; im_init(Name)
+
+#define im_init(Im) NAME(im_init)(Im)
+void im_init(INCREMENTAL_MERGE *im);
+
+#define im_clear(Im) NAME(im_clear)(Im)
+void im_clear(INCREMENTAL_MERGE *im);
+
+#define im_prepared_p(Im) ((Im)->size > 0)
+
+// Set up for incremental merging of the given merge result. Returns 0, or -1
+// if allocation failed with an allocation flag, leaving it unprepared.
+#define im_prepare(Im, Markers, NMarkers) NAME(im_prepare)(Im, Markers, NMarkers)
+int im_prepare(INCREMENTAL_MERGE *im, MARKER *markers, MARKER_ID n_markers);
+
+// Record that a leaf covered by a prepared merge has moved or will be removed.
+// This must be called before its position changes.
+#define im_touch(Im, I) NAME(im_touch)(Im, I)
+void im_touch(INCREMENTAL_MERGE *im, MARKER_ID i);
+
+// Plan a re-merge of the given markers, where any after the prepared ones are
+// new leaves. Returns the number of markers the merge will add to the array.
+// Nothing changes until the commit, so a plan may be dropped. Returns -1 if
+// *cancel_p is set, when cancel_p isn't NULL, or allocation failed with an
+// allocation flag.
+#define im_plan(Im, Info, Markers, NMarkers, CancelP) NAME(im_plan)(Im, Info, Markers, NMarkers, CancelP)
+MARKER_ID im_plan(INCREMENTAL_MERGE *im, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers, volatile int *cancel_p);
+
+// Carry out the planned re-merge. The marker array must have room for the
+// markers the plan said it adds, though it adds fewer if it can put merged
+// markers in the places of ones discarded now or before. Parts still precede
+// what they're merged into. The new number of markers is returned. If
+// allocation fails with an allocation flag, the incremental merge is cleared
+// and must be prepared again. Then -1 is returned if the markers are as they
+// were, and the changes since the last merge are lost.
+#define im_commit(Im, Markers, NMarkers) NAME(im_commit)(Im, Markers, NMarkers)
+MARKER_ID im_commit(INCREMENTAL_MERGE *im, MARKER *markers, MARKER_ID n_markers);
+
+#endif /* IM_H_ */
@@ -11,30 +11,109 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "ruby.h"
+#include "ruby/thread.h"
 #include "utility.h"
 #include "marker.h"
 #include "merger.h"
+#include "mt.h"
+#include "mf.h"
 #include "pq.h"
 #include "qt.h"
+#include "si.h"
+#include "im.h"
 
+#ifndef LULU_FLOAT32
 static char EXT_VERSION[] = "0.1.2";
 
+// Directive of String#unpack for the marker indices of packed_parts and level_clusters.
+#ifdef LULU_INDEX64
+static char INDEX_FORMAT[] = "q";
+#else
+static char INDEX_FORMAT[] = "l";
+#endif
+#endif
+
+// Convert marker indices to and from Ruby integers. See MARKER_ID.
+#ifdef LULU_INDEX64
+#define NUM2MARKER_ID(V)    NUM2LL(V)
+#define MARKER_ID2NUM(I)    LL2NUM(I)
+#else
+#define NUM2MARKER_ID(V)    NUM2INT(V)
+#define MARKER_ID2NUM(I)    INT2NUM(I)
+#endif
+
 // -------- C marker list to be wrapped in a Ruby object -----------------------
 
+// One level of a zoom pyramid: the compressed merged markers at the level's
+// scale and, for each marker of the next finer level's markers, the index
+// of the marker here that it was merged into. The finest level's clusters
+// are indexed by the markers in the list after compression.
+typedef struct pyramid_level_s {
+    MARKER_DISTANCE scale;
+    MARKER *markers;
+    MARKER_ID size;
+    MARKER_ID *clusters;
+    MARKER_ID n_clusters;
+} PYRAMID_LEVEL;
+
 typedef struct marker_list_s {
     MARKER_INFO info[1];
     MARKER *markers;
-    int size, max_size;
+    MARKER_ID size, max_size;
+    int merging_p;  // Non-zero while a merge is running without the GVL.
+    PYRAMID_LEVEL *levels;
+    int n_levels;
+    SPATIAL_INDEX index[1]; // Built by merge, cleared when markers change.
+    INCREMENTAL_MERGE incremental[1];
+    MARKER_ID merged_size;  // Markers after the last merge, or 0 if remerge must start over.
+    double approximation_error; // Of the last merge, 0 unless it was approximate.
+#ifdef LULU_MERGE_STATS
+    MERGE_STATS stats[1];   // Work done by the last merge.
+#endif
+    MERGE_WORKSPACE workspace[1]; // Kept from merge to merge until released.
+    FILE *trace;            // Where merges record their steps, or NULL. See mt.h.
+    void *mapping;          // Marker file holding the markers, or NULL. See mf.h.
+    size_t mapping_size;
 } MARKER_LIST;
 
 #define MARKER_LIST_DECL(Name)  MARKER_LIST Name[1]; init_marker_list(Name)
 #define ml_set_marker_list_info(L, Kind, Scale)  mr_info_set((L)->info, (Kind), (Scale))
 
+// Threads a merge may use unless set_info says otherwise, from environment
+// variable LULU_THREADS, else 1.
+static int default_thread_count(void) {
+    const char *threads = getenv("LULU_THREADS");
+    int n_threads = threads ? atoi(threads) : 1;
+    return n_threads > 0 ? n_threads : 1;
+}
+
 static void init_marker_list(MARKER_LIST *list) {
     mr_info_init(list->info);
+    list->info->n_threads = default_thread_count();
     list->markers = NULL;
     list->size = list->max_size = 0;
+    list->merging_p = 0;
+    list->levels = NULL;
+    list->n_levels = 0;
+    si_init(list->index);
+    im_init(list->incremental);
+    list->merged_size = 0;
+    list->approximation_error = 0;
+#ifdef LULU_MERGE_STATS
+    stats_clear(list->stats);
+#endif
+    merge_workspace_init(list->workspace);
+    list->trace = NULL;
+    list->mapping = NULL;
+    list->mapping_size = 0;
 }
 
 static MARKER_LIST *new_marker_list(void) {
@@ -43,8 +122,72 @@ static MARKER_LIST *new_marker_list(void) {
     return list;
 }
 
+static void clear_pyramid(MARKER_LIST *list) {
+    for (int i = 0; i < list->n_levels; i++) {
+        Free(list->levels[i].markers);
+        Free(list->levels[i].clusters);
+    }
+    Free(list->levels);
+    list->n_levels = 0;
+}
+
+static void copy_pyramid(MARKER_LIST *dst, MARKER_LIST *src) {
+    dst->n_levels = src->n_levels;
+    NewArray(dst->levels, dst->n_levels);
+    for (int i = 0; i < dst->n_levels; i++) {
+        PYRAMID_LEVEL *d = dst->levels + i;
+        PYRAMID_LEVEL *s = src->levels + i;
+        *d = *s;
+        NewArray(d->markers, d->size);
+        CopyArray(d->markers, s->markers, d->size);
+        NewArray(d->clusters, d->n_clusters);
+        CopyArray(d->clusters, s->clusters, d->n_clusters);
+    }
+}
+
+static void close_trace(MARKER_LIST *list) {
+    if (list->trace) {
+        fclose(list->trace);
+        list->trace = NULL;
+    }
+}
+
+// Replace the marker array, freeing or unmapping the old one.
+static void set_markers(MARKER_LIST *list, MARKER *markers) {
+    if (list->mapping) {
+        mf_unmap(list->mapping, list->mapping_size);
+        list->mapping = NULL;
+    } else
+        Free(list->markers);
+    list->markers = markers;
+}
+
+// Resize the marker array to the given max_size, first copying the markers
+// out of their marker file if they're mapped from one. Return 0, or -1 if
+// allocation fails with an allocation flag, leaving the array as it was.
+static int renew_markers(MARKER_LIST *list, MARKER_ID max_size) {
+    if (list->mapping) {
+        NewArrayDecl(MARKER, markers, max_size);
+        if (!markers)
+            return -1;
+        CopyArray(markers, list->markers, list->size);
+        set_markers(list, markers);
+    } else {
+        RenewArray(list->markers, max_size);
+        if (allocation_failed_p())
+            return -1;
+    }
+    list->max_size = max_size;
+    return 0;
+}
+
 static void clear_marker_list(MARKER_LIST *list) {
-    Free(list->markers);
+    close_trace(list);
+    set_markers(list, NULL);
+    clear_pyramid(list);
+    si_clear(list->index);
+    im_clear(list->incremental);
+    merge_workspace_clear(list->workspace);
     init_marker_list(list);
 }
 
@@ -53,26 +196,104 @@ static void free_marker_list(MARKER_LIST *list) {
     Free(list);
 }
 
-static void add_marker(MARKER_LIST *list, MARKER_COORD x, MARKER_COORD y, MARKER_SIZE size) {
-    if (list->size >= list->max_size) {
-        list->max_size = 4 + 2 * list->max_size;
-        RenewArray(list->markers, list->max_size);
+// Make room for at least n_more markers beyond the current size. Return 0,
+// or -1 as renew_markers.
+static int reserve_markers(MARKER_LIST *list, MARKER_ID n_more) {
+    MARKER_ID needed_size = list->size + n_more;
+    if (list->max_size < needed_size) {
+        // Doubling stops at the most a merge can use.
+        MARKER_ID new_max_size = list->max_size < MR_MAX_MARKERS - 2
+                ? 4 + 2 * list->max_size : 2 * MR_MAX_MARKERS - 1;
+        return renew_markers(list, new_max_size < needed_size ? needed_size : new_max_size);
     }
+    return 0;
+}
+
+static void add_marker(MARKER_LIST *list, MARKER_COORD x, MARKER_COORD y, MARKER_SIZE size) {
+    si_clear(list->index);
+    reserve_markers(list, 1);
     MARKER *marker = list->markers + list->size++;
     mr_set(list->info, marker, x, y, size);
 }
 
-static void ensure_headroom(MARKER_LIST *list) {
-    int needed_size = 2 * list->size - 1;
-    if (list->max_size < needed_size) {
-        list->max_size = needed_size;
-        RenewArray(list->markers, list->max_size);
+// Layouts of packed binary marker data. Values are in native byte order,
+// either interleaved x,y,size triples or three columns: all x's, then all
+// y's, then all sizes.
+typedef enum packed_layout_e {
+    PACKED_DOUBLE,
+    PACKED_FLOAT,
+    PACKED_DOUBLE_COLUMNS,
+    PACKED_FLOAT_COLUMNS,
+} PACKED_LAYOUT;
+
+#define packed_layout_float_p(L)    ((L) == PACKED_FLOAT || (L) == PACKED_FLOAT_COLUMNS)
+#define packed_layout_columns_p(L)  ((L) == PACKED_DOUBLE_COLUMNS || (L) == PACKED_FLOAT_COLUMNS)
+#define packed_layout_value_size(L) (packed_layout_float_p(L) ? sizeof(float) : sizeof(double))
+
+// Fetch the i'th packed value.  Buffers need not be aligned.
+static double get_packed_value(const char *buf, int float_p, size_t i) {
+    if (float_p) {
+        float f;
+        memcpy(&f, buf + i * sizeof f, sizeof f);
+        return f;
+    }
+    double d;
+    memcpy(&d, buf + i * sizeof d, sizeof d);
+    return d;
+}
+
+// Store the i'th packed value.
+static void put_packed_value(char *buf, int float_p, size_t i, double val) {
+    if (float_p) {
+        float f = (float)val;
+        memcpy(buf + i * sizeof f, &f, sizeof f);
+    } else {
+        memcpy(buf + i * sizeof val, &val, sizeof val);
+    }
+}
+
+// Append n markers from a packed buffer with given layout. Capacity is reserved once.
+static void add_packed_markers(MARKER_LIST *list, const char *buf, MARKER_ID n, PACKED_LAYOUT layout) {
+    si_clear(list->index);
+    reserve_markers(list, n);
+    MARKER *markers = list->markers + list->size;
+    int float_p = packed_layout_float_p(layout);
+    if (packed_layout_columns_p(layout)) {
+        size_t n_values = n;
+        for (MARKER_ID i = 0; i < n; i++)
+            mr_set(list->info, markers + i,
+                    get_packed_value(buf, float_p, i),
+                    get_packed_value(buf, float_p, n_values + i),
+                    get_packed_value(buf, float_p, 2 * n_values + i));
+    } else {
+        for (MARKER_ID i = 0; i < n; i++) {
+            size_t j = 3 * (size_t)i;
+            mr_set(list->info, markers + i,
+                    get_packed_value(buf, float_p, j),
+                    get_packed_value(buf, float_p, j + 1),
+                    get_packed_value(buf, float_p, j + 2));
+        }
     }
+    list->size += n;
+}
+
+// Make room for a merge of the markers. Return 0, or -1 as renew_markers.
+static int ensure_headroom(MARKER_LIST *list) {
+    MARKER_ID needed_size = 2 * list->size - 1;
+    return list->max_size < needed_size ? renew_markers(list, needed_size) : 0;
+}
+
+// Forget the last merge, so the next remerge is a full merge.
+static void forget_merge(MARKER_LIST *list) {
+    im_clear(list->incremental);
+    list->merged_size = 0;
 }
 
 static void compress(MARKER_LIST *list) {
-    int dst = 0;
-    for (int src = 0; src < list->size; src++)
+    si_clear(list->index);
+    forget_merge(list);
+    MARKER_ID dst = 0;
+    for (MARKER_ID src = 0; src < list->size; src++)
         if (!mr_deleted_p(list->markers + src)) {
             if (src != dst)
                 list->markers[dst] = list->markers[src];
@@ -82,18 +303,158 @@ static void compress(MARKER_LIST *list) {
     list->size = dst;
 }
 
+// Undo a partial merge of the given number of markers, returning
+// them to the state after compress.
+static void unmerge(MARKER_LIST *list, MARKER_ID n_markers) {
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        list->markers[i].deleted_p = 0;
+    list->size = n_markers;
+}
+
+// Add a pyramid level for the given merge result of n_inputs markers, which
+// is compressed in place. Return 0, or -1 if allocation fails.
+static int add_pyramid_level(MARKER_LIST *list, MARKER_INFO *info,
+        MARKER *markers, MARKER_ID n_inputs, MARKER_ID n_markers) {
+    PYRAMID_LEVEL *level = list->levels + list->n_levels++;
+    level->scale = info->scale;
+    level->n_clusters = n_inputs;
+    level->size = 0;
+    level->markers = NULL;
+    NewArray(level->clusters, n_inputs);
+    if (allocation_failed_p())
+        return -1;
+    level->size = merge_clusters(markers, n_inputs, n_markers, level->clusters);
+    if (level->size < 0) {
+        level->size = 0;
+        return -1;
+    }
+    NewArray(level->markers, level->size);
+    if (allocation_failed_p())
+        return -1;
+    MARKER_ID j = 0;
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        if (!mr_deleted_p(markers + i)) {
+            level->markers[j] = markers[i];
+            mr_reset_parts(level->markers + j);
+            j++;
+        }
+    return 0;
+}
+
+// Merge the list, then repeatedly merge the result with marker radii scaled up by
+// the given factor to build a pyramid with the given number of levels. The list
+// is left as after merge, which is also the finest level of the pyramid. A
+// canceled merge, which includes one where allocation fails, stops early.
+static void merge_pyramid(MARKER_LIST *list, int n_levels, MARKER_DISTANCE scale_factor,
+        volatile int *cancel_p) {
+    clear_pyramid(list);
+    NewArray(list->levels, n_levels);
+    if (!list->levels)
+        return;
+
+    MARKER_ID n_inputs = list->size;
+    list->size = merge_markers_in(list->workspace, list->info, list->markers, n_inputs, cancel_p);
+    if (*cancel_p || add_pyramid_level(list, list->info, list->markers, n_inputs, list->size) != 0)
+        return;
+
+    // Coarser levels start from the compressed markers of the previous level,
+    // so this buffer is big enough for all of them.
+    MARKER_INFO info[1] = { *list->info };
+    MARKER_ID max_size = 2 * list->levels[0].size - 1;
+    NewArrayDecl(MARKER, markers, max_size > 0 ? max_size : 1);
+    if (!markers)
+        return;
+    while (list->n_levels < n_levels && !*cancel_p) {
+        PYRAMID_LEVEL *prev = list->levels + list->n_levels - 1;
+        mr_info_set(info, info->kind, info->scale * scale_factor);
+        n_inputs = prev->size;
+        CopyArray(markers, prev->markers, n_inputs);
+        for (MARKER_ID i = 0; i < n_inputs; i++)
+            markers[i].r = size_to_radius(info, markers[i].size);
+        MARKER_ID n_markers = merge_markers_in(list->workspace, info, markers, n_inputs, cancel_p);
+        if (*cancel_p || add_pyramid_level(list, info, markers, n_inputs, n_markers) != 0)
+            break;
+    }
+    Free(markers);
+}
+
+// Pack x,y,size of all undeleted markers into a buffer with room for list->size
+// markers in the given layout. Returns the number packed.
+static MARKER_ID get_packed_markers(MARKER_LIST *list, char *buf, PACKED_LAYOUT layout) {
+    int float_p = packed_layout_float_p(layout);
+    int columns_p = packed_layout_columns_p(layout);
+    size_t stride = columns_p ? 1 : 3;
+    size_t column_offset = columns_p ? list->size : 1;
+    size_t j = 0;
+    for (MARKER_ID i = 0; i < list->size; i++) {
+        MARKER *marker = list->markers + i;
+        if (!mr_deleted_p(marker)) {
+            put_packed_value(buf, float_p, j, mr_x(marker));
+            put_packed_value(buf, float_p, j + column_offset, mr_y(marker));
+            put_packed_value(buf, float_p, j + 2 * column_offset, marker->size);
+            j += stride;
+        }
+    }
+    MARKER_ID n = (MARKER_ID)(j / stride);
+    if (columns_p && n < list->size) {
+        // Close the gaps left by deleted markers at the ends of the x and y columns.
+        size_t value_size = packed_layout_value_size(layout);
+        memmove(buf + n * value_size, buf + list->size * value_size, n * value_size);
+        memmove(buf + 2 * n * value_size, buf + 2 * list->size * value_size, n * value_size);
+    }
+    return n;
+}
+
+// Pack part_a, part_b, and the deleted flag of every marker as MARKER_ID triples.
+static void get_packed_parts(MARKER_LIST *list, MARKER_ID *buf) {
+    for (MARKER_ID i = 0; i < list->size; i++) {
+        MARKER *marker = list->markers + i;
+        *buf++ = marker->part_a;
+        *buf++ = marker->part_b;
+        *buf++ = mr_deleted_p(marker);
+    }
+}
+
 // -------- Ruby API implementation --------------------------------------------
 
+// Bytes of allocations last reported to Ruby's GC.
+static size_t reported_size = 0;
+
+// Report the change in memory held by the gem's allocators to Ruby's GC. They
+// don't use xmalloc, which merges without the GVL can't, so the GC wouldn't
+// otherwise count big marker arrays and workspaces toward collecting dropped
+// lists. Called with the GVL at the start of each call on a list and the end
+// of those that add markers or merge, so frees are noted by the next call.
+static void report_memory(void) {
+    size_t size = allocated_size();
+    if (size != reported_size) {
+        rb_gc_adjust_memory_usage((ssize_t)(size - reported_size));
+        // Ruby checks the count against its limit only on its own next
+        // malloc, so make one now in case the program makes few.
+        if (size > reported_size)
+            xfree(xmalloc(1));
+        reported_size = size;
+    }
+}
+
 static void lulu_rb_api_free_marker_list(void *list) {
     free_marker_list(list);
 }
 
 static VALUE lulu_rb_api_new_marker_list(VALUE klass) {
+    report_memory();
     MARKER_LIST *list = new_marker_list();
     return Data_Wrap_Struct(klass, 0, lulu_rb_api_free_marker_list, list);
 }
 
-#define MARKER_LIST_FOR_VALUE_DECL(Var) MARKER_LIST *Var; Data_Get_Struct(Var ## _value, MARKER_LIST, Var)
+// Raise an exception if the list is being merged by another thread.
+static void check_not_merging(MARKER_LIST *list) {
+    if (list->merging_p)
+        rb_raise(rb_eRuntimeError, "marker list is being merged");
+}
+
+#define MARKER_LIST_FOR_VALUE_DECL(Var) \
+    MARKER_LIST *Var; Data_Get_Struct(Var ## _value, MARKER_LIST, Var); check_not_merging(Var); report_memory()
 
 static VALUE lulu_rb_api_initialize_copy(VALUE dst_value, VALUE src_value)
 #define ARGC_initialize_copy 1
@@ -107,10 +468,21 @@ static VALUE lulu_rb_api_initialize_copy(VALUE dst_value, VALUE src_value)
     MARKER_LIST_FOR_VALUE_DECL(src);
     MARKER_LIST_FOR_VALUE_DECL(dst);
 
-    // Shallow copy contents, then deep copy array of markers.
+    // Shallow copy contents, then deep copy array of markers and pyramid.
     *dst = *src;
     NewArray(dst->markers, dst->max_size);
     CopyArray(dst->markers, src->markers, dst->max_size);
+    dst->mapping = NULL;
+    copy_pyramid(dst, src);
+    si_init(dst->index);
+    // Leaves may have moved since the last merge, so the copy's
+    // incremental merge can only be prepared if none have.
+    im_init(dst->incremental);
+    merge_workspace_init(dst->workspace);
+    dst->trace = NULL;
+    if (src->incremental->n_dirty > 0)
+        dst->merged_size = 0;
+    report_memory();
 
     return dst_value;
 }
@@ -123,10 +495,21 @@ static VALUE lulu_rb_api_clear(VALUE self_value)
     return self_value;
 }
 
-static VALUE lulu_rb_api_set_info(VALUE self_value, VALUE kind_value, VALUE scale_value)
-#define ARGC_set_info 2
+// Free the memory merges keep for the next merge.
+static VALUE lulu_rb_api_release_workspace(VALUE self_value)
+#define ARGC_release_workspace 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    merge_workspace_clear(self->workspace);
+    return self_value;
+}
+
+static VALUE lulu_rb_api_set_info(int argc, VALUE *argv, VALUE self_value)
+#define ARGC_set_info -1
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
+    VALUE kind_value, scale_value, index_value, threads_value;
+    rb_scan_args(argc, argv, "22", &kind_value, &scale_value, &index_value, &threads_value);
 
     // Get the valid symbol values.
     VALUE square_sym = ID2SYM(rb_intern("square"));
@@ -139,31 +522,311 @@ static VALUE lulu_rb_api_set_info(VALUE self_value, VALUE kind_value, VALUE scal
     if (kind_as_sym != square_sym && kind_as_sym != circle_sym)
         rb_raise(rb_eTypeError, "invalid symbol for marker kind (set_info)");
 
+    // The optional index is :auto, :quadtree, :loose_quadtree, or :grid.
+    MARKER_INDEX index = INDEX_AUTO;
+    if (!NIL_P(index_value)) {
+        VALUE index_as_sym = rb_funcall(index_value, rb_intern("to_sym"), 0);
+        if (index_as_sym == ID2SYM(rb_intern("quadtree")))
+            index = INDEX_QUADTREE;
+        else if (index_as_sym == ID2SYM(rb_intern("loose_quadtree")))
+            index = INDEX_LOOSE_QUADTREE;
+        else if (index_as_sym == ID2SYM(rb_intern("grid")))
+            index = INDEX_GRID;
+        else if (index_as_sym != ID2SYM(rb_intern("auto")))
+            rb_raise(rb_eTypeError, "invalid symbol for merge index (set_info)");
+    }
+
+    // The optional thread count is at least 1.
+    int n_threads = NIL_P(threads_value) ? default_thread_count() : NUM2INT(threads_value);
+    if (n_threads < 1)
+        rb_raise(rb_eArgError, "thread count must be positive (set_info)");
+
     mr_info_set(self->info, kind_as_sym == square_sym ? SQUARE : CIRCLE, rb_num2dbl(scale_value));
+    self->info->index = index;
+    self->info->n_threads = n_threads;
+
+    // Radii of markers already added depend on the info.
+    si_clear(self->index);
+    forget_merge(self);
+    for (MARKER_ID i = 0; i < self->size; i++)
+        self->markers[i].r = size_to_radius(self->info, self->markers[i].size);
 
     return self_value;
 }
 
+// Whether adding the given number of markers would overflow the list.
+static int too_many_p(MARKER_LIST *list, long n) {
+    return n > MR_MAX_MARKERS - list->size;
+}
+
+// Raise an exception if adding the given number of markers would overflow the list.
+static void check_add_count(MARKER_LIST *list, long n) {
+    if (too_many_p(list, n))
+        rb_raise(rb_eRangeError, "too many markers");
+}
+
 static VALUE lulu_rb_api_add(VALUE self_value, VALUE x_value, VALUE y_value, VALUE size_value)
 #define ARGC_add 3
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
-    add_marker(self, rb_num2dbl(x_value), rb_num2dbl(y_value), rb_num2dbl(size_value));
-    return INT2FIX(self->size);
+    // Convert first, since to_f methods can change the list or start a merge.
+    double x = rb_num2dbl(x_value), y = rb_num2dbl(y_value), size = rb_num2dbl(size_value);
+    check_not_merging(self);
+    check_add_count(self, 1);
+    add_marker(self, x, y, size);
+    return MARKER_ID2NUM(self->size);
+}
+
+// Convert a layout symbol to its enum value, raising an exception if it's invalid.
+static PACKED_LAYOUT get_packed_layout(VALUE layout_value) {
+    static const struct {
+        const char *name;
+        PACKED_LAYOUT layout;
+    } layouts[] = {
+        { "double", PACKED_DOUBLE },
+        { "float", PACKED_FLOAT },
+        { "double_columns", PACKED_DOUBLE_COLUMNS },
+        { "float_columns", PACKED_FLOAT_COLUMNS },
+    };
+    VALUE layout_as_sym = rb_funcall(layout_value, rb_intern("to_sym"), 0);
+    for (int i = 0; i < STATIC_ARRAY_SIZE(layouts); i++)
+        if (layout_as_sym == ID2SYM(rb_intern(layouts[i].name)))
+            return layouts[i].layout;
+    rb_raise(rb_eArgError, "invalid symbol for packed layout");
+    return PACKED_DOUBLE; // not reached
+}
+
+static VALUE lulu_rb_api_add_packed(VALUE self_value, VALUE str_value, VALUE layout_value)
+#define ARGC_add_packed 2
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    PACKED_LAYOUT layout = get_packed_layout(layout_value);
+    StringValue(str_value);
+    long record_size = 3 * packed_layout_value_size(layout);
+    long len = RSTRING_LEN(str_value);
+    if (len % record_size != 0)
+        rb_raise(rb_eArgError, "packed string length is not a multiple of %ld", record_size);
+    check_add_count(self, len / record_size);
+    add_packed_markers(self, RSTRING_PTR(str_value), (MARKER_ID)(len / record_size), layout);
+    report_memory();
+    return MARKER_ID2NUM(self->size);
+}
+
+static VALUE lulu_rb_api_add_all(VALUE self_value, VALUE triples_value)
+#define ARGC_add_all 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    Check_Type(triples_value, T_ARRAY);
+    long n = RARRAY_LEN(triples_value);
+    check_add_count(self, n);
+    // Convert all the triples before touching the list. Conversions can call
+    // to_f methods that change the list, start a merge, or raise, when
+    // nothing is added.
+    VALUE buf_value = rb_str_new(NULL, 3 * n * (long)sizeof(double));
+    for (long i = 0; i < n; i++) {
+        VALUE triple = rb_ary_entry(triples_value, i);
+        Check_Type(triple, T_ARRAY);
+        if (RARRAY_LEN(triple) != 3)
+            rb_raise(rb_eArgError, "marker %ld is not an [x, y, size] triple", i);
+        double values[3];
+        for (int k = 0; k < 3; k++)
+            values[k] = rb_num2dbl(rb_ary_entry(triple, k));
+        memcpy(RSTRING_PTR(buf_value) + 3 * i * sizeof(double), values, sizeof values);
+    }
+    check_not_merging(self);
+    check_add_count(self, n);
+    add_packed_markers(self, RSTRING_PTR(buf_value), (MARKER_ID)n, PACKED_DOUBLE);
+    RB_GC_GUARD(buf_value);
+    report_memory();
+    return MARKER_ID2NUM(self->size);
+}
+
+// Bytes a CSV load reads at a time. The buffer grows for longer lines.
+#define CSV_BUFFER_SIZE (1 << 20)
+
+// State of a CSV load, freed by rb_ensure even if parsing raises.
+typedef struct csv_load_s {
+    MARKER_LIST *list;
+    const char *path;
+    FILE *f;
+    int cols[3];            // fields holding x, y, and size
+    int header_p;           // whether to skip the first line
+    char *buf;
+    size_t buf_size;
+} CSV_LOAD;
+
+// Parse x, y, and size from the given fields of a null-terminated CSV line,
+// which is changed. Return 0, or -1 if a field is missing or not a number.
+static int parse_csv_line(CSV_LOAD *load, char *p, double *values) {
+    int max_col = load->cols[0];
+    for (int k = 1; k < 3; k++)
+        if (load->cols[k] > max_col)
+            max_col = load->cols[k];
+    for (int col = 0; col <= max_col; col++) {
+        if (!p)
+            return -1;
+        char *comma = strchr(p, ',');
+        if (comma)
+            *comma = '\0';
+        for (int k = 0; k < 3; k++)
+            if (load->cols[k] == col) {
+                char *end;
+                values[k] = strtod(p, &end);
+                if (end == p)
+                    return -1;
+                while (*end == ' ' || *end == '\t' || *end == '\r')
+                    end++;
+                if (*end)
+                    return -1;
+            }
+        p = comma ? comma + 1 : NULL;
+    }
+    return 0;
+}
+
+// Read the file a buffer at a time, appending a marker for each line.
+static VALUE load_csv(VALUE load_value) {
+    CSV_LOAD *load = (CSV_LOAD*)load_value;
+    MARKER_LIST *list = load->list;
+    size_t n = 0;           // bytes in the buffer
+    long line_number = 0;
+    int eof_p = 0;
+    do {
+        // Leave room to terminate the last line.
+        if (n + 1 >= load->buf_size) {
+            load->buf_size *= 2;
+            RenewArray(load->buf, load->buf_size);
+        }
+        size_t n_read = fread(load->buf + n, 1, load->buf_size - n - 1, load->f);
+        if (n_read == 0) {
+            if (ferror(load->f))
+                rb_sys_fail(load->path);
+            eof_p = 1;
+        }
+        n += n_read;
+        char *line = load->buf, *limit = load->buf + n;
+        while (line < limit) {
+            char *newline = memchr(line, '\n', limit - line);
+            if (!newline) {
+                if (!eof_p)
+                    break;
+                newline = limit;
+            }
+            *newline = '\0';
+            line_number++;
+            if (!(line_number == 1 && load->header_p) && line[strspn(line, " \t\r")]) {
+                double values[3];
+                if (parse_csv_line(load, line, values) != 0)
+                    rb_raise(rb_eArgError, "bad marker at %s:%ld (load_csv)", load->path, line_number);
+                check_add_count(list, 1);
+                reserve_markers(list, 1);
+                mr_set(list->info, list->markers + list->size++, values[0], values[1], values[2]);
+            }
+            line = newline + 1;
+        }
+        // Keep a partial last line for the next read.
+        n = line < limit ? limit - line : 0;
+        memmove(load->buf, line, n);
+    } while (!eof_p);
+    return Qnil;
+}
+
+static VALUE end_load_csv(VALUE load_value) {
+    CSV_LOAD *load = (CSV_LOAD*)load_value;
+    fclose(load->f);
+    Free(load->buf);
+    report_memory();
+    return Qnil;
+}
+
+// Make a list of the given class from a CSV file, one marker per line with
+// x, y, and size in the fields given by keyword cols:, by default [0, 1, 2].
+// With header: true, the first line is skipped. Blank lines are skipped.
+// Lines are parsed in place, so markers cost no Ruby objects.
+static VALUE lulu_rb_api_load_csv(int argc, VALUE *argv, VALUE klass)
+#define ARGC_load_csv -1
+{
+    VALUE path_value, options;
+    rb_scan_args(argc, argv, "1:", &path_value, &options);
+    ID keywords[2] = { rb_intern("cols"), rb_intern("header") };
+    VALUE values[2] = { Qundef, Qundef };
+    if (!NIL_P(options))
+        rb_get_kwargs(options, keywords, 0, 2, values);
+    CSV_LOAD load[1] = {{ NULL, StringValueCStr(path_value), NULL, { 0, 1, 2 }, 0, NULL, CSV_BUFFER_SIZE }};
+    if (values[0] != Qundef) {
+        Check_Type(values[0], T_ARRAY);
+        if (RARRAY_LEN(values[0]) != 3)
+            rb_raise(rb_eArgError, "cols must give fields of x, y, and size (load_csv)");
+        for (int k = 0; k < 3; k++)
+            if ((load->cols[k] = NUM2INT(rb_ary_entry(values[0], k))) < 0)
+                rb_raise(rb_eArgError, "cols must be non-negative (load_csv)");
+    }
+    load->header_p = values[1] != Qundef && RTEST(values[1]);
+
+    VALUE list_value = lulu_rb_api_new_marker_list(klass);
+    Data_Get_Struct(list_value, MARKER_LIST, load->list);
+    load->f = fopen(load->path, "r");
+    if (!load->f)
+        rb_sys_fail(load->path);
+    NewArray(load->buf, load->buf_size);
+    rb_ensure(load_csv, (VALUE)load, end_load_csv, (VALUE)load);
+    return list_value;
+}
+
+// Make a list of the given class from a file of packed markers in any layout
+// accepted by add_packed, given by keyword layout:. The file is mapped rather
+// than read, and its markers are appended with one allocation.
+static VALUE lulu_rb_api_load_binary(int argc, VALUE *argv, VALUE klass)
+#define ARGC_load_binary -1
+{
+    VALUE path_value, options;
+    rb_scan_args(argc, argv, "1:", &path_value, &options);
+    ID keywords[1] = { rb_intern("layout") };
+    VALUE values[1];
+    rb_get_kwargs(NIL_P(options) ? rb_hash_new() : options, keywords, 1, 0, values);
+    PACKED_LAYOUT layout = get_packed_layout(values[0]);
+    const char *path = StringValueCStr(path_value);
+
+    VALUE list_value = lulu_rb_api_new_marker_list(klass);
+    MARKER_LIST *list;
+    Data_Get_Struct(list_value, MARKER_LIST, list);
+    struct stat st[1];
+    if (stat(path, st) != 0)
+        rb_sys_fail(path);
+    long record_size = 3 * packed_layout_value_size(layout);
+    if (st->st_size % record_size != 0)
+        rb_raise(rb_eArgError, "packed file length is not a multiple of %ld (load_binary)", record_size);
+    long n = st->st_size / record_size;
+    if (n == 0)
+        return list_value;
+    check_add_count(list, n);
+    // Reserve before mapping, so running out of memory doesn't leak the mapping.
+    reserve_markers(list, (MARKER_ID)n);
+    size_t size;
+    char *data = mf_map(path, &size);
+    if (!data)
+        rb_sys_fail(path);
+    if (size == (size_t)st->st_size)
+        add_packed_markers(list, data, (MARKER_ID)n, layout);
+    mf_unmap(data, size);
+    if (list->size != n)
+        rb_raise(rb_eRuntimeError, "packed file changed while loading (load_binary)");
+    report_memory();
+    return list_value;
 }
 
 static VALUE lulu_rb_api_length(VALUE self_value)
 #define ARGC_length 0
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
-    return INT2FIX(self->size);
+    return MARKER_ID2NUM(self->size);
 }
 
 static VALUE lulu_rb_api_marker(VALUE self_value, VALUE index)
 #define ARGC_marker 1
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
-    int i = NUM2INT(index);
+    MARKER_ID i = NUM2MARKER_ID(index);
     if (0 <= i && i < self->size) {
         MARKER *marker = self->markers + i;
         VALUE triple = rb_ary_new2(3);
@@ -179,18 +842,19 @@ static VALUE lulu_rb_api_parts(VALUE self_value, VALUE index)
 #define ARGC_parts 1
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
-    int i = NUM2INT(index);
+    MARKER_ID i = NUM2MARKER_ID(index);
     if (0 <= i && i < self->size) {
         MARKER *marker = self->markers + i;
         VALUE rtn;
         if (mr_merged(marker)) {
             rtn = rb_ary_new2(3);
             rb_ary_store(rtn, 0, ID2SYM(rb_intern(mr_deleted_p(marker) ? "merge" : "root")));
-            rb_ary_store(rtn, 1, INT2FIX(marker->part_a));
-            rb_ary_store(rtn, 2, INT2FIX(marker->part_b));
+            rb_ary_store(rtn, 1, MARKER_ID2NUM(marker->part_a));
+            rb_ary_store(rtn, 2, MARKER_ID2NUM(marker->part_b));
         } else {
             rtn = rb_ary_new2(1);
-            rb_ary_store(rtn, 0, ID2SYM(rb_intern(mr_deleted_p(marker) ? "leaf" : "single")));
+            rb_ary_store(rtn, 0, ID2SYM(rb_intern(mr_removed_p(marker) ? "removed" :
+                    mr_deleted_p(marker) ? "leaf" : "single")));
         }
         return rtn;
     }
@@ -201,28 +865,577 @@ static VALUE lulu_rb_api_deleted(VALUE self_value, VALUE index)
 #define ARGC_deleted 1
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
-    int i = NUM2INT(index);
+    MARKER_ID i = NUM2MARKER_ID(index);
     if (0 <= i && i < self->size)
         return mr_deleted_p(self->markers + i) ? Qtrue : Qfalse;
     return Qnil;
 }
 
+static VALUE lulu_rb_api_packed_markers(VALUE self_value, VALUE layout_value)
+#define ARGC_packed_markers 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    PACKED_LAYOUT layout = get_packed_layout(layout_value);
+    long record_size = 3 * packed_layout_value_size(layout);
+    VALUE str = rb_str_new(NULL, record_size * self->size);
+    MARKER_ID n = get_packed_markers(self, RSTRING_PTR(str), layout);
+    rb_str_set_len(str, record_size * n);
+    return str;
+}
+
+static VALUE lulu_rb_api_packed_parts(VALUE self_value)
+#define ARGC_packed_parts 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    VALUE str = rb_str_new(NULL, 3 * sizeof(MARKER_ID) * (long)self->size);
+    get_packed_parts(self, (MARKER_ID*)RSTRING_PTR(str));
+    return str;
+}
+
 static VALUE lulu_rb_api_compress(VALUE self_value)
 #define ARGC_compress 0
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
     compress(self);
-    return INT2FIX(self->size);
+    return MARKER_ID2NUM(self->size);
+}
+
+// Compress, then reorder the markers so ones near each other in space are
+// near each other in the array. Merges of the reordered list touch fewer
+// pages of the markers and their geometry at a time, which matters most when
+// they're in storage files. The box index already sorts markers by Morton
+// code, so it gives the order.
+static VALUE lulu_rb_api_sort_by_locality(VALUE self_value)
+#define ARGC_sort_by_locality 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    compress(self);
+    si_build(self->index, self->markers, self->size);
+    NewArrayDecl(MARKER, markers, self->max_size);
+    for (MARKER_ID i = 0; i < self->size; i++)
+        markers[i] = self->markers[self->index->entries[i].index];
+    set_markers(self, markers);
+    si_clear(self->index);
+    return MARKER_ID2NUM(self->size);
+}
+
+// State shared by a merge running on its own thread and the Ruby thread
+// waiting for it.
+typedef struct merge_args_s {
+    MARKER_LIST *list;
+    int n_levels;                   // Pyramid levels to build, or 0 for a plain merge.
+    MARKER_DISTANCE scale_factor;   // Pyramid scale factor between levels.
+    int rounds_p;                   // Merge in rounds of independent pairs.
+    MARKER_DISTANCE cell_size;      // Grid cell side of an approximate merge, or 0.
+    int remerge_p;                  // Redo only merges changes could affect.
+    MARKER_ID n_markers;            // Number of markers after compression.
+    volatile int cancel_p;          // 1 if abandoned, with ALLOCATION_FAILED if out of memory
+    int merged_p;                   // whether the merge finished uncanceled
+    int too_many_p;                 // whether a remerge stopped short of too many markers
+    pthread_t thread;
+    int running_p;                  // whether the thread is yet to be joined
+    pthread_mutex_t mutex;          // guards the rest
+    pthread_cond_t cond;
+    int done_p;                     // whether the thread is done merging
+    int woken_p;                    // whether the waiting Ruby thread was interrupted
+} MERGE_ARGS;
+
+// Redo the merges that changes since the last merge could affect. Unless it
+// finishes, the list is left as it was.
+static void remerge_markers(MERGE_ARGS *args) {
+    MARKER_LIST *list = args->list;
+    INCREMENTAL_MERGE *im = list->incremental;
+    if (!im_prepared_p(im) && im_prepare(im, list->markers, list->merged_size) != 0)
+        return;
+    MARKER_ID n_more = im_plan(im, list->info, list->markers, list->size, &args->cancel_p);
+    if (n_more < 0)
+        return;
+    if (too_many_p(list, n_more)) {
+        args->too_many_p = 1;
+        return;
+    }
+    if (reserve_markers(list, n_more) != 0)
+        return;
+    MARKER_ID size = im_commit(im, list->markers, list->size);
+    if (size < 0) {
+        // The changes were lost, so the next remerge must start over.
+        list->merged_size = 0;
+        return;
+    }
+    // The box index is left cleared for in_box to rebuild if it's used, so
+    // the remerge costs what the change does rather than the list size.
+    list->size = list->merged_size = size;
+    args->merged_p = 1;
+}
+
+static void *merge_without_gvl(void *args_ptr) {
+    MERGE_ARGS *args = args_ptr;
+    MARKER_LIST *list = args->list;
+    // Running out of memory cancels the merge. The caller then raises.
+    set_allocation_flag(&args->cancel_p);
+    if (args->remerge_p) {
+        si_clear(list->index);
+        remerge_markers(args);
+        set_allocation_flag(NULL);
+        return NULL;
+    }
+    compress(list);
+    args->n_markers = list->size;
+    list->approximation_error = 0;
+    list->workspace->trace = list->trace;
+    stats_start();
+    if (ensure_headroom(list) == 0) {
+        if (args->n_levels > 0)
+            merge_pyramid(list, args->n_levels, args->scale_factor, &args->cancel_p);
+        else if (args->rounds_p)
+            list->size = merge_markers_in_rounds(list->workspace, list->info, list->markers, list->size,
+                    &args->cancel_p);
+        else if (args->cell_size > 0)
+            list->size = merge_markers_approximate(list->workspace, list->info, list->markers, list->size,
+                    args->cell_size, &list->approximation_error, &args->cancel_p);
+        else
+            list->size = merge_markers_in(list->workspace, list->info, list->markers, list->size, &args->cancel_p);
+    }
+    if (list->trace)
+        fflush(list->trace);
+    if (!args->cancel_p) {
+        args->merged_p = 1;
+        si_build(list->index, list->markers, list->size);
+        // Remerge reproduces the serial merge, so it must start over after
+        // merging in rounds or approximately.
+        list->merged_size = args->rounds_p || args->cell_size > 0 ? 0 : list->size;
+#ifdef LULU_MERGE_STATS
+        stats_clear(list->stats);
+        stats_flush(list->stats);
+#endif
+    }
+    set_allocation_flag(NULL);
+    return NULL;
+}
+
+static void *merge_thread(void *args_ptr) {
+    MERGE_ARGS *args = args_ptr;
+    merge_without_gvl(args);
+    pthread_mutex_lock(&args->mutex);
+    args->done_p = 1;
+    pthread_cond_signal(&args->cond);
+    pthread_mutex_unlock(&args->mutex);
+    return NULL;
+}
+
+// Wait without the GVL until the merge is done or Ruby interrupts the wait.
+static void *wait_for_merge(void *args_ptr) {
+    MERGE_ARGS *args = args_ptr;
+    pthread_mutex_lock(&args->mutex);
+    while (!args->done_p && !args->woken_p)
+        pthread_cond_wait(&args->cond, &args->mutex);
+    args->woken_p = 0;
+    pthread_mutex_unlock(&args->mutex);
+    return NULL;
+}
+
+// Called by Ruby to interrupt the wait, e.g. for Thread#raise, a timeout, or a
+// signal trap. The merge goes on.
+static void wake_merge_waiter(void *args_ptr) {
+    MERGE_ARGS *args = args_ptr;
+    pthread_mutex_lock(&args->mutex);
+    args->woken_p = 1;
+    pthread_cond_signal(&args->cond);
+    pthread_mutex_unlock(&args->mutex);
+}
+
+// Join the merge thread, first canceling the merge if it's not done. A
+// canceled merge leaves the list as it was before, compressed. A canceled
+// remerge has left it as it was.
+static void finish_merge(MERGE_ARGS *args) {
+    if (!args->running_p)
+        return;
+    pthread_mutex_lock(&args->mutex);
+    if (!args->done_p)
+        __sync_fetch_and_or(&args->cancel_p, 1);
+    pthread_mutex_unlock(&args->mutex);
+    pthread_join(args->thread, NULL);
+    args->running_p = 0;
+    if (!args->merged_p && !args->remerge_p) {
+        unmerge(args->list, args->n_markers);
+        clear_pyramid(args->list);
+    }
+}
+
+// Merge on a new thread, so the GVL is free meanwhile. Interrupts are handled
+// as they come while it runs. Those that don't raise, like signal traps and
+// Thread#wakeup, leave it running. Those that raise cancel it.
+static VALUE merge(VALUE args_value) {
+    MERGE_ARGS *args = (MERGE_ARGS*)args_value;
+    int error = pthread_create(&args->thread, NULL, merge_thread, args);
+    if (error == EAGAIN || error == ENOMEM)
+        rb_memerror();
+    if (error)
+        rb_syserr_fail(error, "merge thread");
+    args->running_p = 1;
+    for (;;) {
+        rb_thread_call_without_gvl(wait_for_merge, args, wake_merge_waiter, args);
+        pthread_mutex_lock(&args->mutex);
+        int done_p = args->done_p;
+        pthread_mutex_unlock(&args->mutex);
+        if (done_p)
+            break;
+    }
+    finish_merge(args);
+    if (!args->merged_p && (args->cancel_p & ALLOCATION_FAILED))
+        rb_memerror();
+    if (args->too_many_p)
+        rb_raise(rb_eRangeError, "too many markers");
+    return MARKER_ID2NUM(args->list->size);
+}
+
+static VALUE end_merge(VALUE args_value) {
+    MERGE_ARGS *args = (MERGE_ARGS*)args_value;
+    finish_merge(args);
+    pthread_cond_destroy(&args->cond);
+    pthread_mutex_destroy(&args->mutex);
+    args->list->merging_p = 0;
+    report_memory();
+    return Qnil;
+}
+
+// Run a merge described by the given arguments without the GVL, returning the list length.
+static VALUE run_merge(MERGE_ARGS *args) {
+    pthread_mutex_init(&args->mutex, NULL);
+    pthread_cond_init(&args->cond, NULL);
+    args->list->merging_p = 1;
+    return rb_ensure(merge, (VALUE)args, end_merge, (VALUE)args);
 }
 
 static VALUE lulu_rb_api_merge(VALUE self_value)
 #define ARGC_merge 0
 {
     MARKER_LIST_FOR_VALUE_DECL(self);
-    compress(self);
-    ensure_headroom(self);
-    self->size = merge_markers_fast(self->info, self->markers, self->size);
-    return INT2FIX(self->size);
+    MERGE_ARGS args[1] = {{ .list = self }};
+    return run_merge(args);
+}
+
+static VALUE lulu_rb_api_merge_in_rounds(VALUE self_value)
+#define ARGC_merge_in_rounds 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    MERGE_ARGS args[1] = {{ .list = self, .rounds_p = 1 }};
+    return run_merge(args);
+}
+
+static VALUE lulu_rb_api_merge_approximate(VALUE self_value, VALUE cell_size_value)
+#define ARGC_merge_approximate 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    MARKER_DISTANCE cell_size = rb_num2dbl(cell_size_value);
+    if (!(cell_size > 0))
+        rb_raise(rb_eArgError, "approximate merge cell size must be positive");
+    MERGE_ARGS args[1] = {{ .list = self, .cell_size = cell_size }};
+    return run_merge(args);
+}
+
+static VALUE lulu_rb_api_approximation_error(VALUE self_value)
+#define ARGC_approximation_error 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    return rb_float_new(self->approximation_error);
+}
+
+// Record the steps of later serial merges in a new file at the given path, or
+// stop recording if it's nil. See mt.h.
+static VALUE lulu_rb_api_trace_merges(VALUE self_value, VALUE path_value)
+#define ARGC_trace_merges 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    close_trace(self);
+    if (!NIL_P(path_value)) {
+        const char *path = StringValueCStr(path_value);
+        self->trace = mt_open(path);
+        if (!self->trace)
+            rb_sys_fail(path);
+    }
+    return self_value;
+}
+
+// Fill a marker file header for the list. Like a copy, a loaded list can
+// remerge from the last merge only if no leaves have changed since.
+static void set_file_header(MARKER_LIST *list, MARKER_FILE_HEADER *h) {
+    // Loading checks the same limit as adding, so every file written loads.
+    if (list->size > MR_MAX_MARKERS)
+        rb_raise(rb_eRangeError, "too many markers");
+    mf_header_set(h, list->info, list->size, list->incremental->n_dirty > 0 ? 0 : list->merged_size);
+}
+
+// Give a new list the parameters and size from a checked marker file header.
+static void set_from_file_header(MARKER_LIST *list, MARKER_FILE_HEADER *h) {
+    mr_info_set(list->info, h->kind, h->scale);
+    list->info->index = h->index;
+    list->size = h->n_markers;
+    if (list->max_size < list->size)
+        list->max_size = list->size;
+    list->merged_size = h->merged_size;
+}
+
+// Write the markers and merge parameters to a marker file at the given path.
+// It's written under a temporary name and renamed, so lists loaded from an
+// earlier file at the path keep their markers. See mf.h.
+static VALUE lulu_rb_api_dump(VALUE self_value, VALUE path_value)
+#define ARGC_dump 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    const char *path = StringValueCStr(path_value);
+    MARKER_FILE_HEADER h[1];
+    set_file_header(self, h);
+    VALUE tmp_value = rb_sprintf("%s.%ld.tmp", path, (long)getpid());
+    const char *tmp = StringValueCStr(tmp_value);
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        rb_sys_fail(tmp);
+    int rtn = mf_write(f, h, self->markers);
+    if (fclose(f) != 0)
+        rtn = -1;
+    if (rtn != 0 || rename(tmp, path) != 0) {
+        int error = errno;
+        unlink(tmp);
+        errno = error;
+        rb_sys_fail(path);
+    }
+    return self_value;
+}
+
+// Make a list of the given class from the marker file at the given path. The
+// markers are mapped copy-on-write, so they're copied only when added to or
+// merged, and other processes loading the file share them.
+static VALUE lulu_rb_api_load(VALUE klass, VALUE path_value)
+#define ARGC_load 1
+{
+    const char *path = StringValueCStr(path_value);
+    VALUE list_value = lulu_rb_api_new_marker_list(klass);
+    MARKER_LIST *list;
+    Data_Get_Struct(list_value, MARKER_LIST, list);
+    size_t size;
+    char *data = mf_map(path, &size);
+    if (!data)
+        rb_sys_fail(path);
+    MARKER_FILE_HEADER *h = (MARKER_FILE_HEADER*)data;
+    const char *error = mf_header_check(h, size);
+    if (error) {
+        mf_unmap(data, size);
+        rb_raise(rb_eArgError, "%s (load %s)", error, path);
+    }
+    // The list owns the mapping from here, so raising doesn't leak it.
+    list->mapping = data;
+    list->mapping_size = size;
+    list->markers = (MARKER*)(data + MF_MARKERS_OFFSET);
+    error = mf_markers_check(list->markers, h->n_markers);
+    if (error)
+        rb_raise(rb_eArgError, "%s (load %s)", error, path);
+    set_from_file_header(list, h);
+    return list_value;
+}
+
+// Marshal the list as the contents of a marker file.
+static VALUE lulu_rb_api__dump(VALUE self_value, VALUE level_value)
+#define ARGC__dump 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    MARKER_FILE_HEADER h[1];
+    set_file_header(self, h);
+    VALUE str = rb_str_new(NULL, MF_MARKERS_OFFSET + sizeof(MARKER) * (long)self->size);
+    char *buf = RSTRING_PTR(str);
+    memset(buf, 0, MF_MARKERS_OFFSET);
+    memcpy(buf, h, sizeof *h);
+    memcpy(buf + MF_MARKERS_OFFSET, self->markers, sizeof(MARKER) * self->size);
+    return str;
+}
+
+static VALUE lulu_rb_api__load(VALUE klass, VALUE str_value)
+#define ARGC__load 1
+{
+    StringValue(str_value);
+    const char *data = RSTRING_PTR(str_value);
+    size_t size = RSTRING_LEN(str_value);
+    MARKER_FILE_HEADER h[1];
+    memset(h, 0, sizeof *h);
+    memcpy(h, data, size < sizeof *h ? size : sizeof *h);
+    const char *error = mf_header_check(h, size);
+    if (error)
+        rb_raise(rb_eArgError, "%s (_load)", error);
+    VALUE list_value = lulu_rb_api_new_marker_list(klass);
+    MARKER_LIST *list;
+    Data_Get_Struct(list_value, MARKER_LIST, list);
+    reserve_markers(list, h->n_markers);
+    memcpy(list->markers, data + MF_MARKERS_OFFSET, sizeof(MARKER) * h->n_markers);
+    // Check the copy, since the string's markers may not be aligned.
+    error = mf_markers_check(list->markers, h->n_markers);
+    if (error)
+        rb_raise(rb_eArgError, "%s (_load)", error);
+    set_from_file_header(list, h);
+    report_memory();
+    return list_value;
+}
+
+#ifdef LULU_MERGE_STATS
+
+#define STATS_TABLE_ENTRY(Name) { #Name, offsetof(MERGE_STATS, Name) }
+
+static struct { const char *name; size_t offset; } stats_table[] = {
+    STATS_TABLE_ENTRY(nearest_searches),
+    STATS_TABLE_ENTRY(nodes_visited),
+    STATS_TABLE_ENTRY(candidates),
+    STATS_TABLE_ENTRY(distances),
+    STATS_TABLE_ENTRY(heap_sifts),
+    STATS_TABLE_ENTRY(inverse_lists),
+    STATS_TABLE_ENTRY(inverse_total),
+    STATS_TABLE_ENTRY(inverse_max),
+    STATS_TABLE_ENTRY(index_nodes),
+    STATS_TABLE_ENTRY(index_depth),
+    { "setup_ns", offsetof(MERGE_STATS, phase_ns[PHASE_SETUP]) },
+    { "index_ns", offsetof(MERGE_STATS, phase_ns[PHASE_INDEX]) },
+    { "nearest_ns", offsetof(MERGE_STATS, phase_ns[PHASE_NEAREST]) },
+    { "loop_ns", offsetof(MERGE_STATS, phase_ns[PHASE_LOOP]) },
+};
+
+#endif
+
+// A Hash of counts of the work done by the last merge, or nil if the
+// extension was built without them.
+static VALUE lulu_rb_api_merge_stats(VALUE self_value)
+#define ARGC_merge_stats 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+#ifdef LULU_MERGE_STATS
+    VALUE hash = rb_hash_new();
+    for (int i = 0; i < STATIC_ARRAY_SIZE(stats_table); i++) {
+        uint64_t count = *(uint64_t*)((char*)self->stats + stats_table[i].offset);
+        rb_hash_aset(hash, ID2SYM(rb_intern(stats_table[i].name)), ULL2NUM(count));
+    }
+    return hash;
+#else
+    (void)self;
+    return Qnil;
+#endif
+}
+
+static VALUE lulu_rb_api_merge_pyramid(VALUE self_value, VALUE levels_value, VALUE scale_factor_value)
+#define ARGC_merge_pyramid 2
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    int n_levels = NUM2INT(levels_value);
+    MARKER_DISTANCE scale_factor = rb_num2dbl(scale_factor_value);
+    if (n_levels < 1)
+        rb_raise(rb_eArgError, "pyramid needs at least one level");
+    if (!(scale_factor > 0))
+        rb_raise(rb_eArgError, "pyramid scale factor must be positive");
+    MERGE_ARGS args[1] = {{ .list = self, .n_levels = n_levels, .scale_factor = scale_factor }};
+    return run_merge(args);
+}
+
+static void push_index(MARKER_ID i, void *array_value) {
+    rb_ary_push((VALUE)array_value, MARKER_ID2NUM(i));
+}
+
+static VALUE lulu_rb_api_in_box(VALUE self_value, VALUE x0_value, VALUE y0_value, VALUE x1_value, VALUE y1_value)
+#define ARGC_in_box 4
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    MARKER_COORD x0 = rb_num2dbl(x0_value);
+    MARKER_COORD y0 = rb_num2dbl(y0_value);
+    MARKER_COORD x1 = rb_num2dbl(x1_value);
+    MARKER_COORD y1 = rb_num2dbl(y1_value);
+    if (!si_built_p(self->index))
+        si_build(self->index, self->markers, self->size);
+    VALUE rtn = rb_ary_new();
+    si_in_box(self->index, self->markers, x0, y0, x1, y1, push_index, (void*)rtn);
+    return rtn;
+}
+
+// Return the leaf with the given index after noting it's about to change.
+static MARKER *get_leaf_to_change(MARKER_LIST *list, MARKER_ID i) {
+    if (i < 0 || i >= list->size)
+        rb_raise(rb_eIndexError, "marker index %" PRI_MARKER_ID " out of range", i);
+    MARKER *marker = list->markers + i;
+    if (mr_merged(marker) || mr_removed_p(marker))
+        rb_raise(rb_eArgError, "marker %" PRI_MARKER_ID " is not a leaf", i);
+    if (list->merged_size > 0) {
+        if (!im_prepared_p(list->incremental))
+            im_prepare(list->incremental, list->markers, list->merged_size);
+        im_touch(list->incremental, i);
+    }
+    si_clear(list->index);
+    return marker;
+}
+
+static VALUE lulu_rb_api_remove(VALUE self_value, VALUE index)
+#define ARGC_remove 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    MARKER *marker = get_leaf_to_change(self, NUM2MARKER_ID(index));
+    mr_set_removed(marker);
+    return self_value;
+}
+
+static VALUE lulu_rb_api_move(VALUE self_value, VALUE index, VALUE x_value, VALUE y_value)
+#define ARGC_move 3
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    MARKER_COORD x = rb_num2dbl(x_value);
+    MARKER_COORD y = rb_num2dbl(y_value);
+    MARKER *marker = get_leaf_to_change(self, NUM2MARKER_ID(index));
+    int deleted_p = mr_deleted_p(marker);
+    mr_set(self->info, marker, x, y, marker->size);
+    marker->deleted_p = deleted_p;
+    return self_value;
+}
+
+static VALUE lulu_rb_api_remerge(VALUE self_value)
+#define ARGC_remerge 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    if (self->merged_size == 0)
+        return lulu_rb_api_merge(self_value);
+    MERGE_ARGS args[1] = {{ .list = self, .remerge_p = 1 }};
+    return run_merge(args);
+}
+
+static VALUE lulu_rb_api_level_count(VALUE self_value)
+#define ARGC_level_count 0
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    return INT2FIX(self->n_levels);
+}
+
+static VALUE lulu_rb_api_level(VALUE self_value, VALUE index)
+#define ARGC_level 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    int i = NUM2INT(index);
+    if (0 <= i && i < self->n_levels) {
+        PYRAMID_LEVEL *level = self->levels + i;
+        VALUE rtn = lulu_rb_api_new_marker_list(rb_obj_class(self_value));
+        MARKER_LIST *list;
+        Data_Get_Struct(rtn, MARKER_LIST, list);
+        mr_info_set(list->info, self->info->kind, level->scale);
+        reserve_markers(list, level->size);
+        CopyArray(list->markers, level->markers, level->size);
+        list->size = level->size;
+        return rtn;
+    }
+    return Qnil;
+}
+
+static VALUE lulu_rb_api_level_clusters(VALUE self_value, VALUE index)
+#define ARGC_level_clusters 1
+{
+    MARKER_LIST_FOR_VALUE_DECL(self);
+    int i = NUM2INT(index);
+    if (0 <= i && i < self->n_levels) {
+        PYRAMID_LEVEL *level = self->levels + i;
+        VALUE str = rb_str_new(NULL, sizeof(MARKER_ID) * (long)level->n_clusters);
+        CopyArray((MARKER_ID*)RSTRING_PTR(str), level->clusters, level->n_clusters);
+        return str;
+    }
+    return Qnil;
 }
 
 #define FUNCTION_TABLE_ENTRY(Name) { #Name, RUBY_METHOD_FUNC(lulu_rb_api_ ## Name), ARGC_ ## Name }
@@ -234,18 +1447,71 @@ struct ft_entry {
 };
 
 static struct ft_entry function_table[] = {
+    FUNCTION_TABLE_ENTRY(_dump),
     FUNCTION_TABLE_ENTRY(add),
+    FUNCTION_TABLE_ENTRY(add_all),
+    FUNCTION_TABLE_ENTRY(add_packed),
+    FUNCTION_TABLE_ENTRY(approximation_error),
     FUNCTION_TABLE_ENTRY(compress),
     FUNCTION_TABLE_ENTRY(clear),
     FUNCTION_TABLE_ENTRY(deleted),
+    FUNCTION_TABLE_ENTRY(dump),
+    FUNCTION_TABLE_ENTRY(in_box),
     FUNCTION_TABLE_ENTRY(initialize_copy),
     FUNCTION_TABLE_ENTRY(length),
+    FUNCTION_TABLE_ENTRY(level),
+    FUNCTION_TABLE_ENTRY(level_clusters),
+    FUNCTION_TABLE_ENTRY(level_count),
     FUNCTION_TABLE_ENTRY(marker),
     FUNCTION_TABLE_ENTRY(merge),
+    FUNCTION_TABLE_ENTRY(merge_approximate),
+    FUNCTION_TABLE_ENTRY(merge_in_rounds),
+    FUNCTION_TABLE_ENTRY(merge_pyramid),
+    FUNCTION_TABLE_ENTRY(merge_stats),
+    FUNCTION_TABLE_ENTRY(move),
+    FUNCTION_TABLE_ENTRY(packed_markers),
+    FUNCTION_TABLE_ENTRY(packed_parts),
     FUNCTION_TABLE_ENTRY(parts),
+    FUNCTION_TABLE_ENTRY(release_workspace),
+    FUNCTION_TABLE_ENTRY(remerge),
+    FUNCTION_TABLE_ENTRY(remove),
     FUNCTION_TABLE_ENTRY(set_info),
+    FUNCTION_TABLE_ENTRY(sort_by_locality),
+    FUNCTION_TABLE_ENTRY(trace_merges),
 };
 
+static struct ft_entry singleton_function_table[] = {
+    FUNCTION_TABLE_ENTRY(_load),
+    FUNCTION_TABLE_ENTRY(load),
+    FUNCTION_TABLE_ENTRY(load_binary),
+    FUNCTION_TABLE_ENTRY(load_csv),
+};
+
+// The float32 build, compiled from lulu32.c, defines MarkerList32 with the
+// same methods.
+#ifdef LULU_FLOAT32
+#define MARKER_LIST_CLASS_NAME "MarkerList32"
+#else
+#define MARKER_LIST_CLASS_NAME "MarkerList"
+#endif
+
+#define define_marker_list NAME(define_marker_list)
+void define_marker_list(VALUE module) {
+    VALUE klass = rb_define_class_under(module, MARKER_LIST_CLASS_NAME, rb_cObject);
+    rb_define_alloc_func(klass, lulu_rb_api_new_marker_list);
+
+    for (int i = 0; i < STATIC_ARRAY_SIZE(function_table); i++) {
+        struct ft_entry *e = function_table + i;
+        rb_define_method(klass, e->name, e->func, e->argc);
+    }
+    for (int i = 0; i < STATIC_ARRAY_SIZE(singleton_function_table); i++) {
+        struct ft_entry *e = singleton_function_table + i;
+        rb_define_singleton_method(klass, e->name, e->func, e->argc);
+    }
+}
+
+#ifndef LULU_FLOAT32
+
 #define STRING_CONST_TABLE_ENTRY(Name) { #Name, Name }
 
 struct sct_entry {
@@ -254,22 +1520,40 @@ struct sct_entry {
 };
 
 static struct sct_entry string_const_table[] = {
-    STRING_CONST_TABLE_ENTRY(EXT_VERSION)
+    STRING_CONST_TABLE_ENTRY(EXT_VERSION),
+    STRING_CONST_TABLE_ENTRY(INDEX_FORMAT),
 };
 
+void lulu32_define_marker_list(VALUE module);
+int lulu32_set_storage(const char *dir, size_t min_size);
+
+// Allocations at least this big go in storage files unless set otherwise.
+#define DEFAULT_STORAGE_MIN_SIZE (64 << 20)
+
+// Put later large allocations of all marker lists in files in the given
+// directory, or stop with nil. See set_storage in utility.h.
+static VALUE lulu_rb_api_set_storage(int argc, VALUE *argv, VALUE module)
+{
+    VALUE dir_value, min_size_value;
+    rb_scan_args(argc, argv, "11", &dir_value, &min_size_value);
+    const char *dir = NIL_P(dir_value) ? NULL : StringValueCStr(dir_value);
+    size_t min_size = NIL_P(min_size_value) ? DEFAULT_STORAGE_MIN_SIZE : NUM2SIZET(min_size_value);
+    if (set_storage(dir, min_size) != 0 || lulu32_set_storage(dir, min_size) != 0)
+        rb_sys_fail(dir);
+    return module;
+}
+
 void Init_lulu(void)
 {
     VALUE module = rb_define_module("Lulu");
-    VALUE klass = rb_define_class_under(module, "MarkerList", rb_cObject);
-    rb_define_alloc_func(klass, lulu_rb_api_new_marker_list);
-
-    for (int i = 0; i < STATIC_ARRAY_SIZE(function_table); i++) {
-        struct ft_entry *e = function_table + i;
-        rb_define_method(klass, e->name, e->func, e->argc);
-    }
+    define_marker_list(module);
+    lulu32_define_marker_list(module);
+    rb_define_module_function(module, "set_storage", RUBY_METHOD_FUNC(lulu_rb_api_set_storage), -1);
 
     for (int i = 0; i < STATIC_ARRAY_SIZE(string_const_table); i++) {
         struct sct_entry *e = string_const_table + i;
         rb_define_const(module, e->name, rb_str_new2(e->val));
     }
 }
+
+#endif
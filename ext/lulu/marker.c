@@ -10,11 +10,14 @@
 #include <math.h>
 #include "marker.h"
 #include "utility.h"
+#include "stats.h"
 
 #define SQRT_1_PI 0.564189583547756286948079451560772585844050629328998856844085
 
 void mr_info_init(MARKER_INFO *info) {
     info->kind = CIRCLE;
+    info->index = INDEX_AUTO;
+    info->n_threads = 1;
     info->scale = 1;
     info->c = SQRT_1_PI;
 }
@@ -25,8 +28,8 @@ void mr_info_set(MARKER_INFO *info, MARKER_KIND kind, MARKER_DISTANCE scale) {
     info->c = scale * (kind == SQUARE ? 0.5 : SQRT_1_PI);
 }
 
-void mr_init(MARKER *markers, int n_markers) {
-    for (int i = 0; i < n_markers; i++) {
+void mr_init(MARKER *markers, MARKER_ID n_markers) {
+    for (MARKER_ID i = 0; i < n_markers; i++) {
         MARKER *marker = markers + i;
         marker->deleted_p = 0;
         marker->size = 0;
@@ -51,7 +54,7 @@ void mr_set(MARKER_INFO *info, MARKER *marker, MARKER_COORD x, MARKER_COORD y, M
     marker->y_sum = y * size;
 }
 
-void mr_merge(MARKER_INFO *info, MARKER *markers, int i_merged, int ia, int ib) {
+void mr_merge(MARKER_INFO *info, MARKER *markers, MARKER_ID i_merged, MARKER_ID ia, MARKER_ID ib) {
     MARKER *merged = markers + i_merged;
     MARKER *a = markers + ia;
     MARKER *b = markers + ib;
@@ -60,8 +63,14 @@ void mr_merge(MARKER_INFO *info, MARKER *markers, int i_merged, int ia, int ib)
     merged->r = size_to_radius(info, merged->size);
     merged->x_sum = a->x_sum + b->x_sum;
     merged->y_sum = a->y_sum + b->y_sum;
-    merged->x = merged->x_sum / merged->size;
-    merged->y = merged->y_sum / merged->size;
+    if (merged->size > 0) {
+        merged->x = merged->x_sum / merged->size;
+        merged->y = merged->y_sum / merged->size;
+    } else {
+        // Markers of no size have no weight, so take the midpoint.
+        merged->x = 0.5 * (a->x + b->x);
+        merged->y = 0.5 * (a->y + b->y);
+    }
     merged->part_a = ia;
     merged->part_b = ib;
 }
@@ -83,13 +92,65 @@ MARKER_DISTANCE mr_distance(MARKER_INFO *info, MARKER *a, MARKER *b) {
     return sqrt(dx * dx + dy * dy) - mr_r(a) - mr_r(b);
 }
 
-void get_marker_array_extent(MARKER *a, int n_markers, MARKER_EXTENT *ext) {
+void mg_init(MARKER_GEOMETRY *g) {
+    g->shapes = NULL;
+    g->deleted = NULL;
+    g->size = g->max_size = 0;
+}
+
+void mg_clear(MARKER_GEOMETRY *g) {
+    Free(g->shapes);
+    Free(g->deleted);
+    mg_init(g);
+}
+
+void mg_reserve(MARKER_GEOMETRY *g, MARKER_ID max_size) {
+    if (max_size > g->max_size) {
+        MARKER_ID old_words = (g->max_size + 31) / 32;
+        MARKER_ID new_words = (max_size + 31) / 32;
+        RenewArray(g->shapes, max_size);
+        RenewArray(g->deleted, new_words);
+        if (allocation_failed_p())
+            return;
+        for (MARKER_ID i = old_words; i < new_words; i++)
+            g->deleted[i] = 0;
+        g->max_size = max_size;
+    }
+}
+
+void mg_set(MARKER_GEOMETRY *g, MARKER_ID i, MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, int deleted_p) {
+    g->shapes[i].x = x;
+    g->shapes[i].y = y;
+    g->shapes[i].r = r;
+    if (deleted_p)
+        g->deleted[(size_t)i >> 5] |= bit(i & 31);
+    else
+        g->deleted[(size_t)i >> 5] &= ~bit(i & 31);
+    if (i >= g->size)
+        g->size = i + 1;
+}
+
+MARKER_DISTANCE mg_distance(MARKER_INFO *info, MARKER_GEOMETRY *g, MARKER_ID a, MARKER_ID b) {
+    STAT_ADD(distances, 1);
+    if (info->kind == SQUARE) {
+        MARKER_DISTANCE r_sum = mg_r(g, a) + mg_r(g, b);
+        MARKER_DISTANCE dx = fabs(mg_x(g, b) - mg_x(g, a)) - r_sum;
+        MARKER_DISTANCE dy = fabs(mg_y(g, b) - mg_y(g, a)) - r_sum;
+        MARKER_DISTANCE d = dx < 0 && dy < 0 ? fmax(dx, dy) : sqrt(dx * dx + dy * dy);
+        return d;
+    }
+    MARKER_DISTANCE dx = mg_x(g, b) - mg_x(g, a);
+    MARKER_DISTANCE dy = mg_y(g, b) - mg_y(g, a);
+    return sqrt(dx * dx + dy * dy) - mg_r(g, a) - mg_r(g, b);
+}
+
+void get_marker_array_extent(MARKER *a, MARKER_ID n_markers, MARKER_EXTENT *ext) {
     if (n_markers > 0) {
         MARKER_DISTANCE ew = mr_w(a);
         MARKER_DISTANCE ee = mr_e(a);
         MARKER_DISTANCE es = mr_s(a);
         MARKER_DISTANCE en = mr_n(a);
-        for (int i = 1; i < n_markers; i++) {
+        for (MARKER_ID i = 1; i < n_markers; i++) {
             MARKER_DISTANCE w = mr_w(a + i);
             MARKER_DISTANCE e = mr_e(a + i);
             MARKER_DISTANCE s = mr_s(a + i);
@@ -109,3 +170,26 @@ void get_marker_array_extent(MARKER *a, int n_markers, MARKER_EXTENT *ext) {
         ext->h = en - es;
     }
 }
+
+void mg_extent(MARKER_GEOMETRY *g, MARKER_ID n_markers, MARKER_EXTENT *ext) {
+    if (n_markers > 0) {
+        MARKER_DISTANCE ew = mg_w(g, 0);
+        MARKER_DISTANCE ee = mg_e(g, 0);
+        MARKER_DISTANCE es = mg_s(g, 0);
+        MARKER_DISTANCE en = mg_n(g, 0);
+        for (MARKER_ID i = 1; i < n_markers; i++) {
+            if (mg_w(g, i) < ew)
+                ew = mg_w(g, i);
+            if (mg_e(g, i) > ee)
+                ee = mg_e(g, i);
+            if (mg_s(g, i) < es)
+                es = mg_s(g, i);
+            if (mg_n(g, i) > en)
+                en = mg_n(g, i);
+        }
+        ext->x = ew;
+        ext->y = es;
+        ext->w = ee - ew;
+        ext->h = en - es;
+    }
+}
@@ -8,34 +8,105 @@
 #ifndef MARKER_H_
 #define MARKER_H_
 
+#include <float.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include "namespace.h"
 
+/**
+ * Coordinates and distances are float in the float32 build, halving the
+ * geometry the merge hot path loads. Sums stay double in both builds so
+ * merged centers don't drift as thousands of markers are combined.
+ */
+#ifdef LULU_FLOAT32
+typedef float MARKER_COORD;
+typedef float MARKER_DISTANCE;
+#define MARKER_DISTANCE_EPSILON FLT_EPSILON
+#define MARKER_DISTANCE_MIN     FLT_MIN
+#else
 typedef double MARKER_COORD;
 typedef double MARKER_DISTANCE;
+#define MARKER_DISTANCE_EPSILON DBL_EPSILON
+#define MARKER_DISTANCE_MIN     DBL_MIN
+#endif
+typedef double MARKER_SUM;
 /**
  * Size of population represented by the marker.  For
  * discrete populations, this can be an unsigned int.
+ * It's a sum, so it's double in the float32 build too.
  */
 typedef double MARKER_SIZE;
 
+/**
+ * Index of a marker in a list. It's 64-bit in the index64 build, so lists
+ * can pass 2^31 markers at the cost of 8 more bytes per marker and wider
+ * merge arrays, heap, and spatial indexes. PRI_MARKER_ID formats it.
+ */
+#ifdef LULU_INDEX64
+typedef int64_t MARKER_ID;
+#define PRI_MARKER_ID PRId64
+#else
+typedef int MARKER_ID;
+#define PRI_MARKER_ID "d"
+#endif
+
 typedef struct marker_s {
     MARKER_SIZE size;
     MARKER_DISTANCE r;
-    MARKER_COORD x, y, x_sum, y_sum;
+    MARKER_COORD x, y;
+    MARKER_SUM x_sum, y_sum;
+#ifdef LULU_INDEX64
+    int64_t part_a;
+    uint64_t deleted_p:1, part_b:63;
+#else
     int part_a;
     unsigned deleted_p:1, part_b:31;
+#endif
 } MARKER;
 
+// Center and radius of a marker, the only fields nearest marker searches use.
+typedef struct marker_shape_s {
+    MARKER_COORD x, y;
+    MARKER_DISTANCE r;
+} MARKER_SHAPE;
+
+/**
+ * Marker geometry split out of the marker array for the merge hot path.
+ * Shapes are packed in one array, 24 bytes each or 12 in the float32 build,
+ * and deletions are in a bitset. Searches load only these, not whole markers.
+ * Separate arrays for x, y, and r would cost three cache misses per random
+ * access rather than one.
+ */
+typedef struct marker_geometry_s {
+    MARKER_SHAPE *shapes;
+    unsigned *deleted;
+    MARKER_ID size, max_size;
+} MARKER_GEOMETRY;
+
+#define MARKER_GEOMETRY_DECL(G) MARKER_GEOMETRY G[1]; mg_init(G)
+
 typedef enum marker_kind_e {
     CIRCLE,
     SQUARE,
 } MARKER_KIND;
 
+// Spatial index used to find nearest overlapping markers while merging.
+typedef enum marker_index_e {
+    INDEX_AUTO,         // a grid when marker sizes are nearly uniform, else a loose quadtree
+    INDEX_QUADTREE,
+    INDEX_GRID,
+    INDEX_LOOSE_QUADTREE,
+} MARKER_INDEX;
+
 /**
  * Holds parameters of the distance function and merging.
  */
 typedef struct marker_type_info_s {
     MARKER_KIND kind;
+    MARKER_INDEX index;
+    // Threads a merge may use. See pm.h.
+    int n_threads;
     // User scale applied to radii of markers during distance computation.
     MARKER_DISTANCE scale;
     // A scale factor that depends on both kind and user scale.
@@ -48,9 +119,26 @@ typedef struct marker_extent_s {
     MARKER_COORD x, y, w, h;
 } MARKER_EXTENT;
 
+// The most markers a list may hold before merging, so the 2n-1 markers of
+// its merge can be indexed with a MARKER_ID.
+#ifdef LULU_INDEX64
+#define MR_MAX_MARKERS (INT64_MAX / 2)
+#else
+#define MR_MAX_MARKERS (INT_MAX / 2)
+#endif
+
+// A part_a value marking a marker removed from the list and no longer in use.
+// Removed leaves have part_b 0, and merged markers discarded by a remerge,
+// whose places may be reused, have part_b 1.
+#define MR_REMOVED_PART (-2)
+
 #define mr_deleted_p(M)     ((M)->deleted_p)
 #define mr_set_deleted(M)   do { (M)->deleted_p = 1; } while (0)
 #define mr_merged(M)        ((M)->part_a >= 0)
+#define mr_removed_p(M)     ((M)->part_a == MR_REMOVED_PART)
+#define mr_set_removed(M)   do { (M)->deleted_p = 1; (M)->part_a = MR_REMOVED_PART; (M)->part_b = 0; } while (0)
+#define mr_discarded_p(M)   (mr_removed_p(M) && (M)->part_b == 1)
+#define mr_set_discarded(M) do { (M)->deleted_p = 1; (M)->part_a = MR_REMOVED_PART; (M)->part_b = 1; } while (0)
 #define mr_x(M) ((M)->x)
 #define mr_y(M) ((M)->y)
 #define mr_r(M) ((M)->r)
@@ -59,8 +147,18 @@ typedef struct marker_extent_s {
 #define mr_s(M) ((M)->y - (M)->r)
 #define mr_n(M) ((M)->y + (M)->r)
 
+#define mg_x(G, I) ((G)->shapes[I].x)
+#define mg_y(G, I) ((G)->shapes[I].y)
+#define mg_r(G, I) ((G)->shapes[I].r)
+#define mg_w(G, I) (mg_x(G, I) - mg_r(G, I))
+#define mg_e(G, I) (mg_x(G, I) + mg_r(G, I))
+#define mg_s(G, I) (mg_y(G, I) - mg_r(G, I))
+#define mg_n(G, I) (mg_y(G, I) + mg_r(G, I))
+#define mg_deleted_p(G, I)      (((G)->deleted[(size_t)(I) >> 5] >> ((I) & 31)) & 1)
+#define mg_set_deleted(G, I)    do { (G)->deleted[(size_t)(I) >> 5] |= bit((I) & 31); } while (0)
+
 #define mr_init(Marker, NMarkers)   NAME(mr_init)(Marker, NMarkers)
-void mr_init(MARKER *marker, int n_markers);
+void mr_init(MARKER *marker, MARKER_ID n_markers);
 
 #define mr_reset_parts(Marker) NAME(mr_reset_parts)(Marker)
 void mr_reset_parts(MARKER *marker);
@@ -75,15 +173,40 @@ void mr_info_set(MARKER_INFO *info, MARKER_KIND kind, MARKER_DISTANCE scale);
 void mr_set(MARKER_INFO *info, MARKER *marker, MARKER_COORD x, MARKER_COORD y, MARKER_SIZE size);
 
 #define mr_merge(Info, Markers, Merged, A, B)   NAME(mr_merge)(Info, Markers, Merged, A, B)
-void mr_merge(MARKER_INFO *info, MARKER *markers, int merged, int a, int b);
+void mr_merge(MARKER_INFO *info, MARKER *markers, MARKER_ID merged, MARKER_ID a, MARKER_ID b);
 
 #define mr_distance(Info, A, B)     NAME(mr_distance)(Info, A, B)
 MARKER_DISTANCE mr_distance(MARKER_INFO *info, MARKER *a, MARKER *b);
 
+#define mg_init(G)  NAME(mg_init)(G)
+void mg_init(MARKER_GEOMETRY *g);
+
+#define mg_clear(G) NAME(mg_clear)(G)
+void mg_clear(MARKER_GEOMETRY *g);
+
+// Make room for the given number of markers, keeping any already set. If
+// allocation fails with an allocation flag set, max_size stays as it was.
+#define mg_reserve(G, MaxSize)  NAME(mg_reserve)(G, MaxSize)
+void mg_reserve(MARKER_GEOMETRY *g, MARKER_ID max_size);
+
+// Set geometry of marker i, which must be within the reserved size, including the deleted bit.
+#define mg_set(G, I, X, Y, R, DeletedP)   NAME(mg_set)(G, I, X, Y, R, DeletedP)
+void mg_set(MARKER_GEOMETRY *g, MARKER_ID i, MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, int deleted_p);
+
+#define mg_set_marker(G, I, Marker) \
+    mg_set(G, I, mr_x(Marker), mr_y(Marker), mr_r(Marker), mr_deleted_p(Marker))
+
+#define mg_distance(Info, G, A, B)  NAME(mg_distance)(Info, G, A, B)
+MARKER_DISTANCE mg_distance(MARKER_INFO *info, MARKER_GEOMETRY *g, MARKER_ID a, MARKER_ID b);
+
 #define size_to_radius(Info, Size)  NAME(size_to_radius)(Info, Size)
 MARKER_DISTANCE size_to_radius(MARKER_INFO *info, MARKER_SIZE size);
 
 #define get_marker_array_extent(A, NMarkers, Ext)   NAME(get_marker_array_extent)(A, NMarkers, Ext)
-void get_marker_array_extent(MARKER *a, int n_markers, MARKER_EXTENT *ext);
+void get_marker_array_extent(MARKER *a, MARKER_ID n_markers, MARKER_EXTENT *ext);
+
+// As get_marker_array_extent, but of the first n_markers shapes of the geometry.
+#define mg_extent(G, NMarkers, Ext) NAME(mg_extent)(G, NMarkers, Ext)
+void mg_extent(MARKER_GEOMETRY *g, MARKER_ID n_markers, MARKER_EXTENT *ext);
 
 #endif /* MARKER_H_ */
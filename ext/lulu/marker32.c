@@ -0,0 +1,11 @@
+/*
+ * marker32.c
+ *
+ * The float32 build of marker.c. See namespace.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#define LULU_FLOAT32
+#include "marker.c"
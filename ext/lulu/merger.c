@@ -7,15 +7,184 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <float.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
 #include "merger.h"
+#include "pm.h"
 #include "utility.h"
 #include "pq.h"
 #include "qt.h"
+#include "grid.h"
 #include "test.h"
 
+// Markers are nearly uniform in size, so a grid beats the quadtree, when the
+// largest radius is no more than this many times the mean.
+#define GRID_MAX_RADIUS_RATIO 2
+
+// Side of grid cells in largest radii of the original markers. Vector scans of
+// cells are cheap compared to visiting them, so cells hold a few markers each.
+// Sides of 2, 4, 8, 16, and 32 radii took 6.7, 5.0, 3.9, 4.6, and 5.1s to merge
+// 1M uniform random markers.
+#define GRID_CELL_RADII 8
+
+// Time merge phases only when counting merge stats.
+#ifdef LULU_MERGE_STATS
+#define start_phase(W) do { (W)->phase_start = stats_now_ns(); } while (0)
+#define end_phase(W, Phase) do { \
+    uint64_t now = stats_now_ns(); \
+    STAT_ADD(phase_ns[Phase], now - (W)->phase_start); \
+    (W)->phase_start = now; \
+} while (0)
+#else
+#define start_phase(W)
+#define end_phase(W, Phase)
+#endif
+
+// Fewer markers than this are merged serially even if threads are allowed.
+#define PARALLEL_MIN_MARKERS 4096
+
+// Markers a thread of the initial nearest neighbor search takes at a time.
+#define NEAREST_CHUNK 1024
+
+void index_init(NEAREST_INDEX *index) {
+    index->grid_p = 0;
+    qt_init(index->qt);
+    grid_init(index->grid);
+}
+
+void index_clear(NEAREST_INDEX *index) {
+    qt_clear(index->qt);
+    grid_clear(index->grid);
+}
+
+void index_setup(NEAREST_INDEX *index, MARKER_INFO *info, MARKER_GEOMETRY *g, MARKER_ID n_markers) {
+    MARKER_DISTANCE r_max = 0;
+    MARKER_SUM r_sum = 0;
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        r_sum += mg_r(g, i);
+        if (mg_r(g, i) > r_max)
+            r_max = mg_r(g, i);
+    }
+    index->grid_p = info->index == INDEX_GRID ||
+            (info->index == INDEX_AUTO && r_max <= GRID_MAX_RADIUS_RATIO * r_sum / n_markers);
+    int loose_p = info->index == INDEX_LOOSE_QUADTREE || (info->index == INDEX_AUTO && !index->grid_p);
+
+    // Get a bounding box for the whole collection of markers.
+    MARKER_EXTENT ext[1];
+    mg_extent(g, n_markers, ext);
+
+    if (index->grid_p) {
+        // All the original markers and many merged ones go in the lowest level.
+        grid_setup(index->grid, ext->x, ext->y, GRID_CELL_RADII * r_max, n_markers, info, g);
+    } else if (loose_p) {
+        qt_reset(index->qt);
+        // The loose tree chooses its own depth from marker sizes.
+        qt_setup_loose(index->qt, ext->x, ext->y, ext->w > ext->h ? ext->w : ext->h, info, g, n_markers);
+    } else {
+        // Choose tree depth heuristically.
+        int max_depth = high_bit_position(n_markers) / 4 + 3;
+        qt_reset(index->qt);
+        qt_setup(index->qt, max_depth, ext->x, ext->y, ext->w, ext->h, info, g);
+    }
+}
+
+void index_insert(NEAREST_INDEX *index, MARKER_ID i) {
+    if (index->grid_p)
+        grid_insert(index->grid, i);
+    else
+        qt_insert(index->qt, i);
+}
+
+void index_delete(NEAREST_INDEX *index, MARKER_ID i) {
+    if (index->grid_p)
+        grid_delete(index->grid, i);
+    else
+        qt_delete(index->qt, i);
+}
+
+MARKER_ID index_nearest(NEAREST_INDEX *index, MARKER_ID a) {
+    return index->grid_p ? grid_nearest(index->grid, a) : qt_nearest(index->qt, a);
+}
+
+// What the threads of a nearest neighbor search share.
+typedef struct nearest_search_s {
+    NEAREST_INDEX *index;
+    MARKER_INFO *info;
+    MARKER_GEOMETRY *g;
+    MARKER_ID *n_nghbr;
+    MARKER_DISTANCE *mindist;
+    MARKER_ID *targets;         // markers to search, or NULL for the first n
+    MARKER_ID *nearest;         // nearest of each target
+    MARKER_ID n;
+    MARKER_ID next;             // first marker of the next chunk to search
+    volatile int *allocation_flag; // the searching thread's, for the threads it starts
+#ifdef LULU_MERGE_STATS
+    MERGE_STATS *worker_stats;  // where started threads leave their counts
+#endif
+} NEAREST_SEARCH;
+
+// Take chunks of markers until there are no more, finding the nearest of
+// each target. With no targets, set the nearest neighbor of each of the first
+// n markers to the one of lower index it overlaps most, or -1 if none. Index
+// queries don't change the index, so threads can run this at once.
+static void *search_nearest(void *search_ptr) {
+    NEAREST_SEARCH *search = search_ptr;
+    for (;;) {
+        MARKER_ID k0 = __sync_fetch_and_add(&search->next, NEAREST_CHUNK);
+        if (k0 >= search->n)
+            break;
+        MARKER_ID k1 = k0 + NEAREST_CHUNK < search->n ? k0 + NEAREST_CHUNK : search->n;
+        for (MARKER_ID k = k0; k < k1; k++) {
+            if (search->targets) {
+                search->nearest[k] = index_nearest(search->index, search->targets[k]);
+                continue;
+            }
+            MARKER_ID b = index_nearest(search->index, k);
+            if (0 <= b && b < k) {
+                search->n_nghbr[k] = b;
+                search->mindist[k] = mg_distance(search->info, search->g, k, b);
+            } else
+                search->n_nghbr[k] = -1;
+        }
+    }
+    return NULL;
+}
+
+static void *search_nearest_thread(void *search_ptr) {
+    set_allocation_flag(((NEAREST_SEARCH*)search_ptr)->allocation_flag);
+    search_nearest(search_ptr);
+    stats_flush(((NEAREST_SEARCH*)search_ptr)->worker_stats);
+    return NULL;
+}
+
+// Search nearest neighbors with up to info->n_threads threads, this one included.
+static void search_all_nearest(NEAREST_SEARCH *search) {
+    int n_threads = search->info->n_threads;
+    if (search->n < PARALLEL_MIN_MARKERS)
+        n_threads = 1;
+    STATS_DECL(worker_stats);
+#ifdef LULU_MERGE_STATS
+    search->worker_stats = worker_stats;
+#endif
+    search->allocation_flag = allocation_flag();
+    // Without room for thread ids, this thread searches alone.
+    NewArrayDecl(pthread_t, ids, n_threads);
+    int n_started = 0;
+    for (int i = 1; ids && i < n_threads; i++)
+        if (pthread_create(ids + n_started, NULL, search_nearest_thread, search) == 0)
+            n_started++;
+    search_nearest(search);
+    for (int i = 0; i < n_started; i++)
+        pthread_join(ids[i], NULL);
+    stats_join(worker_stats);
+    Free(ids);
+}
+
 /**
  * Repeatedly merge the closest pair of the given markers until they don't overlap.
  *
@@ -30,53 +199,138 @@
  * The number of markers after merging is returned. Zero or more of these will be
  * marked deleted_p and should be ignored.
  *
+ * If cancel_p is non-null, the merge stops early once *cancel_p becomes non-zero,
+ * possibly from another thread. The markers are then only partly merged, but
+ * still consistent. Merges on threads with an allocation flag pass it here, so
+ * they stop the same way if allocation fails. See utility.h.
+ *
  * This algorithm is O(n k log n), where k is the maximum number of simultaneously
  * overlapping markers in the original, unmerged set.
  */
-int merge_markers_fast(MARKER_INFO *info, MARKER *markers, int n_markers) {
-    int augmented_length = 2 * n_markers - 1;
-    NewArrayDecl(int, n_nghbr, augmented_length);
-    NewArrayDecl(MARKER_DISTANCE, mindist, augmented_length);
-    NewArrayDecl(int, inv_nghbr_head, augmented_length);
-    NewArrayDecl(int, inv_nghbr_next, augmented_length);
-    NewArrayDecl(int, tmp, augmented_length); // Too big
-    // Do not free the following array!  It's owned by the priority queue.
-    NewArrayDecl(int, heap, augmented_length); // Too big
-
-    // Specialized quadtree supports finding closest marker to any given one.
-    QUADTREE_DECL(qt);
+MARKER_ID merge_markers_fast(MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers, volatile int *cancel_p) {
+    MERGE_WORKSPACE_DECL(workspace);
+    n_markers = merge_markers_in(workspace, info, markers, n_markers, cancel_p);
+    merge_workspace_clear(workspace);
+    return n_markers;
+}
 
-    // Priority queue keyed on distances of overlapping pairs of markers.
-    PRIORITY_QUEUE_DECL(pq);
+void merge_workspace_init(MERGE_WORKSPACE *workspace) {
+    workspace->max_size = 0;
+    workspace->n_nghbr = NULL;
+    workspace->mindist = NULL;
+    workspace->inv_nghbr_head = workspace->inv_nghbr_next = NULL;
+    workspace->tmp = NULL;
+    workspace->max_tmp = 0;
+    mg_init(workspace->geometry);
+    pq_init(workspace->pq);
+    index_init(workspace->index);
+    workspace->workers = NULL;
+    workspace->n_workers = 0;
+    workspace->trace = NULL;
+}
 
-    /// Extent of markers in the domain.
-    MARKER_EXTENT ext[1];
+void merge_workspace_clear(MERGE_WORKSPACE *workspace) {
+    Free(workspace->n_nghbr);
+    Free(workspace->mindist);
+    Free(workspace->inv_nghbr_head);
+    Free(workspace->inv_nghbr_next);
+    Free(workspace->tmp);
+    mg_clear(workspace->geometry);
+    pq_clear(workspace->pq);
+    index_clear(workspace->index);
+    for (int i = 0; i < workspace->n_workers; i++)
+        merge_workspace_clear(workspace->workers + i);
+    Free(workspace->workers);
+    merge_workspace_init(workspace);
+}
 
-    // Get a bounding box for the whole collection of markers.
-    get_marker_array_extent(markers, n_markers, ext);
+// Make sure the workspace arrays have room for the given number of markers.
+// Return 0, or -1 if allocation fails.
+static int reserve_workspace(MERGE_WORKSPACE *workspace, MARKER_ID max_size) {
+    if (max_size > workspace->max_size) {
+        RenewArray(workspace->n_nghbr, max_size);
+        RenewArray(workspace->mindist, max_size);
+        RenewArray(workspace->inv_nghbr_head, max_size);
+        RenewArray(workspace->inv_nghbr_next, max_size);
+        if (allocation_failed_p())
+            return -1;
+        workspace->max_size = max_size;
+    }
+    return 0;
+}
+
+// Append marker i to tmp, which has the given size, and return the new size.
+// If allocation fails, it's dropped, and the merge stops.
+static MARKER_ID push_tmp(MERGE_WORKSPACE *workspace, MARKER_ID tmp_size, MARKER_ID i) {
+    EnsureArraySize(workspace->tmp, workspace->max_tmp, tmp_size + 1);
+    if (tmp_size < workspace->max_tmp)
+        workspace->tmp[tmp_size++] = i;
+    return tmp_size;
+}
+
+MARKER_ID merge_markers_in(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers,
+        volatile int *cancel_p) {
+    if (info->n_threads > 1 && n_markers >= PARALLEL_MIN_MARKERS && !workspace->trace)
+        return merge_markers_parallel(workspace, info, markers, n_markers, cancel_p);
+    return merge_markers_serial(workspace, info, markers, n_markers, cancel_p);
+}
+
+// Set up the workspace for a merge of the given markers: their geometry, the
+// index holding them, their nearest neighbors, and the queue of those. Return
+// 0, or -1 if allocation fails, when the merge can't start.
+static int start_merge(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers) {
+    start_phase(workspace);
+    MARKER_ID augmented_length = 2 * n_markers - 1;
+    if (reserve_workspace(workspace, augmented_length) != 0)
+        return -1;
+    MARKER_ID *n_nghbr = workspace->n_nghbr;
+    MARKER_DISTANCE *mindist = workspace->mindist;
+    MARKER_ID *inv_nghbr_head = workspace->inv_nghbr_head;
+    MARKER_ID *inv_nghbr_next = workspace->inv_nghbr_next;
+
+    // Centers, radii, and deletions of the markers, laid out for fast scanning.
+    MARKER_GEOMETRY *g = workspace->geometry;
+    mg_reserve(g, augmented_length);
+    if (g->max_size < augmented_length)
+        return -1;
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        mg_set_marker(g, i, markers + i);
+    end_phase(workspace, PHASE_SETUP);
+
+    // Specialized quadtree or grid supports finding closest marker to any given one.
+    NEAREST_INDEX *index = workspace->index;
+    index_setup(index, info, g, n_markers);
+    if (allocation_failed_p())
+        return -1;
 
-    // Set up the quadtree with the bounding box. Choose tree depth heuristically.
-    int max_depth = high_bit_position(n_markers) / 4 + 3;
-    qt_setup(qt, max_depth, ext->x, ext->y, ext->w, ext->h, info);
+    // Priority queue keyed on distances of overlapping pairs of markers.
+    // Each live marker has at most one entry, so n_markers is room enough.
+    PRIORITY_QUEUE *pq = workspace->pq;
 
-    // Insert all the markers in the quadtree.
-    for (int i = 0; i < n_markers; i++)
-        qt_insert(qt, markers + i);
+    // Insert all the markers in the index.
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        index_insert(index, i);
 
     // Set all the inverse nearest neighbor links to null.
-    for (int i = 0; i < augmented_length; i++)
+    for (MARKER_ID i = 0; i < augmented_length; i++)
         inv_nghbr_head[i] = inv_nghbr_next[i] = -1;
+    end_phase(workspace, PHASE_INDEX);
+
+    // Find the nearest neighbors, in parallel if allowed.
+    NEAREST_SEARCH search[1] = {{
+        .index = index, .info = info, .g = g, .n_nghbr = n_nghbr, .mindist = mindist, .n = n_markers
+    }};
+    search_all_nearest(search);
 
     // Initialize the heap by adding an index for each overlapping pair. The
     // The heap holds indices into the array of min-distance keys. An index for
     // pair a->bis added iff markers with indices a and b overlap and b < a.
-    int heap_size = 0;
-    for (int a = 0; a < n_markers; a++) {
-        int b = qt_nearest_wrt(markers, qt, a);
-        if (0 <= b && b < a) {
-            n_nghbr[a] = b;
-            mindist[a] = mr_distance(info, markers + a, markers + b);
-            heap[heap_size++] = a;
+    // The indices are collected in tmp.
+    MARKER_ID heap_size = 0;
+    for (MARKER_ID a = 0; a < n_markers; a++) {
+        MARKER_ID b = n_nghbr[a];
+        if (b >= 0) {
+            heap_size = push_tmp(workspace, heap_size, a);
 
             // Here we are building a linked list of markers that have b as nearest.
             inv_nghbr_next[a] = inv_nghbr_head[b];
@@ -84,70 +338,532 @@ int merge_markers_fast(MARKER_INFO *info, MARKER *markers, int n_markers) {
         }
     }
 
-    // Now install the raw heap array into the priority queue. After this it's owned by the queue.
-    pq_set_up_heap(pq, heap, heap_size, mindist, augmented_length); // Too big
+    // Now install the raw heap array into the priority queue.
+    pq_set_up_heap(pq, workspace->tmp, heap_size, mindist, n_markers, augmented_length);
+    end_phase(workspace, PHASE_NEAREST);
+    return allocation_failed_p() ? -1 : 0;
+}
+
+// Append the undeleted markers on the inv list of marker a to tmp, which
+// has the given size, and return the new size.
+static MARKER_ID push_inverse(MERGE_WORKSPACE *workspace, MARKER_ID a, MARKER_ID tmp_size) {
+    MARKER_ID length = 0;
+    for (MARKER_ID p = workspace->inv_nghbr_head[a]; p >= 0; p = workspace->inv_nghbr_next[p]) {
+        length++;
+        if (!mg_deleted_p(workspace->geometry, p))
+            tmp_size = push_tmp(workspace, tmp_size, p);
+    }
+    STAT_ADD(inverse_lists, 1);
+    STAT_ADD(inverse_total, length);
+    STAT_MAX(inverse_max, length);
+    return tmp_size;
+}
+
+MARKER_ID merge_markers_serial(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers,
+        volatile int *cancel_p) {
+    if (n_markers <= 0 || start_merge(workspace, info, markers, n_markers) != 0)
+        return n_markers;
+    MARKER_ID *n_nghbr = workspace->n_nghbr;
+    MARKER_DISTANCE *mindist = workspace->mindist;
+    MARKER_ID *inv_nghbr_head = workspace->inv_nghbr_head;
+    MARKER_ID *inv_nghbr_next = workspace->inv_nghbr_next;
+    MARKER_GEOMETRY *g = workspace->geometry;
+    NEAREST_INDEX *index = workspace->index;
+    PRIORITY_QUEUE *pq = workspace->pq;
+
+    // Record the merge from here on if tracing. Replays redo the setup.
+    FILE *trace = workspace->trace;
+    if (trace) {
+        mt_start(trace, info, g, n_markers);
+        for (MARKER_ID a = 0; a < n_markers; a++)
+            mt_nearest(trace, a, n_nghbr[a]);
+        mt_event(trace, MT_HEAP, pq->size);
+    }
 
-    while (!pq_empty_p(pq)) {
+    while (!pq_empty_p(pq) && !(cancel_p && *cancel_p)) {
 
         // Get nearest pair from priority queue.
-        int a = pq_get_min(pq);
-        int b = n_nghbr[a];
+        MARKER_ID a = pq_get_min(pq);
+        MARKER_ID b = n_nghbr[a];
+        if (trace)
+            mt_pop(trace, a, b);
 
         // Delete both of the nearest pair from all data structures.
         pq_delete(pq, b);
-        qt_delete(qt, markers + a);
-        qt_delete(qt, markers + b);
+        index_delete(index, a);
+        index_delete(index, b);
         mr_set_deleted(markers + a);
         mr_set_deleted(markers + b);
+        mg_set_deleted(g, a);
+        mg_set_deleted(g, b);
 
         // Capture the inv lists of both a and b in tmp.
-        int tmp_size = 0;
-        for (int p = inv_nghbr_head[a]; p >= 0; p = inv_nghbr_next[p])
-            if (!markers[p].deleted_p)
-                tmp[tmp_size++] = p;
-        for (int p = inv_nghbr_head[b]; p >= 0; p = inv_nghbr_next[p])
-            if (!markers[p].deleted_p)
-                tmp[tmp_size++] = p;
+        MARKER_ID tmp_size = push_inverse(workspace, a, 0);
+        tmp_size = push_inverse(workspace, b, tmp_size);
 
         // Create a new merged marker. Adding it after all others means
         // nothing already in the heap could have it as nearest.
-        int aa = n_markers++;
+        MARKER_ID aa = n_markers++;
         mr_merge(info, markers, aa, a, b);
+        mg_set_marker(g, aa, markers + aa);
+        if (trace)
+            mt_new(trace, g, aa);
 
-        // Add to quadtree.
-        qt_insert(qt, markers + aa);
+        // Add to the index.
+        index_insert(index, aa);
 
         // Find nearest overlapping neighbor of the merged marker, if any.
-        int bb = qt_nearest_wrt(markers, qt, aa);
+        MARKER_ID bb = index_nearest(index, aa);
+        if (trace)
+            mt_nearest(trace, aa, bb);
         if (0 <= bb) {
             n_nghbr[aa] = bb;
-            mindist[aa] = mr_distance(info, markers + aa, markers + bb);
+            mindist[aa] = mg_distance(info, g, aa, bb);
             pq_add(pq, aa);
+            if (trace)
+                mt_event(trace, MT_ADD, aa);
             inv_nghbr_next[aa] = inv_nghbr_head[bb];
             inv_nghbr_head[bb] = aa;
         }
 
         // Reset the nearest neighbors of the inverse neighbors of the deletions.
-        for (int i = 0; i < tmp_size; i++) {
-            int aa = tmp[i];
-            int bb = qt_nearest_wrt(markers, qt, aa);
+        for (MARKER_ID i = 0; i < tmp_size; i++) {
+            MARKER_ID aa = workspace->tmp[i];
+            MARKER_ID bb = index_nearest(index, aa);
+            if (trace)
+                mt_nearest(trace, aa, bb);
             if (0 <= bb && bb < aa) {
                 n_nghbr[aa] = bb;
-                mindist[aa] = mr_distance(info, markers + aa, markers + bb);
+                mindist[aa] = mg_distance(info, g, aa, bb);
                 pq_update(pq, aa);
                 inv_nghbr_next[aa] = inv_nghbr_head[bb];
                 inv_nghbr_head[bb] = aa;
+                if (trace)
+                    mt_event(trace, MT_UPDATE, aa);
             } else {
                 pq_delete(pq, aa);
+                if (trace)
+                    mt_event(trace, MT_DELETE, aa);
+            }
+        }
+    }
+    if (trace)
+        mt_event(trace, MT_END, n_markers);
+    end_phase(workspace, PHASE_LOOP);
+    return n_markers;
+}
+
+// Claims of the pairs taken in a round of merge_markers_in_rounds on boxes
+// around them. Level l of a hierarchy of grids has cells of side 2^l times
+// that of level 0. A box is claimed in the cells of the lowest level where it
+// spans at most 2 x 2, and the cells it spans at higher levels are marked as
+// having claims below. So a box meets an earlier one only if one of its own
+// cells was claimed or marked, or one of its cells at a higher level was
+// claimed. Cells are kept in a hash table, which is emptied for the next
+// round by advancing the round number.
+typedef struct claims_s {
+    double x, y;                // origin of cells
+    double side;                // of level 0 cells
+    int top;                    // level where a cell covers all markers
+    int round;
+    int n_cells;                // cells claimed or marked in this round
+    int full_p;                 // whether a box bigger than the top cell was claimed
+    struct claim_cell_s {
+        int64_t key;
+        int claimed_round, marked_round;
+    } *cells;
+} CLAIMS;
+
+// Most hash table cells used in a round, half its size. A small table stays
+// in cache, and rounds rarely need more.
+#define MAX_CLAIM_CELLS (1 << 12)
+
+// Most pairs a round takes off the queue.
+#define ROUND_MAX_PAIRS 4096
+
+// A round ends when it has put back this many more pairs than it merges. Near
+// one another, as in dense clusters, few pairs are independent, and taking
+// more only to put them back costs more than it saves.
+#define ROUND_MAX_EXCESS_PUT_BACK 64
+
+static void claims_init(CLAIMS *claims, MARKER *markers, MARKER_ID n_markers) {
+    MARKER_EXTENT ext[1];
+    get_marker_array_extent(markers, n_markers, ext);
+    MARKER_SUM r_sum = 0;
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        r_sum += mr_r(markers + i);
+    double span = ext->w > ext->h ? ext->w : ext->h;
+    claims->x = ext->x;
+    claims->y = ext->y;
+    claims->side = 2 * r_sum / n_markers;
+    if (!(claims->side > span / (1 << 20)))
+        claims->side = span > 0 ? span / (1 << 20) : 1;
+    claims->top = 0;
+    while (ldexp(claims->side, claims->top) < span)
+        claims->top++;
+    claims->round = 0;
+    NewArray(claims->cells, 2 * MAX_CLAIM_CELLS);
+    if (!claims->cells)
+        return;
+    for (int k = 0; k < 2 * MAX_CLAIM_CELLS; k++)
+        claims->cells[k].claimed_round = claims->cells[k].marked_round = -1;
+}
+
+static void claims_start_round(CLAIMS *claims) {
+    claims->round++;
+    claims->n_cells = 0;
+    claims->full_p = 0;
+}
+
+// Return the hash table cell for level l, column cx, and row cy. It's
+// unused in this round if neither claimed nor marked.
+static struct claim_cell_s *claim_cell(CLAIMS *claims, int l, int64_t cx, int64_t cy) {
+    int64_t key = ((int64_t)l << 58) ^ ((cx & 0x1fffffff) << 29) ^ (cy & 0x1fffffff);
+    unsigned k = (unsigned)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> 40) & (2 * MAX_CLAIM_CELLS - 1);
+    for (;;) {
+        struct claim_cell_s *cell = claims->cells + k;
+        if (cell->claimed_round != claims->round && cell->marked_round != claims->round) {
+            cell->key = key;
+            return cell;
+        }
+        if (cell->key == key)
+            return cell;
+        k = (k + 1) & (2 * MAX_CLAIM_CELLS - 1);
+    }
+}
+
+// Get the range of cells of level l the box spans.
+static void claim_cells(CLAIMS *claims, PM_BOX *box, int l,
+        int64_t *cx0, int64_t *cy0, int64_t *cx1, int64_t *cy1) {
+    double scale = 1 / ldexp(claims->side, l);
+    double limit = 1 << 28;
+    *cx0 = (int64_t)fmax(-limit, fmin(limit, floor((box->x0 - claims->x) * scale)));
+    *cy0 = (int64_t)fmax(-limit, fmin(limit, floor((box->y0 - claims->y) * scale)));
+    *cx1 = (int64_t)fmax(-limit, fmin(limit, floor((box->x1 - claims->x) * scale)));
+    *cy1 = (int64_t)fmax(-limit, fmin(limit, floor((box->y1 - claims->y) * scale)));
+}
+
+// Claim the given box. Return 1 if it meets no box claimed before in this
+// round, or 0 if it does, or -1 without claiming it if the round has no room.
+static int claim(CLAIMS *claims, PM_BOX *box) {
+    if (claims->full_p || claims->n_cells > MAX_CLAIM_CELLS - 4 * (claims->top + 1))
+        return -1;
+    double span = fmax(box->x1 - box->x0, box->y1 - box->y0);
+    int level = 0;
+    while (level <= claims->top && ldexp(claims->side, level) < span)
+        level++;
+    if (level > claims->top) {
+        // Bigger than a top cell, so it can only be claimed alone.
+        if (claims->n_cells > 0)
+            return -1;
+        claims->full_p = 1;
+        return 1;
+    }
+    int free_p = 1;
+    for (int l = level; l <= claims->top; l++) {
+        int64_t cx0, cy0, cx1, cy1;
+        claim_cells(claims, box, l, &cx0, &cy0, &cx1, &cy1);
+        for (int64_t cy = cy0; cy <= cy1; cy++)
+            for (int64_t cx = cx0; cx <= cx1; cx++) {
+                struct claim_cell_s *cell = claim_cell(claims, l, cx, cy);
+                if (cell->claimed_round != claims->round && cell->marked_round != claims->round)
+                    claims->n_cells++;
+                if (cell->claimed_round == claims->round || (l == level && cell->marked_round == claims->round))
+                    free_p = 0;
+                if (l == level)
+                    cell->claimed_round = claims->round;
+                else
+                    cell->marked_round = claims->round;
             }
+    }
+    return free_p;
+}
+
+// Extend a box to cover the bounding square of marker i, padded a little
+// for rounding so squares of overlapping markers surely meet.
+static void cover_marker(PM_BOX *box, MARKER_GEOMETRY *g, MARKER_ID i) {
+    double x = mg_x(g, i), y = mg_y(g, i), r = mg_r(g, i);
+    double pad_x = 4 * MARKER_DISTANCE_EPSILON * (fabs(x) + r) + MARKER_DISTANCE_MIN;
+    double pad_y = 4 * MARKER_DISTANCE_EPSILON * (fabs(y) + r) + MARKER_DISTANCE_MIN;
+    box->x0 = fmin(box->x0, x - r - pad_x);
+    box->y0 = fmin(box->y0, y - r - pad_y);
+    box->x1 = fmax(box->x1, x + r + pad_x);
+    box->y1 = fmax(box->y1, y + r + pad_y);
+}
+
+/**
+ * Merge as merge_markers_serial, but in rounds. Each round takes pairs off the
+ * queue in order and merges at once those with neighborhoods meeting none of
+ * the pairs taken before. The neighborhood of a pair covers both markers, the
+ * marker they merge to, and the markers having either as nearest neighbor, so
+ * it holds all the markers whose nearest neighbors the merge changes. The
+ * nearest neighbors of all those are then searched with up to info->n_threads
+ * threads, and the queue updated. The other pairs go back on the queue.
+ *
+ * Each merge of a round is one the serial merge would make, with the same
+ * distance, if no merge of the round makes a pair closer than the last one
+ * taken. So when the pairs are truly independent, the result is the same.
+ * Otherwise the serial merge may merge a new marker before pairs merged in the
+ * same round, and the results can differ.
+ */
+MARKER_ID merge_markers_in_rounds(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers,
+        volatile int *cancel_p) {
+    if (n_markers <= 0 || start_merge(workspace, info, markers, n_markers) != 0)
+        return n_markers;
+    MARKER_ID *n_nghbr = workspace->n_nghbr;
+    MARKER_DISTANCE *mindist = workspace->mindist;
+    MARKER_ID *inv_nghbr_head = workspace->inv_nghbr_head;
+    MARKER_ID *inv_nghbr_next = workspace->inv_nghbr_next;
+    MARKER_GEOMETRY *g = workspace->geometry;
+    NEAREST_INDEX *index = workspace->index;
+    PRIORITY_QUEUE *pq = workspace->pq;
+
+    CLAIMS claims[1];
+    claims_init(claims, markers, n_markers);
+    NewArrayDecl(MARKER_ID, taken, ROUND_MAX_PAIRS);
+    NewArrayDecl(unsigned char, merge_p, ROUND_MAX_PAIRS);
+    MARKER_ID *nearest = NULL;
+    MARKER_ID max_nearest = 0;
+
+    // Without its arrays, the merge stops before the first round.
+    while (claims->cells && taken && merge_p && !pq_empty_p(pq) && !(cancel_p && *cancel_p)) {
+        claims_start_round(claims);
+
+        // Take pairs in order until the round has no room for more. Markers
+        // they'd merge to are set up in the order they'll be added.
+        int n_taken = 0, n_merged = 0;
+        while (!pq_empty_p(pq) && n_taken < ROUND_MAX_PAIRS &&
+                n_taken - 2 * n_merged < ROUND_MAX_EXCESS_PUT_BACK) {
+            MARKER_ID a = pq_peek_min(pq);
+            MARKER_ID b = n_nghbr[a];
+            MARKER_ID aa = n_markers + n_merged;
+            mr_merge(info, markers, aa, a, b);
+            mg_set_marker(g, aa, markers + aa);
+            PM_BOX box[1] = {{ HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL }};
+            cover_marker(box, g, a);
+            cover_marker(box, g, b);
+            cover_marker(box, g, aa);
+            MARKER_ID tmp_size = push_inverse(workspace, a, 0);
+            tmp_size = push_inverse(workspace, b, tmp_size);
+            for (MARKER_ID i = 0; i < tmp_size; i++)
+                cover_marker(box, g, workspace->tmp[i]);
+            int free_p = claim(claims, box);
+            if (free_p < 0)
+                break;
+            pq_get_min(pq);
+            merge_p[n_taken] = free_p;
+            taken[n_taken++] = a;
+            n_merged += free_p;
+        }
+
+        // Put back the pairs not merged.
+        for (int k = 0; k < n_taken; k++)
+            if (!merge_p[k])
+                pq_add(pq, taken[k]);
+
+        // Merge the others, collecting the markers needing new nearest
+        // neighbors: each merged marker, then the inverse neighbors of its parts.
+        MARKER_ID n_old = n_markers;
+        MARKER_ID tmp_size = 0;
+        for (int k = 0; k < n_taken; k++) {
+            if (!merge_p[k])
+                continue;
+            MARKER_ID a = taken[k];
+            MARKER_ID b = n_nghbr[a];
+            pq_delete(pq, b);
+            index_delete(index, a);
+            index_delete(index, b);
+            mr_set_deleted(markers + a);
+            mr_set_deleted(markers + b);
+            mg_set_deleted(g, a);
+            mg_set_deleted(g, b);
+            MARKER_ID aa = n_markers++;
+            index_insert(index, aa);
+            tmp_size = push_tmp(workspace, tmp_size, aa);
+            tmp_size = push_inverse(workspace, a, tmp_size);
+            tmp_size = push_inverse(workspace, b, tmp_size);
+        }
+
+        // Search their nearest neighbors. No other merge of the round affects them.
+        EnsureArraySize(nearest, max_nearest, tmp_size);
+        if (max_nearest < tmp_size)
+            break;
+        NEAREST_SEARCH search[1] = {{
+            .index = index, .info = info, .g = g, .targets = workspace->tmp, .nearest = nearest, .n = tmp_size
+        }};
+        search_all_nearest(search);
+
+        // Update the queue as the serial merge does.
+        for (MARKER_ID k = 0; k < tmp_size; k++) {
+            MARKER_ID aa = workspace->tmp[k];
+            MARKER_ID bb = nearest[k];
+            if (0 <= bb && bb < aa) {
+                n_nghbr[aa] = bb;
+                mindist[aa] = mg_distance(info, g, aa, bb);
+                if (aa >= n_old)
+                    pq_add(pq, aa);
+                else
+                    pq_update(pq, aa);
+                inv_nghbr_next[aa] = inv_nghbr_head[bb];
+                inv_nghbr_head[bb] = aa;
+            } else if (aa < n_old)
+                pq_delete(pq, aa);
         }
     }
-    qt_clear(qt);
-    pq_clear(pq);
-    Free(n_nghbr);
-    Free(mindist);
-    Free(inv_nghbr_head);
-    Free(inv_nghbr_next);
-    Free(tmp);
+    end_phase(workspace, PHASE_LOOP);
+    Free(claims->cells);
+    Free(taken);
+    Free(merge_p);
+    Free(nearest);
     return n_markers;
 }
+
+// A hash table entry holding the marker that aggregates a grid cell so far.
+typedef struct aggregate_cell_s {
+    int64_t key;
+    MARKER_ID marker;   // -1 if the entry is unused
+} AGGREGATE_CELL;
+
+// Grid coordinate of a marker coordinate, clamped so keys stay unique.
+static int64_t grid_coord(MARKER_COORD v, MARKER_COORD origin, MARKER_DISTANCE cell_size) {
+    double c = floor((v - origin) / cell_size);
+    return c < INT32_MAX ? (int64_t)c : INT32_MAX;
+}
+
+/**
+ * Merge approximately in time linear in the number of markers. First all
+ * markers with centers in the same square grid cell of the given side are
+ * merged, one at a time in index order, by the same rule as merge_markers_fast.
+ * Then the much smaller set of cell aggregates is merged exactly with
+ * merge_markers_in. Markers of both steps record their parts, so clusters
+ * can be walked as after an exact merge.
+ *
+ * The exact step leaves no overlapping markers, so the approximation only
+ * ever merges too much. Its error is returned in *error: the fraction of the
+ * total size in leaves that were aggregated into a cell marker they don't
+ * overlap, which an exact merge might have kept apart.
+ *
+ * The markers array needs room for 2n-1 markers, as for merge_markers_fast.
+ */
+MARKER_ID merge_markers_approximate(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID n_markers,
+        MARKER_DISTANCE cell_size, double *error, volatile int *cancel_p) {
+    *error = 0;
+    if (n_markers <= 0)
+        return n_markers;
+
+    MARKER_EXTENT ext[1];
+    get_marker_array_extent(markers, n_markers, ext);
+    size_t mask = 1;
+    while (mask < 2 * (size_t)n_markers)
+        mask <<= 1;
+    mask--;
+    NewArrayDecl(AGGREGATE_CELL, cells, mask + 1);
+    NewArrayDecl(size_t, cell_of, n_markers);
+    if (!cells || !cell_of) {
+        Free(cells);
+        Free(cell_of);
+        return n_markers;
+    }
+    for (size_t k = 0; k <= mask; k++)
+        cells[k].marker = -1;
+
+    // Aggregate each marker into its cell's marker so far, if any.
+    MARKER_ID size = n_markers;
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        int64_t key = (grid_coord(mr_x(markers + i), ext->x, cell_size) << 32) |
+                grid_coord(mr_y(markers + i), ext->y, cell_size);
+        // Rotated so tables of fewer than 2^32 cells use the high bits of the product.
+        uint64_t h = (uint64_t)key * 0x9e3779b97f4a7c15ull;
+        size_t k = (size_t)(h >> 32 | h << 32) & mask;
+        while (cells[k].marker >= 0 && cells[k].key != key)
+            k = (k + 1) & mask;
+        if (cells[k].marker < 0) {
+            cells[k].key = key;
+            cells[k].marker = i;
+        } else {
+            mr_merge(info, markers, size, i, cells[k].marker);
+            mr_set_deleted(markers + i);
+            mr_set_deleted(markers + cells[k].marker);
+            cells[k].marker = size++;
+        }
+        cell_of[i] = k;
+    }
+
+    // Measure the size aggregated into cell markers it doesn't overlap.
+    double missed = 0, total = 0;
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        MARKER_ID aggregate = cells[cell_of[i]].marker;
+        total += markers[i].size;
+        if (aggregate != i && mr_distance(info, markers + i, markers + aggregate) >= 0)
+            missed += markers[i].size;
+    }
+    *error = total > 0 ? missed / total : 0;
+    Free(cells);
+    Free(cell_of);
+
+    // Merge copies of the cell aggregates exactly, in index order.
+    MARKER_ID n_aggregates = 2 * n_markers - size;
+    NewArrayDecl(MARKER_ID, aggregates, n_aggregates);
+    NewArrayDecl(MARKER, merged, 2 * n_aggregates - 1);
+    if (!aggregates || !merged) {
+        Free(aggregates);
+        Free(merged);
+        return size;
+    }
+    MARKER_ID j = 0;
+    for (MARKER_ID i = 0; i < size; i++)
+        if (!mr_deleted_p(markers + i)) {
+            aggregates[j] = i;
+            merged[j] = markers[i];
+            mr_reset_parts(merged + j);
+            j++;
+        }
+    MARKER_ID n_merged = merge_markers_in(workspace, info, merged, n_aggregates, cancel_p);
+
+    // Copy back the result, with parts translated to indices in markers.
+    MARKER_ID base = size - n_aggregates;
+    for (MARKER_ID i = 0; i < n_aggregates; i++)
+        if (mr_deleted_p(merged + i))
+            mr_set_deleted(markers + aggregates[i]);
+    for (MARKER_ID i = n_aggregates; i < n_merged; i++) {
+        MARKER *marker = markers + base + i;
+        *marker = merged[i];
+        MARKER_ID a = marker->part_a, b = marker->part_b;
+        marker->part_a = a < n_aggregates ? aggregates[a] : base + a;
+        marker->part_b = b < n_aggregates ? aggregates[b] : base + b;
+    }
+    Free(aggregates);
+    Free(merged);
+    return base + n_merged;
+}
+
+/**
+ * Find the cluster each input marker belongs to after a merge of n_inputs
+ * markers that produced n_markers. Clusters are numbered in the order their
+ * undeleted markers appear in the array, which is the order left by compress.
+ * So clusters[i] is the index the merged marker containing input i will have
+ * after compression.
+ *
+ * The number of clusters is returned, or -1 if allocation fails.
+ */
+MARKER_ID merge_clusters(MARKER *markers, MARKER_ID n_inputs, MARKER_ID n_markers, MARKER_ID *clusters) {
+    NewArrayDecl(MARKER_ID, roots, n_markers > 0 ? n_markers : 1);
+    if (!roots)
+        return -1;
+
+    // Number the undeleted markers, which are the cluster roots.
+    MARKER_ID n_clusters = 0;
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        roots[i] = mr_deleted_p(markers + i) ? -1 : n_clusters++;
+
+    // Merged markers always follow their parts, so a backward sweep
+    // passes each root's number down to its parts before they're reached.
+    for (MARKER_ID i = n_markers - 1; i >= n_inputs; i--) {
+        MARKER *marker = markers + i;
+        if (mr_merged(marker))
+            roots[marker->part_a] = roots[marker->part_b] = roots[i];
+    }
+    CopyArray(clusters, roots, n_inputs);
+    Free(roots);
+    return n_clusters;
+}
@@ -10,8 +10,104 @@
 
 #include "namespace.h"
 #include "marker.h"
+#include "pq.h"
+#include "qt.h"
+#include "grid.h"
+#include "stats.h"
+#include "mt.h"
 
-#define merge_markers_fast(Info, Markers, MarkersSize)  NAME(merge_markers_fast)(Info, Markers, MarkersSize)
-int merge_markers_fast(MARKER_INFO *info, MARKER *markers, int markers_size);
+// The spatial index a merge uses, either a quadtree, loose or not, or a grid.
+typedef struct nearest_index_s {
+    int grid_p;
+    QUADTREE qt[1];
+    GRID grid[1];
+} NEAREST_INDEX;
+
+#define index_init(I)   NAME(index_init)(I)
+void index_init(NEAREST_INDEX *index);
+
+#define index_clear(I)  NAME(index_clear)(I)
+void index_clear(NEAREST_INDEX *index);
+
+// Choose and set up the index for the first n_markers markers of the geometry,
+// reusing its memory. It's empty until they're inserted.
+#define index_setup(I, Info, G, NMarkers)   NAME(index_setup)(I, Info, G, NMarkers)
+void index_setup(NEAREST_INDEX *index, MARKER_INFO *info, MARKER_GEOMETRY *g, MARKER_ID n_markers);
+
+#define index_insert(I, M)  NAME(index_insert)(I, M)
+void index_insert(NEAREST_INDEX *index, MARKER_ID i);
+
+#define index_delete(I, M)  NAME(index_delete)(I, M)
+void index_delete(NEAREST_INDEX *index, MARKER_ID i);
+
+// The marker in the index nearest marker a that overlaps it, or -1 if none.
+#define index_nearest(I, A) NAME(index_nearest)(I, A)
+MARKER_ID index_nearest(NEAREST_INDEX *index, MARKER_ID a);
+
+// Everything a merge allocates. Merges given the same workspace reuse its
+// memory, growing it as needed.
+typedef struct merge_workspace_s {
+    MARKER_ID max_size;             // markers the arrays below have room for
+    MARKER_ID *n_nghbr;             // nearest neighbor of each marker
+    MARKER_DISTANCE *mindist;       // and its distance
+    MARKER_ID *inv_nghbr_head, *inv_nghbr_next; // lists of markers having each as nearest
+    MARKER_ID *tmp;                 // scratch list of markers
+    MARKER_ID max_tmp;
+    MARKER_GEOMETRY geometry[1];
+    PRIORITY_QUEUE pq[1];
+    NEAREST_INDEX index[1];
+    struct merge_workspace_s *workers; // workspaces of parallel merge threads
+    int n_workers;
+    FILE *trace;                    // where serial merges record their steps, or NULL. See mt.h.
+#ifdef LULU_MERGE_STATS
+    uint64_t phase_start;           // when the phase being timed started
+#endif
+} MERGE_WORKSPACE;
+
+#define MERGE_WORKSPACE_DECL(Name) MERGE_WORKSPACE Name[1]; merge_workspace_init(Name)
+
+#define merge_workspace_init(W) NAME(merge_workspace_init)(W)
+void merge_workspace_init(MERGE_WORKSPACE *workspace);
+
+// Free all the workspace's memory, returning it to the initialized state.
+#define merge_workspace_clear(W) NAME(merge_workspace_clear)(W)
+void merge_workspace_clear(MERGE_WORKSPACE *workspace);
+
+#define merge_markers_fast(Info, Markers, MarkersSize, CancelP)  NAME(merge_markers_fast)(Info, Markers, MarkersSize, CancelP)
+MARKER_ID merge_markers_fast(MARKER_INFO *info, MARKER *markers, MARKER_ID markers_size, volatile int *cancel_p);
+
+// Merge as merge_markers_fast, but with memory from the given workspace, which
+// keeps it for the next merge. Large merges use the parallel merge if
+// info->n_threads is more than 1 and the workspace has no trace. With LULU_MERGE_STATS, this and the other
+// merges below count their work in the calling thread's stats. See stats.h.
+#define merge_markers_in(Workspace, Info, Markers, MarkersSize, CancelP) \
+    NAME(merge_markers_in)(Workspace, Info, Markers, MarkersSize, CancelP)
+MARKER_ID merge_markers_in(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID markers_size,
+        volatile int *cancel_p);
+
+// Merge as merge_markers_in, but without splitting the markers into tiles.
+// Only the initial nearest neighbor search of large merges uses info->n_threads
+// threads.
+#define merge_markers_serial(Workspace, Info, Markers, MarkersSize, CancelP) \
+    NAME(merge_markers_serial)(Workspace, Info, Markers, MarkersSize, CancelP)
+MARKER_ID merge_markers_serial(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID markers_size,
+        volatile int *cancel_p);
+
+// Merge as merge_markers_serial, but merge pairs with neighborhoods that
+// don't meet in rounds. See merger.c.
+#define merge_markers_in_rounds(Workspace, Info, Markers, MarkersSize, CancelP) \
+    NAME(merge_markers_in_rounds)(Workspace, Info, Markers, MarkersSize, CancelP)
+MARKER_ID merge_markers_in_rounds(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID markers_size,
+        volatile int *cancel_p);
+
+// Merge approximately by first aggregating markers in grid cells of the given
+// side, returning in *error the fraction of size aggregated too eagerly. See merger.c.
+#define merge_markers_approximate(Workspace, Info, Markers, MarkersSize, CellSize, Error, CancelP) \
+    NAME(merge_markers_approximate)(Workspace, Info, Markers, MarkersSize, CellSize, Error, CancelP)
+MARKER_ID merge_markers_approximate(MERGE_WORKSPACE *workspace, MARKER_INFO *info, MARKER *markers, MARKER_ID markers_size,
+        MARKER_DISTANCE cell_size, double *error, volatile int *cancel_p);
+
+#define merge_clusters(Markers, NInputs, NMarkers, Clusters)  NAME(merge_clusters)(Markers, NInputs, NMarkers, Clusters)
+MARKER_ID merge_clusters(MARKER *markers, MARKER_ID n_inputs, MARKER_ID n_markers, MARKER_ID *clusters);
 
 #endif /* MERGER_H_ */
@@ -0,0 +1,117 @@
+/*
+ * mf.c
+ *
+ * Marker file headers, writing, and mapping. See mf.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utility.h"
+#include "mf.h"
+
+void mf_header_set(MARKER_FILE_HEADER *h, MARKER_INFO *info, MARKER_ID n_markers, MARKER_ID merged_size) {
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, MF_MAGIC, sizeof h->magic);
+    h->version = MF_VERSION;
+    h->byte_order = MF_BYTE_ORDER;
+    h->coord_size = sizeof(MARKER_COORD);
+    h->marker_size = sizeof(MARKER);
+    h->kind = info->kind;
+    h->index = info->index;
+    h->scale = info->scale;
+    h->n_markers = n_markers;
+    h->merged_size = merged_size;
+}
+
+const char *mf_header_check(MARKER_FILE_HEADER *h, size_t size) {
+    if (size < MF_MARKERS_OFFSET || memcmp(h->magic, MF_MAGIC, sizeof h->magic) != 0)
+        return "not a marker file";
+    if (h->version != MF_VERSION)
+        return "unsupported marker file version";
+    if (h->byte_order != MF_BYTE_ORDER)
+        return "marker file has other byte order";
+    if (h->coord_size != sizeof(MARKER_COORD))
+        return "marker file has other coordinate size";
+    if (h->marker_size != sizeof(MARKER))
+        return "marker file has other marker layout";
+    if (h->n_markers < 0 || h->n_markers > MR_MAX_MARKERS ||
+            h->merged_size < 0 || h->merged_size > h->n_markers ||
+            (h->kind != CIRCLE && h->kind != SQUARE) ||
+            h->index < INDEX_AUTO || h->index > INDEX_LOOSE_QUADTREE)
+        return "marker file header is corrupt";
+    if ((size - MF_MARKERS_OFFSET) / sizeof(MARKER) < (size_t)h->n_markers)
+        return "marker file is truncated";
+    return NULL;
+}
+
+// Mark part p of a merge as used, returning whether it's a deleted marker of
+// lower index than the merge at i that no other merge used. It may be a leaf
+// removed since the merge.
+static int use_part(MARKER *markers, uint32_t *used, MARKER_ID p, MARKER_ID i) {
+    if (p >= i || !mr_deleted_p(markers + p) || (used[p >> 5] & bit(p & 31)))
+        return 0;
+    used[p >> 5] |= bit(p & 31);
+    return 1;
+}
+
+const char *mf_markers_check(MARKER *markers, MARKER_ID n_markers) {
+    size_t n_words = ((size_t)n_markers + 31) / 32;
+    NewArrayDecl(uint32_t, used, n_words > 0 ? n_words : 1);
+    memset(used, 0, n_words * sizeof *used);
+    const char *error = NULL;
+    for (MARKER_ID i = 0; i < n_markers && !error; i++) {
+        MARKER *marker = markers + i;
+        if (mr_merged(marker)) {
+            if (!use_part(markers, used, marker->part_a, i) || !use_part(markers, used, marker->part_b, i))
+                error = "marker file parts are corrupt";
+        } else if (mr_removed_p(marker)) {
+            if (!mr_deleted_p(marker) || marker->part_b > 1)
+                error = "marker file parts are corrupt";
+        } else if (marker->part_a != -1)
+            error = "marker file parts are corrupt";
+    }
+    // Deleted markers that aren't removed must have been merged.
+    for (MARKER_ID i = 0; i < n_markers && !error; i++)
+        if (mr_deleted_p(markers + i) && !mr_removed_p(markers + i) && !(used[i >> 5] & bit(i & 31)))
+            error = "marker file deleted flags are corrupt";
+    Free(used);
+    return error;
+}
+
+int mf_write(FILE *f, MARKER_FILE_HEADER *h, MARKER *markers) {
+    char pad[MF_MARKERS_OFFSET - sizeof *h] = { 0 };
+    if (fwrite(h, sizeof *h, 1, f) != 1 || fwrite(pad, sizeof pad, 1, f) != 1)
+        return -1;
+    if (h->n_markers > 0 && fwrite(markers, sizeof *markers, h->n_markers, f) != (size_t)h->n_markers)
+        return -1;
+    return 0;
+}
+
+void *mf_map(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st[1];
+    void *p = NULL;
+    if (fstat(fd, st) == 0) {
+        *size = st->st_size;
+        // Private and writable, so changes to the markers copy their pages.
+        p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+            p = NULL;
+    }
+    close(fd);
+    return p;
+}
+
+void mf_unmap(void *p, size_t size) {
+    munmap(p, size);
+}
@@ -0,0 +1,74 @@
+/*
+ * mf.h
+ *
+ * Marker files: a marker array and the parameters it was merged with, in a
+ * binary form that's mapped into memory rather than read. The file is a
+ * header padded to MF_MARKERS_OFFSET bytes, then the markers exactly as they
+ * are in memory, so a file is loaded only by a build with the same marker
+ * layout and byte order, which the header records.
+ *
+ * Files are mapped copy-on-write. Processes mapping the same file, e.g.
+ * workers forked from one that loaded it, share its pages until they change
+ * them. A file must not be rewritten in place while mapped.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef MF_H_
+#define MF_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "namespace.h"
+#include "marker.h"
+
+#define MF_MAGIC "LULUMF\r\n"
+#define MF_VERSION 1
+#define MF_BYTE_ORDER 0x01020304u
+
+// Markers start at this offset, aligned for any access including vector loads.
+#define MF_MARKERS_OFFSET 64
+
+typedef struct marker_file_header_s {
+    char magic[8];              // MF_MAGIC
+    uint32_t version;           // MF_VERSION
+    uint32_t byte_order;        // MF_BYTE_ORDER in the writer's order
+    uint32_t coord_size;        // sizeof(MARKER_COORD): 8, or 4 from the float32 build
+    uint32_t marker_size;       // sizeof(MARKER)
+    int32_t kind;               // MARKER_KIND of the merge
+    int32_t index;              // MARKER_INDEX of the merge
+    double scale;               // user scale of the merge
+    int64_t n_markers;
+    int64_t merged_size;        // markers after the last merge, or 0 if unknown
+} MARKER_FILE_HEADER;
+
+// Fill a header for the given markers.
+#define mf_header_set(H, Info, NMarkers, MergedSize) NAME(mf_header_set)(H, Info, NMarkers, MergedSize)
+void mf_header_set(MARKER_FILE_HEADER *h, MARKER_INFO *info, MARKER_ID n_markers, MARKER_ID merged_size);
+
+// Check the header of a file of the given size, returning NULL if its markers
+// can be used, else a message saying why not.
+#define mf_header_check(H, Size)   NAME(mf_header_check)(H, Size)
+const char *mf_header_check(MARKER_FILE_HEADER *h, size_t size);
+
+// Check the parts and deleted flags of the given markers from a marker file,
+// returning NULL if a list can use them, else a message saying why not. Each
+// merged marker's parts must be distinct deleted markers of lower index,
+// part of no other merge, and each other deleted marker must be removed.
+#define mf_markers_check(Markers, NMarkers) NAME(mf_markers_check)(Markers, NMarkers)
+const char *mf_markers_check(MARKER *markers, MARKER_ID n_markers);
+
+// Write the header and markers, returning 0, or -1 with errno set.
+#define mf_write(F, H, Markers)    NAME(mf_write)(F, H, Markers)
+int mf_write(FILE *f, MARKER_FILE_HEADER *h, MARKER *markers);
+
+// Map the file at the given path, returning its address and setting *size,
+// or returning NULL with errno set.
+#define mf_map(Path, Size)  NAME(mf_map)(Path, Size)
+void *mf_map(const char *path, size_t *size);
+
+#define mf_unmap(P, Size)   NAME(mf_unmap)(P, Size)
+void mf_unmap(void *p, size_t size);
+
+#endif /* MF_H_ */
@@ -0,0 +1,11 @@
+/*
+ * mf32.c
+ *
+ * The float32 build of mf.c. See namespace.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#define LULU_FLOAT32
+#include "mf.c"
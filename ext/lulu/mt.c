@@ -0,0 +1,89 @@
+/*
+ * mt.c
+ *
+ * Merge trace writing and field reading. See mt.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "mt.h"
+
+static void put_varint(FILE *f, unsigned long long v) {
+    while (v >= 0x80) {
+        putc((int)(v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int)v, f);
+}
+
+static void put_coord(FILE *f, MARKER_COORD c) {
+    fwrite(&c, sizeof c, 1, f);
+}
+
+static void put_shape(FILE *f, MARKER_GEOMETRY *g, MARKER_ID i) {
+    put_coord(f, mg_x(g, i));
+    put_coord(f, mg_y(g, i));
+    put_coord(f, mg_r(g, i));
+}
+
+FILE *mt_open(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f)
+        fputs(MT_MAGIC, f);
+    return f;
+}
+
+void mt_start(FILE *f, MARKER_INFO *info, MARKER_GEOMETRY *g, MARKER_ID n_markers) {
+    putc(MT_START, f);
+    putc(sizeof(MARKER_COORD), f);
+    put_varint(f, info->kind);
+    put_coord(f, info->c);
+    put_varint(f, n_markers);
+    for (MARKER_ID i = 0; i < n_markers; i++)
+        put_shape(f, g, i);
+}
+
+void mt_nearest(FILE *f, MARKER_ID a, MARKER_ID b) {
+    putc(MT_NEAREST, f);
+    put_varint(f, a);
+    put_varint(f, b + 1);
+}
+
+void mt_pop(FILE *f, MARKER_ID a, MARKER_ID b) {
+    putc(MT_POP, f);
+    put_varint(f, a);
+    put_varint(f, b);
+}
+
+void mt_new(FILE *f, MARKER_GEOMETRY *g, MARKER_ID i) {
+    putc(MT_NEW, f);
+    put_varint(f, i);
+    put_shape(f, g, i);
+}
+
+void mt_event(FILE *f, MT_EVENT event, MARKER_ID i) {
+    putc(event, f);
+    put_varint(f, i);
+}
+
+long long mt_get_varint(const unsigned char **p, const unsigned char *end) {
+    unsigned long long v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        v |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return (long long)v;
+    }
+    return -1;
+}
+
+int mt_get_coord(const unsigned char **p, const unsigned char *end, MARKER_COORD *c) {
+    if (end - *p < (long)sizeof *c)
+        return -1;
+    memcpy(c, *p, sizeof *c);
+    *p += sizeof *c;
+    return 0;
+}
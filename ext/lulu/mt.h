@@ -0,0 +1,66 @@
+/*
+ * mt.h
+ *
+ * Merge traces: a compact binary record of each step of a serial merge, so
+ * its index and queue work can be replayed without the rest of the merge.
+ * See replay.c.
+ *
+ * A trace file starts with MT_MAGIC. Each merge then adds an MT_START event
+ * and ends with MT_END. Events are a tag byte and fields, where indices and
+ * counts are unsigned LEB128 varints and coordinates are raw MARKER_COORDs,
+ * so traces are read back only by a build with the same coordinate type and
+ * byte order. Marker indices that may be -1 are written plus one.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef MT_H_
+#define MT_H_
+
+#include <stdio.h>
+#include "namespace.h"
+#include "marker.h"
+
+#define MT_MAGIC "LULUMT1\n"
+
+typedef enum mt_event_e {
+    MT_START = 1,   // coord size byte, kind, c, n markers, then n shapes x, y, r
+    MT_NEAREST,     // marker, its nearest neighbor plus one, at first only of lower index
+    MT_HEAP,        // heap set up from markers having a nearest of lower index
+    MT_POP,         // pair a, b: a taken off the heap, b deleted from it
+    MT_NEW,         // merged marker index, shape x, y, r
+    MT_ADD,         // marker added to the heap
+    MT_UPDATE,      // marker's key updated in the heap
+    MT_DELETE,      // marker deleted from the heap
+    MT_END,         // markers after the merge
+} MT_EVENT;
+
+// Open the trace file at the given path and write the magic, or return NULL.
+#define mt_open(Path)   NAME(mt_open)(Path)
+FILE *mt_open(const char *path);
+
+#define mt_start(F, Info, G, NMarkers)  NAME(mt_start)(F, Info, G, NMarkers)
+void mt_start(FILE *f, MARKER_INFO *info, MARKER_GEOMETRY *g, MARKER_ID n_markers);
+
+#define mt_nearest(F, A, B) NAME(mt_nearest)(F, A, B)
+void mt_nearest(FILE *f, MARKER_ID a, MARKER_ID b);
+
+#define mt_pop(F, A, B) NAME(mt_pop)(F, A, B)
+void mt_pop(FILE *f, MARKER_ID a, MARKER_ID b);
+
+#define mt_new(F, G, I) NAME(mt_new)(F, G, I)
+void mt_new(FILE *f, MARKER_GEOMETRY *g, MARKER_ID i);
+
+// Record an event having one index or count: MT_HEAP, MT_ADD, MT_UPDATE, MT_DELETE, or MT_END.
+#define mt_event(F, Event, I)   NAME(mt_event)(F, Event, I)
+void mt_event(FILE *f, MT_EVENT event, MARKER_ID i);
+
+// Readers of the fields written above. They return -1 at the end of the buffer.
+#define mt_get_varint(P, End)   NAME(mt_get_varint)(P, End)
+long long mt_get_varint(const unsigned char **p, const unsigned char *end);
+
+#define mt_get_coord(P, End, C) NAME(mt_get_coord)(P, End, C)
+int mt_get_coord(const unsigned char **p, const unsigned char *end, MARKER_COORD *c);
+
+#endif /* MT_H_ */
@@ -8,7 +8,13 @@
 #ifndef NAMESPACE_H_
 #define NAMESPACE_H_
 
+// The float32 build of each source, compiled from the wrapper files named
+// *32.c, gets its own prefix so both builds link into the one extension.
+#ifdef LULU_FLOAT32
+#define NAME(X) lulu32_ ## X
+#else
 #define NAME(X) lulu_ ## X
+#endif
 
 #endif /* NAMESPACE_H_ */
 
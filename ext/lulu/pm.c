@@ -0,0 +1,708 @@
+/*
+ * pm.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "pm.h"
+#include "utility.h"
+#include "stats.h"
+
+// Tiles per thread. More tiles balance the load better, but put more
+// markers near tile borders, where they go to the serial fix-up.
+#define TILES_PER_THREAD 2
+
+// Most cells across a tile grid.
+#define MAX_GRID_SIDE 4096
+
+// A marker whose square meets more grid cells than this is rejected rather
+// than listed in all of them.
+#define MAX_MARKER_CELLS 4096
+
+// Largest fraction of the markers the fix-up merges before the parallel
+// merge gives up and merges all serially instead.
+#define MAX_FIXUP_FRACTION 0.5
+
+// Everything the threads of a parallel merge share.
+typedef struct pm_state_s {
+    MARKER_INFO info[1];        // the caller's info, but with one thread
+    MARKER_INFO *fixup_info;    // the caller's info
+    MARKER *markers;
+    MARKER_EXTENT ext[1];       // of the original markers
+    double tile_w, tile_h;
+    int tiles_x, tiles_y;
+    PM_REGION *tiles;
+    int n_tiles;
+    int next_tile;              // next tile for a thread to merge
+    volatile int *cancel_p;
+    volatile int *allocation_flag; // the merging thread's, for the threads it starts
+#ifdef LULU_MERGE_STATS
+    MERGE_STATS *worker_stats;  // where started threads leave their counts
+#endif
+} PM_STATE;
+
+// Set the bounding square of a marker shape, padded a little for rounding
+// so squares of overlapping markers surely meet.
+static void get_box(MARKER_SHAPE *shape, PM_BOX *box) {
+    double r = shape->r;
+    double pad_x = 4 * MARKER_DISTANCE_EPSILON * (fabs(shape->x) + r) + MARKER_DISTANCE_MIN;
+    double pad_y = 4 * MARKER_DISTANCE_EPSILON * (fabs(shape->y) + r) + MARKER_DISTANCE_MIN;
+    box->x0 = shape->x - r - pad_x;
+    box->x1 = shape->x + r + pad_x;
+    box->y0 = shape->y - r - pad_y;
+    box->y1 = shape->y + r + pad_y;
+}
+
+static int boxes_meet_p(PM_BOX *a, PM_BOX *b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static int box_inside_p(PM_BOX *a, PM_BOX *b) {
+    return a->x0 > b->x0 && a->y0 > b->y0 && a->x1 < b->x1 && a->y1 < b->y1;
+}
+
+static void init_grid(PM_GRID *grid) {
+    grid->x = grid->y = 0;
+    grid->scale = 0;
+    grid->n_x = grid->n_y = 0;
+    grid->starts = grid->ends = grid->items = NULL;
+    grid->next = NULL;
+}
+
+static void clear_grid(PM_GRID *grid) {
+    Free(grid->starts);
+    Free(grid->ends);
+    Free(grid->items);
+    Free(grid->next);
+    init_grid(grid);
+}
+
+// Clamp to the n cells, putting NaN coordinates in the first.
+static int cell_of(double v, double origin, double scale, int n) {
+    double c = floor((v - origin) * scale);
+    return !(c >= 0) ? 0 : c >= n ? n - 1 : (int)c;
+}
+
+// Return the number of cells a box meets, setting their range.
+static double get_cells(PM_GRID *grid, PM_BOX *box, int *x0, int *y0, int *x1, int *y1) {
+    *x0 = cell_of(box->x0, grid->x, grid->scale, grid->n_x);
+    *x1 = cell_of(box->x1, grid->x, grid->scale, grid->n_x);
+    *y0 = cell_of(box->y0, grid->y, grid->scale, grid->n_y);
+    *y1 = cell_of(box->y1, grid->y, grid->scale, grid->n_y);
+    return (double)(*x1 - *x0 + 1) * (*y1 - *y0 + 1);
+}
+
+static void init_region(PM_REGION *region) {
+    region->n_markers = region->n_events = 0;
+    region->globals = region->parts = NULL;
+    region->keys = NULL;
+    region->shapes = NULL;
+    region->clusters = NULL;
+    region->n_clusters = 0;
+    region->member_starts = region->members = NULL;
+    region->rejected = NULL;
+    region->queue = NULL;
+    region->n_queue = 0;
+    init_grid(region->grid);
+    region->next = 0;
+}
+
+// Free what's needed only to decide which clusters are rejected.
+static void clear_region_geometry(PM_REGION *region) {
+    Free(region->shapes);
+    Free(region->member_starts);
+    Free(region->members);
+    Free(region->queue);
+    clear_grid(region->grid);
+}
+
+static void clear_region(PM_REGION *region) {
+    clear_region_geometry(region);
+    Free(region->globals);
+    Free(region->parts);
+    Free(region->keys);
+    Free(region->clusters);
+    Free(region->rejected);
+    init_region(region);
+}
+
+static void reject(PM_REGION *region, MARKER_ID c) {
+    if (!region->rejected[c]) {
+        region->rejected[c] = 1;
+        region->queue[region->n_queue++] = c;
+    }
+}
+
+// Record the merges, clusters, and shapes of a region given its markers
+// after the region's merge produced n_total of them. Return 0, or -1 if
+// allocation fails.
+static int record_merges(PM_STATE *s, PM_REGION *region, MARKER *markers, MARKER_ID n_total) {
+    MARKER_ID n = region->n_markers;
+    MARKER_ID m = region->n_events = n_total - n;
+    NewArray(region->parts, 2 * m);
+    NewArray(region->keys, m);
+    if (allocation_failed_p())
+        return -1;
+    for (MARKER_ID k = 0; k < m; k++) {
+        MARKER *merged = markers + n + k;
+        region->parts[2 * k] = merged->part_a;
+        region->parts[2 * k + 1] = merged->part_b;
+        // The serial merge took this merge off its queue with this key.
+        region->keys[k] = mr_distance(s->info, markers + merged->part_a, markers + merged->part_b);
+    }
+
+    NewArray(region->shapes, n_total);
+    NewArray(region->clusters, n_total);
+    if (allocation_failed_p())
+        return -1;
+    for (MARKER_ID i = 0; i < n_total; i++) {
+        region->shapes[i].x = mr_x(markers + i);
+        region->shapes[i].y = mr_y(markers + i);
+        region->shapes[i].r = mr_r(markers + i);
+    }
+
+    // Merged markers follow their parts, so a backward sweep numbers each
+    // cluster at its root and passes the number down to its parts.
+    region->n_clusters = 0;
+    for (MARKER_ID i = n_total - 1; i >= 0; i--) {
+        MARKER *marker = markers + i;
+        if (!mr_deleted_p(marker))
+            region->clusters[i] = region->n_clusters++;
+        if (i >= n)
+            region->clusters[marker->part_a] = region->clusters[marker->part_b] = region->clusters[i];
+    }
+
+    // List the markers of each cluster.
+    MARKER_ID n_clusters = region->n_clusters;
+    NewArray(region->member_starts, n_clusters + 1);
+    NewArray(region->members, n_total);
+    NewArray(region->rejected, n_clusters);
+    NewArray(region->queue, n_clusters);
+    if (allocation_failed_p())
+        return -1;
+    for (MARKER_ID c = 0; c <= n_clusters; c++)
+        region->member_starts[c] = 0;
+    for (MARKER_ID i = 0; i < n_total; i++)
+        region->member_starts[region->clusters[i] + 1]++;
+    for (MARKER_ID c = 0; c < n_clusters; c++)
+        region->member_starts[c + 1] += region->member_starts[c];
+    for (MARKER_ID i = 0; i < n_total; i++)
+        region->members[region->member_starts[region->clusters[i]]++] = i;
+    for (MARKER_ID c = n_clusters; c > 0; c--)
+        region->member_starts[c] = region->member_starts[c - 1];
+    region->member_starts[0] = 0;
+
+    for (MARKER_ID c = 0; c < n_clusters; c++)
+        region->rejected[c] = 0;
+    region->n_queue = 0;
+    return 0;
+}
+
+// Merge the original markers of a region by themselves, returning the local
+// marker array, or NULL if canceled or allocation fails.
+static MARKER *merge_region(PM_STATE *s, MERGE_WORKSPACE *workspace, MARKER_INFO *info,
+        PM_REGION *region) {
+    MARKER_ID n = region->n_markers;
+    NewArrayDecl(MARKER, markers, 2 * n - 1);
+    if (!markers)
+        return NULL;
+    for (MARKER_ID i = 0; i < n; i++)
+        markers[i] = s->markers[region->globals[i]];
+    MARKER_ID n_total = merge_markers_serial(workspace, info, markers, n, s->cancel_p);
+    if ((s->cancel_p && *s->cancel_p) || allocation_failed_p() || record_merges(s, region, markers, n_total) != 0) {
+        Free(markers);
+        return NULL;
+    }
+    return markers;
+}
+
+// Build the grid of a tile over markers of clusters not yet rejected.
+static void build_grid(PM_REGION *region) {
+    PM_GRID *grid = region->grid;
+    MARKER_ID n_total = region->n_markers + region->n_events;
+    PM_BOX ext[1] = {{ HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL }};
+    MARKER_ID n_listed = 0;
+    for (MARKER_ID i = 0; i < n_total; i++)
+        if (!region->rejected[region->clusters[i]]) {
+            PM_BOX box[1];
+            get_box(region->shapes + i, box);
+            if (box->x0 < ext->x0) ext->x0 = box->x0;
+            if (box->y0 < ext->y0) ext->y0 = box->y0;
+            if (box->x1 > ext->x1) ext->x1 = box->x1;
+            if (box->y1 > ext->y1) ext->y1 = box->y1;
+            n_listed++;
+        }
+    if (n_listed == 0)
+        return;
+
+    // About one cell per marker.
+    double w = ext->x1 - ext->x0, h = ext->y1 - ext->y0;
+    double side = w > h ? w : h;
+    double cell = w * h > 0 ? sqrt(w * h / n_listed) : side / n_listed;
+    if (cell < side / MAX_GRID_SIDE)
+        cell = side / MAX_GRID_SIDE;
+    grid->x = ext->x0;
+    grid->y = ext->y0;
+    grid->scale = cell > 0 ? 1 / cell : 0;
+    grid->n_x = cell_of(ext->x1, grid->x, grid->scale, MAX_GRID_SIDE + 1) + 1;
+    grid->n_y = cell_of(ext->y1, grid->y, grid->scale, MAX_GRID_SIDE + 1) + 1;
+
+    // Reject clusters with markers too big to list.
+    for (MARKER_ID i = 0; i < n_total; i++) {
+        PM_BOX box[1];
+        int x0, y0, x1, y1;
+        get_box(region->shapes + i, box);
+        if (get_cells(grid, box, &x0, &y0, &x1, &y1) > MAX_MARKER_CELLS)
+            reject(region, region->clusters[i]);
+    }
+
+    // Count the markers of each cell, then list them.
+    int n_cells = grid->n_x * grid->n_y;
+    NewArray(grid->starts, n_cells + 1);
+    NewArray(grid->ends, n_cells);
+    NewArray(grid->next, n_cells + 1);
+    if (allocation_failed_p()) {
+        clear_grid(grid);
+        return;
+    }
+    for (int k = 0; k <= n_cells; k++)
+        grid->starts[k] = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (MARKER_ID i = 0; i < n_total; i++) {
+            if (region->rejected[region->clusters[i]])
+                continue;
+            PM_BOX box[1];
+            int x0, y0, x1, y1;
+            get_box(region->shapes + i, box);
+            get_cells(grid, box, &x0, &y0, &x1, &y1);
+            for (int y = y0; y <= y1; y++)
+                for (int x = x0; x <= x1; x++) {
+                    int k = y * grid->n_x + x;
+                    if (pass == 0)
+                        grid->starts[k + 1]++;
+                    else
+                        grid->items[grid->starts[k]++] = i;
+                }
+        }
+        if (pass == 0) {
+            for (int k = 0; k < n_cells; k++)
+                grid->starts[k + 1] += grid->starts[k];
+            NewArray(grid->items, grid->starts[n_cells] > 0 ? grid->starts[n_cells] : 1);
+            if (!grid->items) {
+                clear_grid(grid);
+                return;
+            }
+        } else {
+            // Filling advanced each start to the end.
+            for (int k = n_cells; k > 0; k--) {
+                grid->ends[k - 1] = grid->starts[k - 1];
+                grid->starts[k] = grid->starts[k - 1];
+            }
+            grid->starts[0] = 0;
+        }
+    }
+    for (int k = 0; k < n_cells; k++)
+        grid->next[k] = grid->ends[k] > grid->starts[k] ? k : k + 1;
+    grid->next[n_cells] = n_cells;
+}
+
+// Return the first live cell at or after the given one.
+static int live_cell(PM_GRID *grid, int k) {
+    while (grid->next[k] != k) {
+        grid->next[k] = grid->next[grid->next[k]];
+        k = grid->next[k];
+    }
+    return k;
+}
+
+// Reject clusters of a tile with markers whose squares meet the given box.
+// Cells strictly inside the range the box meets are covered by it, so all
+// their markers are rejected.
+static void reject_meeting(PM_REGION *region, PM_BOX *box) {
+    PM_GRID *grid = region->grid;
+    if (!grid->starts)
+        return;
+    int x0, y0, x1, y1;
+    get_cells(grid, box, &x0, &y0, &x1, &y1);
+    for (int y = y0; y <= y1; y++) {
+        int row = y * grid->n_x;
+        for (int k = live_cell(grid, row + x0); k <= row + x1; k = live_cell(grid, k + 1)) {
+            int x = k - row;
+            int covered_p = x0 < x && x < x1 && y0 < y && y < y1;
+            MARKER_ID end = grid->ends[k];
+            for (MARKER_ID j = grid->starts[k]; j < end; ) {
+                MARKER_ID i = grid->items[j];
+                if (!region->rejected[region->clusters[i]]) {
+                    PM_BOX item_box[1];
+                    get_box(region->shapes + i, item_box);
+                    if (covered_p || boxes_meet_p(item_box, box))
+                        reject(region, region->clusters[i]);
+                }
+                if (region->rejected[region->clusters[i]])
+                    grid->items[j] = grid->items[--end];
+                else
+                    j++;
+            }
+            grid->ends[k] = end;
+            if (end == grid->starts[k])
+                grid->next[k] = k + 1;
+        }
+    }
+}
+
+// Reject clusters of a tile with markers meeting those of rejected clusters
+// until there are no more.
+static void settle_tile(PM_REGION *region) {
+    while (region->n_queue > 0) {
+        MARKER_ID c = region->queue[--region->n_queue];
+        for (MARKER_ID j = region->member_starts[c]; j < region->member_starts[c + 1]; j++) {
+            PM_BOX box[1];
+            get_box(region->shapes + region->members[j], box);
+            reject_meeting(region, box);
+        }
+    }
+}
+
+// Merge a tile and reject its clusters that leave it or meet rejected ones.
+static void merge_tile(PM_STATE *s, MERGE_WORKSPACE *workspace, PM_REGION *tile) {
+    if (tile->n_markers == 0)
+        return;
+    MARKER *markers = merge_region(s, workspace, s->info, tile);
+    if (!markers)
+        return;
+    Free(markers);
+    MARKER_ID n_total = tile->n_markers + tile->n_events;
+    for (MARKER_ID i = 0; i < n_total; i++) {
+        PM_BOX box[1];
+        get_box(tile->shapes + i, box);
+        if (!box_inside_p(box, &tile->box))
+            reject(tile, tile->clusters[i]);
+    }
+    build_grid(tile);
+    settle_tile(tile);
+}
+
+typedef struct pm_thread_s {
+    PM_STATE *state;
+    MERGE_WORKSPACE *workspace;
+} PM_THREAD;
+
+static void *merge_tiles(void *thread_ptr) {
+    PM_THREAD *thread = thread_ptr;
+    PM_STATE *s = thread->state;
+    for (;;) {
+        int t = __sync_fetch_and_add(&s->next_tile, 1);
+        if (t >= s->n_tiles || (s->cancel_p && *s->cancel_p) || allocation_failed_p())
+            break;
+        merge_tile(s, thread->workspace, s->tiles + t);
+    }
+    return NULL;
+}
+
+// Allocation failures on started threads set the merging thread's flag, so
+// they stop the merge rather than the process.
+static void *merge_tiles_thread(void *thread_ptr) {
+    set_allocation_flag(((PM_THREAD*)thread_ptr)->state->allocation_flag);
+    merge_tiles(thread_ptr);
+    stats_flush(((PM_THREAD*)thread_ptr)->state->worker_stats);
+    return NULL;
+}
+
+static int tile_column(PM_STATE *s, double x) {
+    return s->tile_w > 0 ? cell_of(x, s->ext->x, 1 / s->tile_w, s->tiles_x) : 0;
+}
+
+static int tile_row(PM_STATE *s, double y) {
+    return s->tile_h > 0 ? cell_of(y, s->ext->y, 1 / s->tile_h, s->tiles_y) : 0;
+}
+
+// Set up tiles over the markers. Outer sides of the outer tiles are open.
+// If allocation fails, there are none.
+static void setup_tiles(PM_STATE *s, int n_threads, MARKER_ID n_markers) {
+    get_marker_array_extent(s->markers, n_markers, s->ext);
+
+    // Make tiles about square.
+    int n_tiles = TILES_PER_THREAD * n_threads;
+    double aspect = s->ext->w > 0 && s->ext->h > 0 ? s->ext->w / s->ext->h : 1;
+    s->tiles_x = (int)floor(sqrt(n_tiles * aspect) + 0.5);
+    if (s->tiles_x < 1)
+        s->tiles_x = 1;
+    if (s->tiles_x > n_tiles)
+        s->tiles_x = n_tiles;
+    s->tiles_y = (n_tiles + s->tiles_x - 1) / s->tiles_x;
+    s->n_tiles = s->tiles_x * s->tiles_y;
+    s->tile_w = s->ext->w / s->tiles_x;
+    s->tile_h = s->ext->h / s->tiles_y;
+
+    NewArray(s->tiles, s->n_tiles);
+    if (!s->tiles)
+        s->n_tiles = 0;
+    for (int t = 0; t < s->n_tiles; t++) {
+        PM_REGION *tile = s->tiles + t;
+        int col = t % s->tiles_x, row = t / s->tiles_x;
+        init_region(tile);
+        tile->box.x0 = col == 0 ? -HUGE_VAL : s->ext->x + col * s->tile_w;
+        tile->box.x1 = col == s->tiles_x - 1 ? HUGE_VAL : s->ext->x + (col + 1) * s->tile_w;
+        tile->box.y0 = row == 0 ? -HUGE_VAL : s->ext->y + row * s->tile_h;
+        tile->box.y1 = row == s->tiles_y - 1 ? HUGE_VAL : s->ext->y + (row + 1) * s->tile_h;
+    }
+}
+
+// Give each tile the markers with centers in it in ascending order, recording
+// the tile and local index of each marker. Return 0, or -1 if allocation fails.
+static int fill_tiles(PM_STATE *s, MARKER_ID n_markers, int *homes, MARKER_ID *locals) {
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        MARKER *marker = s->markers + i;
+        homes[i] = tile_row(s, mr_y(marker)) * s->tiles_x + tile_column(s, mr_x(marker));
+        s->tiles[homes[i]].n_markers++;
+    }
+    for (int t = 0; t < s->n_tiles; t++) {
+        PM_REGION *tile = s->tiles + t;
+        NewArray(tile->globals, tile->n_markers > 0 ? 2 * tile->n_markers - 1 : 1);
+        tile->n_markers = 0;
+    }
+    if (allocation_failed_p())
+        return -1;
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        PM_REGION *tile = s->tiles + homes[i];
+        locals[i] = tile->n_markers;
+        tile->globals[tile->n_markers++] = i;
+    }
+    return 0;
+}
+
+// Reject clusters of the tiles meeting the given box, except the given tile,
+// returning non-zero iff there were any.
+static int reject_meeting_tiles(PM_STATE *s, PM_BOX *box, PM_REGION *except) {
+    int col0 = tile_column(s, box->x0), col1 = tile_column(s, box->x1);
+    int row0 = tile_row(s, box->y0), row1 = tile_row(s, box->y1);
+    int changed_p = 0;
+    for (int row = row0; row <= row1; row++)
+        for (int col = col0; col <= col1; col++) {
+            PM_REGION *tile = s->tiles + row * s->tiles_x + col;
+            if (tile == except)
+                continue;
+            reject_meeting(tile, box);
+            if (tile->n_queue > 0) {
+                settle_tile(tile);
+                changed_p = 1;
+            }
+        }
+    return changed_p;
+}
+
+// Return the number of leaves of rejected clusters of all tiles.
+static MARKER_ID count_rejected_leaves(PM_STATE *s) {
+    MARKER_ID n = 0;
+    for (int t = 0; t < s->n_tiles; t++) {
+        PM_REGION *tile = s->tiles + t;
+        for (MARKER_ID i = 0; i < tile->n_markers; i++)
+            if (tile->rejected[tile->clusters[i]])
+                n++;
+    }
+    return n;
+}
+
+// Leaves of rejected clusters are surely in the fix-up merge, so reject
+// clusters of other tiles that they meet before merging. Return zero as soon
+// as there are more such leaves than the given limit.
+static int reject_meeting_leaves(PM_STATE *s, MARKER_ID limit) {
+    int changed_p;
+    do {
+        if (count_rejected_leaves(s) > limit)
+            return 0;
+        changed_p = 0;
+        for (int t = 0; t < s->n_tiles; t++) {
+            PM_REGION *tile = s->tiles + t;
+            for (MARKER_ID i = 0; i < tile->n_markers; i++)
+                if (tile->rejected[tile->clusters[i]]) {
+                    PM_BOX box[1];
+                    get_box(tile->shapes + i, box);
+                    if (!box_inside_p(box, &tile->box))
+                        changed_p |= reject_meeting_tiles(s, box, tile);
+                }
+        }
+    } while (changed_p);
+    return 1;
+}
+
+// Merge the leaves of all rejected clusters together, redoing the merge
+// until none of its markers meets an accepted cluster. Return zero without
+// merging if the fix-up would be most of the markers, so a serial merge of
+// all is faster.
+static int merge_fixup(PM_STATE *s, MERGE_WORKSPACE *workspace, MARKER_ID n_markers,
+        int *homes, MARKER_ID *locals, PM_REGION *fixup) {
+    MARKER_ID limit = (MARKER_ID)(n_markers * MAX_FIXUP_FRACTION);
+    if (!reject_meeting_leaves(s, limit))
+        return 0;
+    for (;;) {
+        clear_region(fixup);
+        NewArray(fixup->globals, n_markers > 0 ? 2 * n_markers - 1 : 1);
+        if (!fixup->globals)
+            return 1;
+        for (MARKER_ID i = 0; i < n_markers; i++) {
+            PM_REGION *tile = s->tiles + homes[i];
+            if (tile->rejected[tile->clusters[locals[i]]])
+                fixup->globals[fixup->n_markers++] = i;
+        }
+        if (fixup->n_markers == 0)
+            return 1;
+        MARKER *markers = merge_region(s, workspace, s->fixup_info, fixup);
+        if (!markers)
+            return 1;
+        Free(markers);
+
+        // Leaves were checked already.
+        int changed_p = 0;
+        for (MARKER_ID i = fixup->n_markers; i < fixup->n_markers + fixup->n_events; i++) {
+            PM_BOX box[1];
+            get_box(fixup->shapes + i, box);
+            changed_p |= reject_meeting_tiles(s, box, NULL);
+        }
+        if (!changed_p)
+            return 1;
+        if (!reject_meeting_leaves(s, limit))
+            return 0;
+    }
+}
+
+// Advance a region to its next merge of an accepted cluster, returning
+// non-zero iff there is one.
+static int next_merge_p(PM_REGION *region) {
+    while (region->next < region->n_events &&
+            region->rejected[region->clusters[region->n_markers + region->next]])
+        region->next++;
+    return region->next < region->n_events;
+}
+
+// Return non-zero iff the next merge of region a comes before that of b in
+// the serial merge. Its queue is keyed on distance, with ties to the lower index.
+static int before_p(PM_REGION *a, PM_REGION *b) {
+    MARKER_DISTANCE ka = a->keys[a->next], kb = b->keys[b->next];
+    return ka < kb || (ka == kb && a->globals[a->parts[2 * a->next]] < b->globals[b->parts[2 * b->next]]);
+}
+
+static void sift_down(PM_REGION **heap, int size, int j) {
+    PM_REGION *region = heap[j];
+    for (;;) {
+        int j_min = 2 * j + 1;
+        if (j_min >= size)
+            break;
+        if (j_min + 1 < size && before_p(heap[j_min + 1], heap[j_min]))
+            j_min++;
+        if (!before_p(heap[j_min], region))
+            break;
+        heap[j] = heap[j_min];
+        j = j_min;
+    }
+    heap[j] = region;
+}
+
+// Apply the merges of all regions to the marker array in serial merge order.
+// If allocation fails, none are.
+static MARKER_ID apply_merges(PM_STATE *s, PM_REGION *fixup, MARKER_ID n_markers) {
+    NewArrayDecl(PM_REGION*, heap, s->n_tiles + 1);
+    if (!heap)
+        return n_markers;
+    int size = 0;
+    for (int t = 0; t < s->n_tiles; t++)
+        if (s->tiles[t].n_markers > 0 && next_merge_p(s->tiles + t))
+            heap[size++] = s->tiles + t;
+    if (fixup->n_markers > 0 && next_merge_p(fixup))
+        heap[size++] = fixup;
+    for (int j = size / 2 - 1; j >= 0; j--)
+        sift_down(heap, size, j);
+    while (size > 0) {
+        PM_REGION *region = heap[0];
+        MARKER_ID k = region->next++;
+        MARKER_ID a = region->globals[region->parts[2 * k]];
+        MARKER_ID b = region->globals[region->parts[2 * k + 1]];
+        MARKER_ID aa = region->globals[region->n_markers + k] = n_markers++;
+        mr_set_deleted(s->markers + a);
+        mr_set_deleted(s->markers + b);
+        mr_merge(s->info, s->markers, aa, a, b);
+        if (!next_merge_p(region))
+            heap[0] = heap[--size];
+        if (size > 0)
+            sift_down(heap, size, 0);
+    }
+    Free(heap);
+    return n_markers;
+}
+
+MARKER_ID merge_markers_parallel(MERGE_WORKSPACE *workspace, MARKER_INFO *info,
+        MARKER *markers, MARKER_ID n_markers, volatile int *cancel_p) {
+    int n_threads = info->n_threads;
+    if (n_threads > workspace->n_workers) {
+        RenewArray(workspace->workers, n_threads);
+        if (allocation_failed_p())
+            return n_markers;
+        for (int i = workspace->n_workers; i < n_threads; i++)
+            merge_workspace_init(workspace->workers + i);
+        workspace->n_workers = n_threads;
+    }
+
+    PM_STATE s[1];
+    s->info[0] = *info;
+    s->info->n_threads = 1;
+    s->fixup_info = info;
+    s->markers = markers;
+    s->next_tile = 0;
+    s->cancel_p = cancel_p;
+    s->allocation_flag = allocation_flag();
+    setup_tiles(s, n_threads, n_markers);
+    NewArrayDecl(int, homes, n_markers);
+    NewArrayDecl(MARKER_ID, locals, n_markers);
+    NewArrayDecl(PM_THREAD, threads, n_threads);
+    NewArrayDecl(pthread_t, ids, n_threads);
+    // If allocation fails, nothing is merged.
+    int ready_p = s->tiles && homes && locals && threads && ids && fill_tiles(s, n_markers, homes, locals) == 0;
+
+    // Merge tiles on n_threads - 1 new threads and this one.
+    STATS_DECL(worker_stats);
+#ifdef LULU_MERGE_STATS
+    s->worker_stats = worker_stats;
+#endif
+    if (ready_p) {
+        int n_started = 0;
+        for (int i = 0; i < n_threads; i++) {
+            threads[i].state = s;
+            threads[i].workspace = workspace->workers + i;
+        }
+        for (int i = 1; i < n_threads; i++)
+            if (pthread_create(ids + n_started, NULL, merge_tiles_thread, threads + i) == 0)
+                n_started++;
+        merge_tiles(threads);
+        for (int i = 0; i < n_started; i++)
+            pthread_join(ids[i], NULL);
+    }
+    stats_join(worker_stats);
+    Free(threads);
+    Free(ids);
+
+    PM_REGION fixup[1];
+    init_region(fixup);
+    int stopped_p = !ready_p || (cancel_p && *cancel_p) || allocation_failed_p();
+    int tiled_p = stopped_p ? 1 : merge_fixup(s, workspace, n_markers, homes, locals, fixup);
+    for (int t = 0; t < s->n_tiles; t++)
+        clear_region_geometry(s->tiles + t);
+    clear_region_geometry(fixup);
+    if (!tiled_p)
+        n_markers = merge_markers_serial(workspace, info, markers, n_markers, cancel_p);
+    else if (!stopped_p && !(cancel_p && *cancel_p) && !allocation_failed_p())
+        n_markers = apply_merges(s, fixup, n_markers);
+
+    clear_region(fixup);
+    for (int t = 0; t < s->n_tiles; t++)
+        clear_region(s->tiles + t);
+    Free(s->tiles);
+    Free(homes);
+    Free(locals);
+    return n_markers;
+}
@@ -0,0 +1,85 @@
+/*
+ * pm.h
+ *
+ * Parallel merging. The extent of the markers is split into tiles, and the
+ * markers of each tile are merged on their own, several tiles at once on
+ * separate threads. The result is exactly that of the serial merge.
+ *
+ * As with incremental merging (see im.h), two clusters can't have affected
+ * each other if no marker of one ever overlapped a marker of the other. So a
+ * cluster of a tile merge is rejected if the bounding square of any of its
+ * markers leaves the tile or meets that of a marker of a rejected cluster of
+ * the same tile. The leaves of rejected clusters of all tiles are then merged
+ * together in a serial fix-up merge. If a marker of that merge meets a marker
+ * of a cluster still accepted, the cluster is rejected too and the fix-up
+ * merge is redone. Finally the merges of the accepted clusters and of the
+ * fix-up are interleaved in the order the serial merge would make them, which
+ * is by distance and then index, and applied to the marker array.
+ *
+ * The fix-up merge is serial, so the speedup depends on how few markers are
+ * near tile borders or in clusters that reach them. When most markers merge
+ * into a few huge clusters, nearly all are in the fix-up, and the parallel
+ * merge falls back to a serial merge of all of them.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef PM_H_
+#define PM_H_
+
+#include "namespace.h"
+#include "marker.h"
+#include "merger.h"
+
+// A rectangle given by its corners.
+typedef struct pm_box_s {
+    double x0, y0, x1, y1;
+} PM_BOX;
+
+// A uniform grid over the bounding squares of markers of a tile. Each cell
+// lists the markers whose squares meet it, dropping them as their clusters
+// are found rejected. Cells with none left are dead, and link to later cells,
+// so a live one can be found as in union-find, and scans skip runs of them.
+typedef struct pm_grid_s {
+    double x, y;                // origin
+    double scale;               // cells per unit distance
+    int n_x, n_y;
+    MARKER_ID *starts;          // start of each cell's markers in items
+    MARKER_ID *ends;            // and the end of those not dropped
+    MARKER_ID *items;
+    int *next;                  // each cell if live, else a later cell; the last is a sentinel
+} PM_GRID;
+
+// A tile or the fix-up merge. Local markers are the originals in ascending
+// order of their global indices, then the markers merged from them.
+typedef struct pm_region_s {
+    PM_BOX box;                 // the tile, open at the sides
+    MARKER_ID n_markers;        // original markers
+    MARKER_ID n_events;         // merges
+    MARKER_ID *globals;         // global index of each local marker, once known
+    MARKER_ID *parts;           // local part_a and part_b of each merge
+    MARKER_DISTANCE *keys;      // distance between the parts of each merge
+    MARKER_SHAPE *shapes;       // of each local marker
+    MARKER_ID *clusters;        // cluster of each local marker
+    MARKER_ID n_clusters;
+    MARKER_ID *member_starts;   // start of each cluster's markers in members, then the end
+    MARKER_ID *members;
+    unsigned char *rejected;    // clusters left to the fix-up merge
+    MARKER_ID *queue;           // rejected clusters with markers still to check
+    MARKER_ID n_queue;
+    PM_GRID grid[1];            // markers of clusters not rejected at first
+    MARKER_ID next;             // next merge to apply
+} PM_REGION;
+
+/**
+ * Merge the given markers as merge_markers_in with up to info->n_threads
+ * threads. The workspace keeps per-thread workspaces for the next merge.
+ * If the merge is canceled, the markers are left unmerged.
+ */
+#define merge_markers_parallel(Workspace, Info, Markers, NMarkers, CancelP) \
+    NAME(merge_markers_parallel)(Workspace, Info, Markers, NMarkers, CancelP)
+MARKER_ID merge_markers_parallel(MERGE_WORKSPACE *workspace, MARKER_INFO *info,
+        MARKER *markers, MARKER_ID n_markers, volatile int *cancel_p);
+
+#endif /* PM_H_ */
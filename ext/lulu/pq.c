@@ -6,6 +6,9 @@
  * There is also a reverse map that takes a value index to the heap
  * element that refers to it. This allows values to be adjusted.
  *
+ * The heap is either binary, holding only indices, or 4- or 8-ary, holding
+ * copies of the values with the indices.
+ *
  *  Created on: Feb 23, 2014
  *      Author: generessler
  */
@@ -14,69 +17,157 @@
 #include <assert.h>
 #include "utility.h"
 #include "pq.h"
+#include "stats.h"
+
+// Return non-zero iff the value Ka with index Ia comes off the queue before Kb
+// with index Ib. Ties go to the lower index so all kinds of heap agree.
+#define BEFORE(Ka, Ia, Kb, Ib) ((Ka) < (Kb) || ((Ka) == (Kb) && (Ia) < (Ib)))
 
 // Move index at heap location j upward until its parent's value is no bigger.
-static void pq_sift_up(PRIORITY_QUEUE *q, int j) {
-    int i = q->heap[j];
+static void pq_sift_up(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX j) {
+    PRIORITY_QUEUE_INDEX i = q->heap[j];
     PRIORITY_QUEUE_VALUE val = q->values[i];
     while (j > 0) {
-        int j_pnt = (j - 1) / 2;
-        if (q->values[q->heap[j_pnt]] <= val)
+        PRIORITY_QUEUE_INDEX j_pnt = (j - 1) / 2;
+        PRIORITY_QUEUE_INDEX i_pnt = q->heap[j_pnt];
+        if (!BEFORE(val, i, q->values[i_pnt], i_pnt))
             break;
-        int k = q->heap[j] = q->heap[j_pnt];
-        q->locs[k] = j;
+        q->heap[j] = i_pnt;
+        q->locs[i_pnt] = j;
         j = j_pnt;
+        STAT_ADD(heap_sifts, 1);
     }
-    int k = q->heap[j] = i;
-    q->locs[k] = j;
+    q->heap[j] = i;
+    q->locs[i] = j;
 }
 
 // Move index at heap location j downward until its children's values are no smaller.
 // Pay some attention to efficiency because this is bottleneck code.
-static void pq_sift_down(PRIORITY_QUEUE *q, int j) {
-    int i = q->heap[j];
+static void pq_sift_down(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX j) {
+    PRIORITY_QUEUE_INDEX i = q->heap[j];
     PRIORITY_QUEUE_VALUE val = q->values[i];
     for (;;) {
-        int j_rgt = 2 * j + 2;
+        PRIORITY_QUEUE_INDEX j_rgt = 2 * j + 2;
         if (j_rgt < q->size) {
             // two children
-            int j_lft = j_rgt - 1;
-            PRIORITY_QUEUE_VALUE val_lft = q->values[q->heap[j_lft]];
-            PRIORITY_QUEUE_VALUE val_rgt = q->values[q->heap[j_rgt]];
-            if (val_lft < val_rgt) {
-                if (val <= val_lft)
+            PRIORITY_QUEUE_INDEX j_lft = j_rgt - 1;
+            PRIORITY_QUEUE_INDEX i_lft = q->heap[j_lft];
+            PRIORITY_QUEUE_INDEX i_rgt = q->heap[j_rgt];
+            PRIORITY_QUEUE_VALUE val_lft = q->values[i_lft];
+            PRIORITY_QUEUE_VALUE val_rgt = q->values[i_rgt];
+            if (BEFORE(val_lft, i_lft, val_rgt, i_rgt)) {
+                if (BEFORE(val, i, val_lft, i_lft))
                     break;
-                int k = q->heap[j] = q->heap[j_lft];
-                q->locs[k] = j;
+                q->heap[j] = i_lft;
+                q->locs[i_lft] = j;
                 j = j_lft;
+                STAT_ADD(heap_sifts, 1);
             } else {
-                if (val <= val_rgt)
+                if (BEFORE(val, i, val_rgt, i_rgt))
                     break;
-                int k = q->heap[j] = q->heap[j_rgt];
-                q->locs[k] = j;
+                q->heap[j] = i_rgt;
+                q->locs[i_rgt] = j;
                 j = j_rgt;
+                STAT_ADD(heap_sifts, 1);
             }
         } else if (j_rgt == q->size) {
             // left child only
-            int j_lft = j_rgt - 1;
-            if (val <= q->values[q->heap[j_lft]])
+            PRIORITY_QUEUE_INDEX j_lft = j_rgt - 1;
+            PRIORITY_QUEUE_INDEX i_lft = q->heap[j_lft];
+            if (BEFORE(val, i, q->values[i_lft], i_lft))
                 break;
-            int k = q->heap[j] = q->heap[j_lft];
-            q->locs[k] = j;
+            q->heap[j] = i_lft;
+            q->locs[i_lft] = j;
             j = j_lft;
+            STAT_ADD(heap_sifts, 1);
             break; // this node has no children
         } else {
             break; // no children at all
         }
     }
-    int k = q->heap[j] = i;
-    q->locs[k] = j;
+    q->heap[j] = i;
+    q->locs[i] = j;
+}
+
+// The d-ary heap keeps each value with its index, so comparisons needn't load
+// from the values array. Children of location j are at d * j + 1 through
+// d * j + d. The entries array is offset so these share an aligned block of
+// d entries, one cache line for d = 4.
+
+// Move entry e upward from heap location j until its parent's value is no bigger.
+static void dary_sift_up(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX j, PRIORITY_QUEUE_ENTRY e) {
+    PRIORITY_QUEUE_ENTRY *entries = q->entries;
+    int d = q->arity;
+    while (j > 0) {
+        PRIORITY_QUEUE_INDEX j_pnt = (j - 1) / d;
+        if (!BEFORE(e.key, e.index, entries[j_pnt].key, entries[j_pnt].index))
+            break;
+        entries[j] = entries[j_pnt];
+        q->locs[entries[j].index] = j;
+        j = j_pnt;
+        STAT_ADD(heap_sifts, 1);
+    }
+    entries[j] = e;
+    q->locs[e.index] = j;
+}
+
+// Move entry e downward from heap location j until its children's values are no smaller.
+static void dary_sift_down(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX j, PRIORITY_QUEUE_ENTRY e) {
+    PRIORITY_QUEUE_ENTRY *entries = q->entries;
+    int d = q->arity;
+    PRIORITY_QUEUE_INDEX size = q->size;
+    for (;;) {
+        PRIORITY_QUEUE_INDEX j_fst = d * j + 1;
+        if (j_fst >= size)
+            break;
+        PRIORITY_QUEUE_INDEX j_end = j_fst + d < size ? j_fst + d : size;
+        PRIORITY_QUEUE_INDEX j_min = j_fst;
+        for (PRIORITY_QUEUE_INDEX k = j_fst + 1; k < j_end; k++)
+            if (BEFORE(entries[k].key, entries[k].index, entries[j_min].key, entries[j_min].index))
+                j_min = k;
+        if (!BEFORE(entries[j_min].key, entries[j_min].index, e.key, e.index))
+            break;
+        entries[j] = entries[j_min];
+        q->locs[entries[j].index] = j;
+        j = j_min;
+        STAT_ADD(heap_sifts, 1);
+    }
+    entries[j] = e;
+    q->locs[e.index] = j;
+}
+
+// Allocate d-ary heap entries for max_size indices, offset within a
+// cache-aligned block so sibling groups are aligned.
+static void new_entries(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX max_size) {
+    size_t line = 64;
+    size_t n = (size_t)max_size + q->arity;
+    char *block = safe_malloc(n * sizeof(PRIORITY_QUEUE_ENTRY) + line, __FILE__, __LINE__);
+    if (!block)
+        return;
+    char *aligned = block + (line - (size_t)block % line) % line;
+    q->entries_block = block;
+    q->entries = (PRIORITY_QUEUE_ENTRY*)aligned + (q->arity - 1);
+}
+
+// Put index i at heap location j without regard to heap order.
+static void place_index(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX j, PRIORITY_QUEUE_INDEX i) {
+    if (q->arity == 2)
+        q->heap[j] = i;
+    else {
+        q->entries[j].key = q->values[i];
+        q->entries[j].index = i;
+    }
+    q->locs[i] = j;
 }
 
 // Initialize a newly allocated priority queue structure.
 void pq_init(PRIORITY_QUEUE *q) {
     q->max_size = q->size = 0;
+    q->n_values = 0;
+    q->arity = PQ_DEFAULT_ARITY;
     q->heap = NULL;
+    q->entries = NULL;
+    q->entries_block = NULL;
     q->locs = NULL;
     q->values = NULL;
 }
@@ -85,87 +176,162 @@ void pq_init(PRIORITY_QUEUE *q) {
 // it to the initialized state but with all resourced freed.  Note the values
 // are owned by the user and are not freed here.
 void pq_clear(PRIORITY_QUEUE *q) {
+    int arity = q->arity;
     Free(q->heap);
+    Free(q->entries_block);
     Free(q->locs);
     pq_init(q);
+    q->arity = arity;
+}
+
+void pq_set_arity(PRIORITY_QUEUE *q, int arity) {
+    arity = arity == 4 || arity == 8 ? arity : 2;
+    if (arity != q->arity) {
+        // The heap has a different form, so start it over.
+        Free(q->heap);
+        Free(q->entries_block);
+        q->entries = NULL;
+        q->max_size = q->size = 0;
+        q->arity = arity;
+    }
+}
+
+void pq_reserve(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX max_size, PRIORITY_QUEUE_INDEX n_values) {
+    if (max_size > q->max_size) {
+        if (q->arity == 2)
+            RenewArray(q->heap, max_size);
+        else {
+            Free(q->entries_block);
+            q->entries = NULL;
+            q->max_size = 0;
+            new_entries(q, max_size);
+        }
+        if (allocation_failed_p())
+            return;
+        q->max_size = max_size;
+    }
+    if (n_values > q->n_values) {
+        RenewArray(q->locs, n_values);
+        if (allocation_failed_p())
+            return;
+        q->n_values = n_values;
+    }
+}
+
+// Whether pq_reserve made room for the given sizes.
+static int reserved_p(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX max_size, PRIORITY_QUEUE_INDEX n_values) {
+    return q->max_size >= max_size && q->n_values >= n_values;
+}
+
+// Heapify whichever heap is in use.
+static void heapify(PRIORITY_QUEUE *q) {
+    if (q->arity == 2)
+        for (PRIORITY_QUEUE_INDEX j = q->size / 2 - 1; j >= 0; j--)
+            pq_sift_down(q, j);
+    else if (q->size > 1)
+        for (PRIORITY_QUEUE_INDEX j = (q->size - 2) / q->arity; j >= 0; j--)
+            dary_sift_down(q, j, q->entries[j]);
 }
 
 // Build the queue with given pre-allocated and filled array of values.
-void pq_set_up(PRIORITY_QUEUE *q, PRIORITY_QUEUE_VALUE *values, int size) {
-    q->max_size = q->size = size;
+void pq_set_up(PRIORITY_QUEUE *q, PRIORITY_QUEUE_VALUE *values, PRIORITY_QUEUE_INDEX size) {
+    pq_reserve(q, size, size);
     q->values = values;
-    NewArray(q->heap, size);
-    NewArray(q->locs, size);
-    for (int i = 0; i < size; i++)
-        q->heap[i] = q->locs[i] = i;
-    // heapify
-    for (int j = size / 2 - 1; j >= 0; j--)
-        pq_sift_down(q, j);
+    q->size = reserved_p(q, size, size) ? size : 0;
+    for (PRIORITY_QUEUE_INDEX i = 0; i < q->size; i++)
+        place_index(q, i, i);
+    heapify(q);
 }
 
 // Build the queue with given pre-allocated and filled array of values
-// and given heap indices.  Note the indices are owned by the heap
-// after set up and will be freed with the heap.
-void pq_set_up_heap(PRIORITY_QUEUE *q, int *heap, int size,
-        PRIORITY_QUEUE_VALUE *values, int max_size) {
-    q->max_size = max_size;
+// and given heap indices, which are copied. Memory from an earlier set
+// up is reused if it's big enough.
+void pq_set_up_heap(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX *heap, PRIORITY_QUEUE_INDEX size,
+        PRIORITY_QUEUE_VALUE *values, PRIORITY_QUEUE_INDEX max_size, PRIORITY_QUEUE_INDEX n_values) {
+    pq_reserve(q, max_size, n_values);
     q->values = values;
+    if (!reserved_p(q, max_size, n_values)) {
+        q->size = 0;
+        return;
+    }
     q->size = size;
-    q->heap = heap;
-    NewArray(q->locs, max_size);
-    for (int i = 0; i < max_size; i++)
+    for (PRIORITY_QUEUE_INDEX i = 0; i < q->n_values; i++)
         q->locs[i] = -1;
-    for (int j = 0; j < size; j++)
-        q->locs[heap[j]] = j;
-    for (int j = size / 2 - 1; j >= 0; j--)
-        pq_sift_down(q, j);
+    for (PRIORITY_QUEUE_INDEX j = 0; j < size; j++)
+        place_index(q, j, heap[j]);
+    heapify(q);
 }
 
 // Return the index of the minimum value on the queue.
-int pq_peek_min(PRIORITY_QUEUE *q) {
-    return q->size <= 0 ? -1 : q->heap[0];
+PRIORITY_QUEUE_INDEX pq_peek_min(PRIORITY_QUEUE *q) {
+    return q->size <= 0 ? -1 : pq_index(q, 0);
 }
 
 // Remove and return the index of the minimum value on the queue.
-int pq_get_min(PRIORITY_QUEUE *q) {
+PRIORITY_QUEUE_INDEX pq_get_min(PRIORITY_QUEUE *q) {
     if (q->size <= 0)
         return -1;
-    int i = q->heap[0];
+    PRIORITY_QUEUE_INDEX i = pq_index(q, 0);
     q->locs[i] = -1;
     if (--q->size > 0) {
-        q->heap[0] = q->heap[q->size];
-        pq_sift_down(q, 0);
+        if (q->arity == 2) {
+            q->heap[0] = q->heap[q->size];
+            pq_sift_down(q, 0);
+        } else
+            dary_sift_down(q, 0, q->entries[q->size]);
     }
     return i;
 }
 
 // Add a new value with index i into the queue.
-void pq_add(PRIORITY_QUEUE *q, int i) {
+void pq_add(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX i) {
     if (q->size >= q->max_size)
         return;
-    int j = q->size++;
-    q->heap[j] = i;
-    pq_sift_up(q, j);
+    PRIORITY_QUEUE_INDEX j = q->size++;
+    if (q->arity == 2) {
+        q->heap[j] = i;
+        pq_sift_up(q, j);
+    } else {
+        PRIORITY_QUEUE_ENTRY e = { q->values[i], i };
+        dary_sift_up(q, j, e);
+    }
 }
 
 // Restore the heap after the value at index i is changed.
-void pq_update(PRIORITY_QUEUE *q, int i) {
-    int j = q->locs[i];
+void pq_update(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX i) {
+    PRIORITY_QUEUE_INDEX j = q->locs[i];
     if (j >= 0) {
-        pq_sift_down(q, j);
-        pq_sift_up(q, j);
+        if (q->arity == 2) {
+            pq_sift_down(q, j);
+            pq_sift_up(q, j);
+        } else {
+            // The key copy is stale, so use the new value to pick a direction.
+            PRIORITY_QUEUE_ENTRY e = { q->values[i], i };
+            if (j > 0 && BEFORE(e.key, i, q->entries[(j - 1) / q->arity].key, q->entries[(j - 1) / q->arity].index))
+                dary_sift_up(q, j, e);
+            else
+                dary_sift_down(q, j, e);
+        }
     }
 }
 
 // Delete index i from the heap, making the corresponding key an orphan.
-void pq_delete(PRIORITY_QUEUE *q, int i) {
-    int j = q->locs[i];
+void pq_delete(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX i) {
+    PRIORITY_QUEUE_INDEX j = q->locs[i];
     if (0 <= j) {
         q->locs[i] = -1;
         if (j < --q->size) {
-            q->heap[j] = q->heap[q->size];
-            pq_sift_down(q, j);
-            pq_sift_up(q, j);
+            if (q->arity == 2) {
+                q->heap[j] = q->heap[q->size];
+                pq_sift_down(q, j);
+                pq_sift_up(q, j);
+            } else {
+                PRIORITY_QUEUE_ENTRY e = q->entries[q->size];
+                if (j > 0 && BEFORE(e.key, e.index, q->entries[(j - 1) / q->arity].key, q->entries[(j - 1) / q->arity].index))
+                    dary_sift_up(q, j, e);
+                else
+                    dary_sift_down(q, j, e);
+            }
         }
     }
 }
@@ -8,15 +8,43 @@
 #ifndef PRIORITY_QUEUE_H_
 #define PRIORITY_QUEUE_H_
 
+#include <stdint.h>
 #include "namespace.h"
 
+// Values are marker distances, so they're float in the float32 build.
+#ifdef LULU_FLOAT32
+typedef float PRIORITY_QUEUE_VALUE;
+#else
 typedef double PRIORITY_QUEUE_VALUE;
+#endif
+
+// Indices are marker indices, so they're 64-bit in the index64 build.
+#ifdef LULU_INDEX64
+typedef int64_t PRIORITY_QUEUE_INDEX;
+#else
+typedef int PRIORITY_QUEUE_INDEX;
+#endif
+
+// Arity of heaps unless set otherwise with pq_set_arity.
+#ifndef PQ_DEFAULT_ARITY
+#define PQ_DEFAULT_ARITY 4
+#endif
+
+// An entry of a d-ary heap: a copy of the value and its index.
+typedef struct priority_queue_entry_s {
+    PRIORITY_QUEUE_VALUE key;
+    PRIORITY_QUEUE_INDEX index;
+} PRIORITY_QUEUE_ENTRY;
 
 typedef struct priority_queue_s {
-    int max_size;                   // max number of items in heap
-    int size;                       // current number of items in heap
-    int *heap;                      // heap of indices to values
-    int *locs;                      // map of value indices to heap locations
+    PRIORITY_QUEUE_INDEX max_size;  // max number of items in heap
+    PRIORITY_QUEUE_INDEX n_values;  // number of values, hence of indices
+    PRIORITY_QUEUE_INDEX size;      // current number of items in heap
+    int arity;                      // 2 for a binary heap of indices, 4 or 8 for a d-ary heap of entries
+    PRIORITY_QUEUE_INDEX *heap;     // binary heap of indices to values
+    PRIORITY_QUEUE_ENTRY *entries;  // d-ary heap with each node's children on their own cache line
+    void *entries_block;            // allocation holding entries
+    PRIORITY_QUEUE_INDEX *locs;     // map of value indices to heap locations
     PRIORITY_QUEUE_VALUE *values;   // values referred to by heap
 } PRIORITY_QUEUE;
 
@@ -24,6 +52,13 @@ typedef struct priority_queue_s {
 #define pq_init(Q)  NAME(pq_init)(Q)
 void pq_init(PRIORITY_QUEUE *q);
 
+// Choose the kind of heap: 2 for a binary heap of indices into the values,
+// or 4 or 8 for a d-ary heap holding copies of the values with their indices,
+// which saves a random load per comparison. Either way, values that are equal
+// come off in index order, so the order is the same. Call before set up.
+#define pq_set_arity(Q, Arity) NAME(pq_set_arity)(Q, Arity)
+void pq_set_arity(PRIORITY_QUEUE *q, int arity);
+
 #define PRIORITY_QUEUE_DECL(Q) PRIORITY_QUEUE Q[1]; pq_init(Q)
 
 // Clear a previously initialized and possibly set up priority queue, returning
@@ -33,43 +68,50 @@ void pq_clear(PRIORITY_QUEUE *q);
 
 // Build the queue with given pre-allocated and filled array of values.
 #define pq_set_up(Q, Values, Size)   NAME(pq_set_up)(Q, Values, Size)
-void pq_set_up(PRIORITY_QUEUE *q, PRIORITY_QUEUE_VALUE *values, int size);
-
-// Build the queue with given pre-allocated and filled array of values
-// and given heap indices.  Note the indices are owned by the heap
-// after set up and will be freed with the heap.
-#define pq_set_up_heap(Q, Heap, Size, Values, MaxSize)  NAME(pq_set_up_heap)(Q, Heap, Size, Values, MaxSize)
+void pq_set_up(PRIORITY_QUEUE *q, PRIORITY_QUEUE_VALUE *values, PRIORITY_QUEUE_INDEX size);
+
+// Build the queue with given pre-allocated and filled array of n_values
+// values and given heap indices, which are copied. The heap can hold up
+// to max_size indices. Memory from an earlier set up is reused if it's
+// big enough.
+#define pq_set_up_heap(Q, Heap, Size, Values, MaxSize, NValues) \
+    NAME(pq_set_up_heap)(Q, Heap, Size, Values, MaxSize, NValues)
 void pq_set_up_heap(PRIORITY_QUEUE *q,
-        int *heap, int size,
-        PRIORITY_QUEUE_VALUE *values, int max_size);
+        PRIORITY_QUEUE_INDEX *heap, PRIORITY_QUEUE_INDEX size,
+        PRIORITY_QUEUE_VALUE *values, PRIORITY_QUEUE_INDEX max_size, PRIORITY_QUEUE_INDEX n_values);
+
+// Make sure the queue has room for a heap of max_size indices of n_values values.
+// If allocation fails with an allocation flag set, it may have less, and set up
+// leaves the queue empty.
+#define pq_reserve(Q, MaxSize, NValues) NAME(pq_reserve)(Q, MaxSize, NValues)
+void pq_reserve(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX max_size, PRIORITY_QUEUE_INDEX n_values);
 
 // Return the index of the minimum value on the queue.
 #define pq_peek_min(Q)  NAME(pq_peek_min)(Q)
-int pq_peek_min(PRIORITY_QUEUE *q);
+PRIORITY_QUEUE_INDEX pq_peek_min(PRIORITY_QUEUE *q);
 
 // Remove and return the index of the minimum value on the queue.
 #define pq_get_min(Q)   NAME(pq_get_min)(Q)
-int pq_get_min(PRIORITY_QUEUE *q);
+PRIORITY_QUEUE_INDEX pq_get_min(PRIORITY_QUEUE *q);
 
-// Update the queue given that the value at index i has changed.
+// Update the queue given that the value at index i has changed. Values
+// must only be changed while their indices are not in the queue or just
+// before calling this.
 #define pq_update(Q, I) NAME(pq_update)(Q, I)
-void pq_update(PRIORITY_QUEUE *q, int i);
+void pq_update(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX i);
 
-// Add a new value with index i into the queue.
+// Add a new value with index i into the queue. Set the value first.
 #define pq_add(Q, I)    NAME(pq_add)(Q, I)
-void pq_add(PRIORITY_QUEUE *q, int i);
+void pq_add(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX i);
 
 // Delete index i from the heap, making the corresponding key an orphan.
 #define pq_delete(Q, I) NAME(pq_delete)(Q, I)
-void pq_delete(PRIORITY_QUEUE *q, int i);
-
-// Return an array containing indices currently in the heap.
-#define pq_index_set(Q)         ((Q)->heap)
+void pq_delete(PRIORITY_QUEUE *q, PRIORITY_QUEUE_INDEX i);
 
-// Return an array containing indices currently in the heap.
-#define pq_index(Q, I)          ((Q)->heap[I])
+// Return the I'th index currently in the heap.
+#define pq_index(Q, I)          ((Q)->arity == 2 ? (Q)->heap[I] : (Q)->entries[I].index)
 
-// Return the size of the index array contained above.
+// Return the number of indices currently in the heap.
 #define pq_index_set_size(Q)    ((Q)->size)
 
 // Return non-zero iff the queue is empty.
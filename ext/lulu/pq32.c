@@ -0,0 +1,11 @@
+/*
+ * pq32.c
+ *
+ * The float32 build of pq.c. See namespace.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#define LULU_FLOAT32
+#include "pq.c"
@@ -10,11 +10,17 @@
 
 #include "namespace.h"
 #include "marker.h"
+#include "arena.h"
 
 typedef struct node_s {
-    struct node_s *children;
-    MARKER **markers;
+    struct node_s *children, *parent;
+    MARKER_ID *markers;     // indices into the quadtree's geometry
+    MARKER_COORD *xs, *ys;  // and copies of their shapes, packed for vector scans,
+    MARKER_DISTANCE *rs;
+    MARKER_ID *refs;        // and the refs pointing back here; all five arrays are
+                            // in one arena block starting at xs
     int marker_count, markers_size;
+    MARKER_DISTANCE reach;  // in a loose tree, the largest radius ever added below, or -1
 } NODE;
 
 #define leaf_p(Node) ((Node)->children == NULL)
@@ -37,12 +43,34 @@ typedef struct node_s {
 #define NW 2
 #define NE 3
 
+// Declare the given quadrant of a given bounding box.
+#define QUADRANT_DECL(Q, QX, QY, QW, QH, X, Y, W, H) \
+  MARKER_DISTANCE QW = W * 0.5; \
+  MARKER_DISTANCE QH = H * 0.5; \
+  MARKER_COORD QX = (Q & 1) ? X + QW : X; \
+  MARKER_COORD QY = (Q & 2) ? Y + QH : Y
+
+// Where a marker is held: a node and position in its list. A marker's refs are
+// linked through next, as are unused ones.
+typedef struct qt_ref_s {
+    NODE *node;
+    int k;
+    MARKER_ID next;
+} QT_REF;
+
 typedef struct quadtree_s {
     MARKER_COORD x, y;
     MARKER_DISTANCE w, h;
     int max_depth;
+    int loose_p;            // markers go in one node each, which they may overhang
     MARKER_INFO *info;
+    MARKER_GEOMETRY *geometry;
+    ARENA arena[1];         // holds all nodes and marker lists
     NODE root[1];
+    QT_REF *refs;           // where each marker is held, so deletes needn't search
+    MARKER_ID n_refs, max_refs, free_ref;
+    MARKER_ID *marker_refs; // first ref of each marker, or -1
+    MARKER_ID max_markers;
 } QUADTREE;
 
 #define QUADTREE_DECL(Name) QUADTREE Name[1]; qt_init(Name)
@@ -50,24 +78,47 @@ typedef struct quadtree_s {
 #define qt_init(T)  NAME(qt_init)(T)
 void qt_init(QUADTREE *qt);
 
-#define qt_setup(T, MaxDepth, X, Y, W, H, Info) NAME(qt_setup)(T, MaxDepth, X, Y, W, H, Info)
+// Markers are held as indices into the given geometry, which may be
+// reallocated as it grows, but must keep the same address.
+#define qt_setup(T, MaxDepth, X, Y, W, H, Info, Geometry) NAME(qt_setup)(T, MaxDepth, X, Y, W, H, Info, Geometry)
 void qt_setup(QUADTREE *qt, int max_depth,
         MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE w, MARKER_DISTANCE h,
-        MARKER_INFO *info);
+        MARKER_INFO *info, MARKER_GEOMETRY *geometry);
+
+// Set up a loose quadtree over the square with given corner and side. Each marker
+// goes in the one node chosen by its center of the deepest level with side at
+// least twice its radius, rather than in every node it touches. Markers overhang
+// their nodes, so searches check children grown by the largest radius added below
+// them. Depth is chosen from the extent and the sizes of the first n_markers
+// markers of the geometry.
+#define qt_setup_loose(T, X, Y, Side, Info, Geometry, NMarkers) \
+    NAME(qt_setup_loose)(T, X, Y, Side, Info, Geometry, NMarkers)
+void qt_setup_loose(QUADTREE *qt, MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE side,
+        MARKER_INFO *info, MARKER_GEOMETRY *geometry, MARKER_ID n_markers);
 
 #define qt_clear(T) NAME(qt_clear)(T)
 void qt_clear(QUADTREE *qt);
 
-#define qt_insert(T, Marker)    NAME(qt_insert)(T, Marker)
-void qt_insert(QUADTREE *qt, MARKER *marker);
+// Empty the tree, keeping its memory for reuse. It must be set up again.
+#define qt_reset(T) NAME(qt_reset)(T)
+void qt_reset(QUADTREE *qt);
+
+#define qt_insert(T, I)    NAME(qt_insert)(T, I)
+void qt_insert(QUADTREE *qt, MARKER_ID i);
 
-#define qt_delete(T, Marker)    NAME(qt_delete)(T, Marker)
-void qt_delete(QUADTREE *qt, MARKER *marker);
+#define qt_delete(T, I)    NAME(qt_delete)(T, I)
+void qt_delete(QUADTREE *qt, MARKER_ID i);
 
-#define qt_nearest(T, Marker)   NAME(qt_nearest)(T, Marker)
-MARKER *qt_nearest(QUADTREE *qt, MARKER *marker);
+// Return the index of the nearest marker in the tree overlapping marker a
+// and having a lower index, or -1 if there is none.
+#define qt_nearest(T, A)   NAME(qt_nearest)(T, A)
+MARKER_ID qt_nearest(QUADTREE *qt, MARKER_ID a);
 
-#define qt_nearest_wrt(Markers, T, A)   NAME(qt_nearest_wrt)(Markers, T, A)
-int qt_nearest_wrt(MARKER *markers, QUADTREE *qt, int a);
+// Call visit with the index of each marker in the tree whose bounding box overlaps
+// the square with given center and half-side. Markers lying in more than one quad
+// may be visited more than once.
+#define qt_overlapping(T, X, Y, R, Visit, Env) NAME(qt_overlapping)(T, X, Y, R, Visit, Env)
+void qt_overlapping(QUADTREE *qt, MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r,
+        void (*visit)(MARKER_ID i, void *env), void *env);
 
 #endif /* QT_H_ */
@@ -0,0 +1,11 @@
+/*
+ * qt32.c
+ *
+ * The float32 build of qt.c. See namespace.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#define LULU_FLOAT32
+#include "qt.c"
@@ -0,0 +1,312 @@
+/*
+ * replay.c
+ *
+ * Replay merge traces, built only with UNIT_TESTS. See mt.h and the replay
+ * task in the Rakefile. Each merge of each trace is replayed once with each
+ * given spatial index and priority queue arity, redoing its index inserts,
+ * deletes, and nearest neighbor searches and its heap operations, but none
+ * of the other work of a merge. Searches and pops are checked against the
+ * trace, and a replay stops at its first mismatch. Results are printed one
+ * JSON object per line:
+ *
+ *   {"merge":0,"n":10000,"pops":7362,"index":"grid","arity":4,
+ *    "seconds":0.012345,"mismatches":0}
+ *
+ * Replays of traces from the float32 build need a build with LULU_FLOAT32.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifdef UNIT_TESTS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "merger.h"
+#include "mt.h"
+#include "utility.h"
+
+static struct {
+    const char *name;
+    MARKER_INDEX index;
+} indexes[] = {
+    { "quadtree", INDEX_QUADTREE },
+    { "loose_quadtree", INDEX_LOOSE_QUADTREE },
+    { "grid", INDEX_GRID },
+    { "auto", INDEX_AUTO },
+};
+
+// What a replay of one merge needs. The workspace's arrays are reused.
+typedef struct replay_s {
+    MARKER_INFO info[1];
+    MERGE_WORKSPACE workspace[1];
+    MARKER_ID n_markers; // of the merge, then including merged ones
+    int pops;
+    int mismatches;
+} REPLAY;
+
+#define GetVarint(V) do { if (((V) = mt_get_varint(&p, end)) < 0) return NULL; } while (0)
+#define GetCoord(C) do { if (mt_get_coord(&p, end, &(C))) return NULL; } while (0)
+
+// Report a mismatch with the trace. The replay can't go on, because the
+// index or queue no longer holds what the traced merge's did.
+static void mismatch(REPLAY *r, const char *what, long long traced, long long replayed) {
+    fprintf(stderr, "mismatch at pop %d: %s %lld traced, %lld replayed\n", r->pops, what, traced, replayed);
+    r->mismatches++;
+}
+
+// Replay the events of the merge just past the given MT_START tag, returning
+// a pointer past its MT_END, or NULL if the trace is malformed.
+static const unsigned char *replay_merge(REPLAY *r, const unsigned char *p, const unsigned char *end) {
+    MERGE_WORKSPACE *workspace = r->workspace;
+    if (p >= end || *p++ != sizeof(MARKER_COORD)) {
+        fprintf(stderr, "trace coordinates are not %d bytes\n", (int)sizeof(MARKER_COORD));
+        return NULL;
+    }
+    long long kind, n;
+    GetVarint(kind);
+    GetCoord(r->info->c);
+    GetVarint(n);
+    if (n < 1 || n > MR_MAX_MARKERS)
+        return NULL;
+    r->info->kind = kind == SQUARE ? SQUARE : CIRCLE;
+    r->n_markers = n;
+    r->pops = r->mismatches = 0;
+
+    MARKER_ID max_size = 2 * r->n_markers - 1;
+    if (max_size > workspace->max_size) {
+        RenewArray(workspace->n_nghbr, max_size);
+        RenewArray(workspace->mindist, max_size);
+        workspace->max_size = max_size;
+    }
+    MARKER_GEOMETRY *g = workspace->geometry;
+    mg_reserve(g, max_size);
+    for (MARKER_ID i = 0; i < r->n_markers; i++) {
+        MARKER_COORD x, y, radius;
+        GetCoord(x);
+        GetCoord(y);
+        GetCoord(radius);
+        mg_set(g, i, x, y, radius, 0);
+    }
+    NEAREST_INDEX *index = workspace->index;
+    index_setup(index, r->info, g, r->n_markers);
+    for (MARKER_ID i = 0; i < r->n_markers; i++)
+        index_insert(index, i);
+
+    MARKER_ID *n_nghbr = workspace->n_nghbr;
+    MARKER_DISTANCE *mindist = workspace->mindist;
+    PRIORITY_QUEUE *pq = workspace->pq;
+    int heap_set_p = 0;
+    while (p < end) {
+        int tag = *p++;
+        long long a, b;
+        MARKER_ID got;
+        switch (tag) {
+        case MT_NEAREST:
+            GetVarint(a);
+            GetVarint(b);
+            if (r->mismatches > 0)
+                break;
+            if (a >= r->n_markers)
+                return NULL;
+            got = index_nearest(index, a);
+            // Until the heap is set up, only neighbors of lower index count.
+            if (!heap_set_p && got >= a)
+                got = -1;
+            if (got != b - 1)
+                mismatch(r, "nearest", b - 1, got);
+            n_nghbr[a] = got;
+            if (got >= 0)
+                mindist[a] = mg_distance(r->info, g, a, got);
+            break;
+        case MT_HEAP:
+            GetVarint(a);
+            if (r->mismatches > 0)
+                break;
+            EnsureArraySize(workspace->tmp, workspace->max_tmp, r->n_markers);
+            got = 0;
+            for (MARKER_ID i = 0; i < r->n_markers; i++)
+                if (n_nghbr[i] >= 0)
+                    workspace->tmp[got++] = i;
+            if (got != a)
+                mismatch(r, "heap size", a, got);
+            pq_set_up_heap(pq, workspace->tmp, got, mindist, r->n_markers, max_size);
+            heap_set_p = 1;
+            break;
+        case MT_POP:
+            GetVarint(a);
+            GetVarint(b);
+            if (r->mismatches > 0)
+                break;
+            got = pq_empty_p(pq) ? -1 : pq_get_min(pq);
+            if (got != a)
+                mismatch(r, "pop", a, got);
+            else if (n_nghbr[a] != b)
+                mismatch(r, "pair", b, n_nghbr[a]);
+            else {
+                pq_delete(pq, b);
+                index_delete(index, a);
+                index_delete(index, b);
+                mg_set_deleted(g, a);
+                mg_set_deleted(g, b);
+                r->pops++;
+            }
+            break;
+        case MT_NEW: {
+            MARKER_COORD x, y, radius;
+            GetVarint(a);
+            GetCoord(x);
+            GetCoord(y);
+            GetCoord(radius);
+            if (r->mismatches > 0)
+                break;
+            if (a != r->n_markers || a >= max_size)
+                return NULL;
+            mg_set(g, r->n_markers++, x, y, radius, 0);
+            index_insert(index, a);
+            break;
+        }
+        case MT_ADD:
+        case MT_UPDATE:
+        case MT_DELETE:
+            GetVarint(a);
+            if (r->mismatches > 0)
+                break;
+            if (a >= r->n_markers)
+                return NULL;
+            if (tag == MT_ADD)
+                pq_add(pq, a);
+            else if (tag == MT_UPDATE)
+                pq_update(pq, a);
+            else
+                pq_delete(pq, a);
+            break;
+        case MT_END:
+            GetVarint(a);
+            if (r->mismatches == 0 && a != r->n_markers)
+                mismatch(r, "markers", a, r->n_markers);
+            return p;
+        default:
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Split a comma-separated list into at most max_items strings, returning how many.
+static int split(char *list, char **items, int max_items) {
+    int n = 0;
+    for (char *item = strtok(list, ","); item && n < max_items; item = strtok(NULL, ","))
+        items[n++] = item;
+    return n;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-i index,...] [-a arity,...] trace\n"
+            "indexes: quadtree, loose_quadtree, grid, auto; arities: 2, 4, 8\n", program);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int selected[STATIC_ARRAY_SIZE(indexes)] = { 0, 1, 2 };
+    int n_selected = 3;
+    int arities[3] = { 2, 4, 8 };
+    int n_arities = 3;
+    char *items[32];
+    int opt;
+    while ((opt = getopt(argc, argv, "i:a:")) != -1) {
+        switch (opt) {
+        case 'i':
+            n_selected = 0;
+            for (int n = split(optarg, items, STATIC_ARRAY_SIZE(items)), i = 0; i < n; i++) {
+                int k = 0;
+                while (k < STATIC_ARRAY_SIZE(indexes) && strcmp(items[i], indexes[k].name) != 0)
+                    k++;
+                if (k == STATIC_ARRAY_SIZE(indexes) || n_selected == STATIC_ARRAY_SIZE(selected))
+                    usage(argv[0]);
+                selected[n_selected++] = k;
+            }
+            break;
+        case 'a':
+            n_arities = 0;
+            for (int n = split(optarg, items, STATIC_ARRAY_SIZE(items)), i = 0; i < n; i++) {
+                int arity = atoi(items[i]);
+                if ((arity != 2 && arity != 4 && arity != 8) || n_arities == STATIC_ARRAY_SIZE(arities))
+                    usage(argv[0]);
+                arities[n_arities++] = arity;
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || n_selected == 0 || n_arities == 0)
+        usage(argv[0]);
+
+    // Read the whole trace first, so replay times don't include reading it.
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t size = 0, max_size = 0;
+    unsigned char *trace = NULL;
+    for (;;) {
+        EnsureArraySize(trace, max_size, size + 65536);
+        size_t n = fread(trace + size, 1, max_size - size, f);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    fclose(f);
+    const unsigned char *end = trace + size;
+    size_t magic_size = strlen(MT_MAGIC);
+    if (size < magic_size || memcmp(trace, MT_MAGIC, magic_size) != 0) {
+        fprintf(stderr, "%s: not a merge trace\n", argv[optind]);
+        return 1;
+    }
+
+    REPLAY r[1];
+    mr_info_init(r->info);
+    merge_workspace_init(r->workspace);
+    int status = 0;
+    const unsigned char *p = trace + magic_size;
+    for (int merge = 0; p < end; merge++) {
+        if (*p++ != MT_START) {
+            fprintf(stderr, "%s: malformed trace\n", argv[optind]);
+            return 1;
+        }
+        const unsigned char *next = NULL;
+        for (int k = 0; k < n_selected; k++)
+            for (int j = 0; j < n_arities; j++) {
+                struct timeval start[1], stop[1], diff[1];
+                r->info->index = indexes[selected[k]].index;
+                pq_clear(r->workspace->pq);
+                pq_set_arity(r->workspace->pq, arities[j]);
+                gettimeofday(start, NULL);
+                next = replay_merge(r, p, end);
+                gettimeofday(stop, NULL);
+                if (!next) {
+                    fprintf(stderr, "%s: malformed merge %d\n", argv[optind], merge);
+                    return 1;
+                }
+                timersub(stop, start, diff);
+                printf("{\"merge\":%d,\"n\":%" PRI_MARKER_ID ",\"pops\":%d,\"index\":\"%s\",\"arity\":%d,"
+                        "\"seconds\":%.6f,\"mismatches\":%d}\n",
+                        merge, r->n_markers - r->pops, r->pops, indexes[selected[k]].name, arities[j],
+                        diff->tv_sec + 1.0e-6 * diff->tv_usec, r->mismatches);
+                if (r->mismatches > 0)
+                    status = 1;
+            }
+        p = next;
+    }
+    merge_workspace_clear(r->workspace);
+    Free(trace);
+    return status;
+}
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * scan.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "scan.h"
+
+// Slack for circle checks without square roots. It keeps rounding from
+// excluding a marker that just touches.
+#ifdef LULU_FLOAT32
+#define CIRCLE_SLACK (1 + 1e-5f)
+#else
+#define CIRCLE_SLACK (1 + 1e-9)
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LULU_NO_SIMD)
+#define X86_KERNELS
+#include <immintrin.h>
+// SSE2 has no 64-bit integer comparison, so the index64 build has only the
+// AVX2 kernel.
+#ifndef LULU_INDEX64
+#define SSE2_KERNELS
+#endif
+#endif
+
+typedef int (*SCAN_KERNEL)(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits);
+
+// Check candidates from k to n one at a time.
+static int scan_tail(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int k, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits, int n_hits) {
+    if (kind == SQUARE) {
+        for (; k < n; k++) {
+            MARKER_DISTANCE r_sum = r + rs[k];
+            if (indices[k] < limit && fabs(xs[k] - x) - r_sum < 0 && fabs(ys[k] - y) - r_sum < 0)
+                hits[n_hits++] = k;
+        }
+    } else {
+        for (; k < n; k++) {
+            MARKER_DISTANCE dx = xs[k] - x;
+            MARKER_DISTANCE dy = ys[k] - y;
+            MARKER_DISTANCE r_sum = r + rs[k];
+            if (indices[k] < limit && dx * dx + dy * dy < r_sum * r_sum * CIRCLE_SLACK)
+                hits[n_hits++] = k;
+        }
+    }
+    return n_hits;
+}
+
+static int scan_scalar(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits) {
+    return scan_tail(kind, xs, ys, rs, indices, 0, n, x, y, r, limit, hits, 0);
+}
+
+#ifdef X86_KERNELS
+
+// Append positions k + j for the set bits j of mask.
+#define ADD_HITS(Hits, NHits, K, Mask) do { \
+    for (int m_ = (Mask); m_; m_ &= m_ - 1) \
+        (Hits)[(NHits)++] = (K) + __builtin_ctz(m_); \
+} while (0)
+
+#ifdef LULU_FLOAT32
+
+// Lanes of all ones where the eight indices from k are below limit. In the
+// index64 build, the low halves of the 64-bit comparisons are gathered.
+__attribute__((target("avx2")))
+static inline __m256i below8(MARKER_ID *indices, int k, MARKER_ID limit) {
+#ifdef LULU_INDEX64
+    __m256i vlimit = _mm256_set1_epi64x(limit);
+    __m256i lo = _mm256_cmpgt_epi64(vlimit, _mm256_loadu_si256((__m256i *)(indices + k)));
+    __m256i hi = _mm256_cmpgt_epi64(vlimit, _mm256_loadu_si256((__m256i *)(indices + k + 4)));
+    __m256i halves = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    return _mm256_permute2x128_si256(_mm256_permutevar8x32_epi32(lo, halves),
+            _mm256_permutevar8x32_epi32(hi, halves), 0x20);
+#else
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(limit), _mm256_loadu_si256((__m256i *)(indices + k)));
+#endif
+}
+
+// Eight candidates at a time. Index masks and floats have the same lane
+// width, so they mask the float comparisons directly.
+__attribute__((target("avx2")))
+static int scan_avx2(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits) {
+    __m256 vx = _mm256_set1_ps(x);
+    __m256 vy = _mm256_set1_ps(y);
+    __m256 vr = _mm256_set1_ps(r);
+    __m256 zero = _mm256_setzero_ps();
+    int k = 0, n_hits = 0;
+    if (kind == SQUARE) {
+        __m256 sign = _mm256_set1_ps(-0.0f);
+        for (; k + 8 <= n; k += 8) {
+            __m256i below = below8(indices, k, limit);
+            if (_mm256_movemask_epi8(below) == 0)
+                continue;
+            __m256 r_sum = _mm256_add_ps(vr, _mm256_loadu_ps(rs + k));
+            __m256 dx = _mm256_sub_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(xs + k), vx)), r_sum);
+            __m256 dy = _mm256_sub_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(ys + k), vy)), r_sum);
+            __m256 in = _mm256_and_ps(_mm256_cmp_ps(dx, zero, _CMP_LT_OQ), _mm256_cmp_ps(dy, zero, _CMP_LT_OQ));
+            in = _mm256_and_ps(in, _mm256_castsi256_ps(below));
+            ADD_HITS(hits, n_hits, k, _mm256_movemask_ps(in));
+        }
+    } else {
+        __m256 slack = _mm256_set1_ps(CIRCLE_SLACK);
+        for (; k + 8 <= n; k += 8) {
+            __m256i below = below8(indices, k, limit);
+            if (_mm256_movemask_epi8(below) == 0)
+                continue;
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + k), vx);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + k), vy);
+            __m256 r_sum = _mm256_add_ps(vr, _mm256_loadu_ps(rs + k));
+            __m256 d2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+            __m256 limit2 = _mm256_mul_ps(_mm256_mul_ps(r_sum, r_sum), slack);
+            __m256 in = _mm256_cmp_ps(d2, limit2, _CMP_LT_OQ);
+            in = _mm256_and_ps(in, _mm256_castsi256_ps(below));
+            ADD_HITS(hits, n_hits, k, _mm256_movemask_ps(in));
+        }
+    }
+    _mm256_zeroupper();
+    return scan_tail(kind, xs, ys, rs, indices, k, n, x, y, r, limit, hits, n_hits);
+}
+
+#ifdef SSE2_KERNELS
+
+// Four candidates at a time.
+__attribute__((target("sse2")))
+static int scan_sse2(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits) {
+    __m128 vx = _mm_set1_ps(x);
+    __m128 vy = _mm_set1_ps(y);
+    __m128 vr = _mm_set1_ps(r);
+    __m128 zero = _mm_setzero_ps();
+    __m128i vlimit = _mm_set1_epi32(limit);
+    int k = 0, n_hits = 0;
+    if (kind == SQUARE) {
+        __m128 sign = _mm_set1_ps(-0.0f);
+        for (; k + 4 <= n; k += 4) {
+            __m128i below = _mm_cmplt_epi32(_mm_loadu_si128((__m128i *)(indices + k)), vlimit);
+            if (_mm_movemask_epi8(below) == 0)
+                continue;
+            __m128 r_sum = _mm_add_ps(vr, _mm_loadu_ps(rs + k));
+            __m128 dx = _mm_sub_ps(_mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(xs + k), vx)), r_sum);
+            __m128 dy = _mm_sub_ps(_mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(ys + k), vy)), r_sum);
+            __m128 in = _mm_and_ps(_mm_cmplt_ps(dx, zero), _mm_cmplt_ps(dy, zero));
+            in = _mm_and_ps(in, _mm_castsi128_ps(below));
+            ADD_HITS(hits, n_hits, k, _mm_movemask_ps(in));
+        }
+    } else {
+        __m128 slack = _mm_set1_ps(CIRCLE_SLACK);
+        for (; k + 4 <= n; k += 4) {
+            __m128i below = _mm_cmplt_epi32(_mm_loadu_si128((__m128i *)(indices + k)), vlimit);
+            if (_mm_movemask_epi8(below) == 0)
+                continue;
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs + k), vx);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys + k), vy);
+            __m128 r_sum = _mm_add_ps(vr, _mm_loadu_ps(rs + k));
+            __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            __m128 limit2 = _mm_mul_ps(_mm_mul_ps(r_sum, r_sum), slack);
+            __m128 in = _mm_cmplt_ps(d2, limit2);
+            in = _mm_and_ps(in, _mm_castsi128_ps(below));
+            ADD_HITS(hits, n_hits, k, _mm_movemask_ps(in));
+        }
+    }
+    return scan_tail(kind, xs, ys, rs, indices, k, n, x, y, r, limit, hits, n_hits);
+}
+
+#endif
+
+#else
+
+// Lanes of all ones where the four indices from k are below limit, 64 bits
+// wide to mask double comparisons.
+__attribute__((target("avx2")))
+static inline __m256i below4(MARKER_ID *indices, int k, MARKER_ID limit) {
+#ifdef LULU_INDEX64
+    return _mm256_cmpgt_epi64(_mm256_set1_epi64x(limit), _mm256_loadu_si256((__m256i *)(indices + k)));
+#else
+    return _mm256_cvtepi32_epi64(_mm_cmplt_epi32(_mm_loadu_si128((__m128i *)(indices + k)), _mm_set1_epi32(limit)));
+#endif
+}
+
+// Four candidates at a time.
+__attribute__((target("avx2")))
+static int scan_avx2(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits) {
+    __m256d vx = _mm256_set1_pd(x);
+    __m256d vy = _mm256_set1_pd(y);
+    __m256d vr = _mm256_set1_pd(r);
+    __m256d zero = _mm256_setzero_pd();
+    int k = 0, n_hits = 0;
+    if (kind == SQUARE) {
+        __m256d sign = _mm256_set1_pd(-0.0);
+        for (; k + 4 <= n; k += 4) {
+            __m256i below = below4(indices, k, limit);
+            if (_mm256_movemask_epi8(below) == 0)
+                continue;
+            __m256d r_sum = _mm256_add_pd(vr, _mm256_loadu_pd(rs + k));
+            __m256d dx = _mm256_sub_pd(_mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(xs + k), vx)), r_sum);
+            __m256d dy = _mm256_sub_pd(_mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(ys + k), vy)), r_sum);
+            __m256d in = _mm256_and_pd(_mm256_cmp_pd(dx, zero, _CMP_LT_OQ), _mm256_cmp_pd(dy, zero, _CMP_LT_OQ));
+            in = _mm256_and_pd(in, _mm256_castsi256_pd(below));
+            ADD_HITS(hits, n_hits, k, _mm256_movemask_pd(in));
+        }
+    } else {
+        __m256d slack = _mm256_set1_pd(CIRCLE_SLACK);
+        for (; k + 4 <= n; k += 4) {
+            __m256i below = below4(indices, k, limit);
+            if (_mm256_movemask_epi8(below) == 0)
+                continue;
+            __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(xs + k), vx);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(ys + k), vy);
+            __m256d r_sum = _mm256_add_pd(vr, _mm256_loadu_pd(rs + k));
+            __m256d d2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+            __m256d limit2 = _mm256_mul_pd(_mm256_mul_pd(r_sum, r_sum), slack);
+            __m256d in = _mm256_cmp_pd(d2, limit2, _CMP_LT_OQ);
+            in = _mm256_and_pd(in, _mm256_castsi256_pd(below));
+            ADD_HITS(hits, n_hits, k, _mm256_movemask_pd(in));
+        }
+    }
+    // Clear upper halves so the SSE code of the tail doesn't pay for a state transition.
+    _mm256_zeroupper();
+    return scan_tail(kind, xs, ys, rs, indices, k, n, x, y, r, limit, hits, n_hits);
+}
+
+#ifdef SSE2_KERNELS
+
+// Two candidates at a time.
+__attribute__((target("sse2")))
+static int scan_sse2(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits) {
+    __m128d vx = _mm_set1_pd(x);
+    __m128d vy = _mm_set1_pd(y);
+    __m128d vr = _mm_set1_pd(r);
+    __m128d zero = _mm_setzero_pd();
+    __m128i vlimit = _mm_set1_epi32(limit);
+    int k = 0, n_hits = 0;
+    if (kind == SQUARE) {
+        __m128d sign = _mm_set1_pd(-0.0);
+        for (; k + 2 <= n; k += 2) {
+            __m128i below = _mm_cmplt_epi32(_mm_loadl_epi64((__m128i *)(indices + k)), vlimit);
+            if ((_mm_movemask_epi8(below) & 0xff) == 0)
+                continue;
+            __m128d r_sum = _mm_add_pd(vr, _mm_loadu_pd(rs + k));
+            __m128d dx = _mm_sub_pd(_mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(xs + k), vx)), r_sum);
+            __m128d dy = _mm_sub_pd(_mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(ys + k), vy)), r_sum);
+            __m128d in = _mm_and_pd(_mm_cmplt_pd(dx, zero), _mm_cmplt_pd(dy, zero));
+            in = _mm_and_pd(in, _mm_castsi128_pd(_mm_unpacklo_epi32(below, below)));
+            ADD_HITS(hits, n_hits, k, _mm_movemask_pd(in));
+        }
+    } else {
+        __m128d slack = _mm_set1_pd(CIRCLE_SLACK);
+        for (; k + 2 <= n; k += 2) {
+            __m128i below = _mm_cmplt_epi32(_mm_loadl_epi64((__m128i *)(indices + k)), vlimit);
+            if ((_mm_movemask_epi8(below) & 0xff) == 0)
+                continue;
+            __m128d dx = _mm_sub_pd(_mm_loadu_pd(xs + k), vx);
+            __m128d dy = _mm_sub_pd(_mm_loadu_pd(ys + k), vy);
+            __m128d r_sum = _mm_add_pd(vr, _mm_loadu_pd(rs + k));
+            __m128d d2 = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+            __m128d limit2 = _mm_mul_pd(_mm_mul_pd(r_sum, r_sum), slack);
+            __m128d in = _mm_cmplt_pd(d2, limit2);
+            in = _mm_and_pd(in, _mm_castsi128_pd(_mm_unpacklo_epi32(below, below)));
+            ADD_HITS(hits, n_hits, k, _mm_movemask_pd(in));
+        }
+    }
+    return scan_tail(kind, xs, ys, rs, indices, k, n, x, y, r, limit, hits, n_hits);
+}
+
+#endif
+
+#endif
+
+#endif
+
+static SCAN_KERNEL kernel = NULL;
+static const char *kernel_name = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernel this CPU supports. Called once, by pthread_once, so
+// merge threads never see a half-set choice.
+static void select_kernel(void) {
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel_name = "avx2";
+        kernel = scan_avx2;
+        return;
+    }
+#ifdef SSE2_KERNELS
+    if (__builtin_cpu_supports("sse2")) {
+        kernel_name = "sse2";
+        kernel = scan_sse2;
+        return;
+    }
+#endif
+#endif
+    kernel_name = "scalar";
+    kernel = scan_scalar;
+}
+
+int scan_overlapping(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits) {
+    pthread_once(&kernel_once, select_kernel);
+    return kernel(kind, xs, ys, rs, indices, n, x, y, r, limit, hits);
+}
+
+const char *scan_kernel_name(void) {
+    pthread_once(&kernel_once, select_kernel);
+    return kernel_name;
+}
@@ -0,0 +1,38 @@
+/*
+ * scan.h
+ *
+ * Vectorized scans of packed marker shapes for candidate overlaps. The
+ * quadtree keeps the centers and radii of each node's markers in separate
+ * arrays so these can check several candidates at once.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include "namespace.h"
+#include "marker.h"
+
+/**
+ * Find markers among the n given by centers xs, ys and radii rs that may
+ * overlap the one at x, y with radius r and have indices, given in parallel
+ * array indices, less than limit. Their positions are stored in hits, which
+ * must have room for n, and their count is returned.
+ *
+ * Every such overlapping marker is a hit. For squares, hits overlap exactly.
+ * Circles are checked without square roots, with a little slack, so callers
+ * must compute distances of the hits to be sure.
+ */
+#define scan_overlapping(Kind, Xs, Ys, Rs, Indices, N, X, Y, R, Limit, Hits) \
+    NAME(scan_overlapping)(Kind, Xs, Ys, Rs, Indices, N, X, Y, R, Limit, Hits)
+int scan_overlapping(MARKER_KIND kind,
+        MARKER_COORD *xs, MARKER_COORD *ys, MARKER_DISTANCE *rs, MARKER_ID *indices, int n,
+        MARKER_COORD x, MARKER_COORD y, MARKER_DISTANCE r, MARKER_ID limit, int *hits);
+
+// Name of the kernel scan_overlapping uses on this machine: "avx2", "sse2", or "scalar".
+#define scan_kernel_name NAME(scan_kernel_name)
+const char *scan_kernel_name(void);
+
+#endif /* SCAN_H_ */
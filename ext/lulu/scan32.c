@@ -0,0 +1,11 @@
+/*
+ * scan32.c
+ *
+ * The float32 build of scan.c. See namespace.h.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#define LULU_FLOAT32
+#include "scan.c"
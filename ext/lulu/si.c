@@ -0,0 +1,211 @@
+/*
+ * si.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "si.h"
+#include "utility.h"
+
+#define GRID_MAX ((1 << SI_GRID_BITS) - 1)
+
+// Quads holding no more than this many entries are searched linearly.
+#define SMALL_QUAD_SIZE 8
+
+// Spread the low 16 bits of n so there's a zero bit between each pair.
+static uint32_t spread_bits(uint32_t n) {
+    n &= 0xffff;
+    n = (n | (n << 8)) & 0x00ff00ff;
+    n = (n | (n << 4)) & 0x0f0f0f0f;
+    n = (n | (n << 2)) & 0x33333333;
+    n = (n | (n << 1)) & 0x55555555;
+    return n;
+}
+
+// Interleave grid coordinates so the low bit of a 2-bit digit is x and the
+// high bit is y, the same as the quadrant numbering of the quadtree.
+static uint32_t morton_code(uint32_t gx, uint32_t gy) {
+    return spread_bits(gx) | (spread_bits(gy) << 1);
+}
+
+// Map a coordinate onto the grid without clamping.
+static double to_grid(MARKER_COORD v, MARKER_COORD origin, MARKER_DISTANCE scale) {
+    return floor((v - origin) * scale);
+}
+
+static uint32_t clamp_to_grid(double g) {
+    return g < 0 ? 0 : g > GRID_MAX ? GRID_MAX : (uint32_t)g;
+}
+
+// Sort entries by code with an LSD radix sort on bytes. Return 0, or -1 if
+// allocation fails.
+static int sort_entries(SI_ENTRY *entries, MARKER_ID n) {
+    NewArrayDecl(SI_ENTRY, tmp, n > 0 ? n : 1);
+    if (!tmp)
+        return -1;
+    SI_ENTRY *src = entries, *dst = tmp;
+    for (int shift = 0; shift < 32; shift += 8) {
+        MARKER_ID counts[257];
+        memset(counts, 0, sizeof counts);
+        for (MARKER_ID i = 0; i < n; i++)
+            counts[((src[i].code >> shift) & 0xff) + 1]++;
+        for (int i = 1; i < 257; i++)
+            counts[i] += counts[i - 1];
+        for (MARKER_ID i = 0; i < n; i++)
+            dst[counts[(src[i].code >> shift) & 0xff]++] = src[i];
+        SI_ENTRY *t = src; src = dst; dst = t;
+    }
+    // An even number of passes leaves the result in entries.
+    Free(tmp);
+    return 0;
+}
+
+void si_init(SPATIAL_INDEX *index) {
+    index->x = index->y = 0;
+    index->x_scale = index->y_scale = 0;
+    index->r_max = 0;
+    index->entries = NULL;
+    index->size = 0;
+    index->built_p = 0;
+}
+
+void si_clear(SPATIAL_INDEX *index) {
+    Free(index->entries);
+    si_init(index);
+}
+
+void si_build(SPATIAL_INDEX *index, MARKER *markers, MARKER_ID n_markers) {
+    si_clear(index);
+    NewArray(index->entries, n_markers > 0 ? n_markers : 1);
+    if (!index->entries)
+        return;
+    MARKER_ID n = 0;
+    MARKER_COORD x_min = 0, y_min = 0, x_max = 0, y_max = 0;
+    for (MARKER_ID i = 0; i < n_markers; i++) {
+        MARKER *marker = markers + i;
+        if (mr_deleted_p(marker))
+            continue;
+        if (n == 0) {
+            x_min = x_max = mr_x(marker);
+            y_min = y_max = mr_y(marker);
+        } else {
+            if (mr_x(marker) < x_min) x_min = mr_x(marker);
+            if (mr_x(marker) > x_max) x_max = mr_x(marker);
+            if (mr_y(marker) < y_min) y_min = mr_y(marker);
+            if (mr_y(marker) > y_max) y_max = mr_y(marker);
+        }
+        if (mr_r(marker) > index->r_max)
+            index->r_max = mr_r(marker);
+        index->entries[n++].index = i;
+    }
+    index->size = n;
+    index->x = x_min;
+    index->y = y_min;
+    index->x_scale = x_max > x_min ? GRID_MAX / (x_max - x_min) : 0;
+    index->y_scale = y_max > y_min ? GRID_MAX / (y_max - y_min) : 0;
+    for (MARKER_ID i = 0; i < n; i++) {
+        MARKER *marker = markers + index->entries[i].index;
+        index->entries[i].code = morton_code(
+                clamp_to_grid(to_grid(mr_x(marker), index->x, index->x_scale)),
+                clamp_to_grid(to_grid(mr_y(marker), index->y, index->y_scale)));
+    }
+    if (sort_entries(index->entries, n) != 0) {
+        si_clear(index);
+        return;
+    }
+    index->built_p = 1;
+}
+
+// Local struct to hold the parameters of a box query.
+struct query_info {
+    MARKER *markers;
+    MARKER_COORD x0, y0, x1, y1;
+    // Grid cells that could hold centers of overlapping markers.
+    uint32_t outer_x0, outer_y0, outer_x1, outer_y1;
+    // Grid cells holding only centers strictly inside the box.
+    double inner_x0, inner_y0, inner_x1, inner_y1;
+    void (*visit)(MARKER_ID i, void *env);
+    void *env;
+};
+
+// Return the first entry in [lo, hi) with code at least the given one.
+static MARKER_ID lower_bound(SI_ENTRY *entries, MARKER_ID lo, MARKER_ID hi, uint32_t code) {
+    while (lo < hi) {
+        MARKER_ID mid = lo + (hi - lo) / 2;
+        if (entries[mid].code < code)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Visit the entries in [lo, hi) whose markers overlap the query box.
+static void visit_overlapping(SI_ENTRY *entries, MARKER_ID lo, MARKER_ID hi, struct query_info *query) {
+    for (MARKER_ID i = lo; i < hi; i++) {
+        MARKER_ID j = entries[i].index;
+        MARKER *marker = query->markers + j;
+        if (mr_e(marker) >= query->x0 && mr_w(marker) <= query->x1 &&
+            mr_n(marker) >= query->y0 && mr_s(marker) <= query->y1)
+            query->visit(j, query->env);
+    }
+}
+
+// Search the quad with grid corner (gx, gy) and side 2^bits holding entries [lo, hi).
+static void search(SI_ENTRY *entries, MARKER_ID lo, MARKER_ID hi,
+        uint32_t gx, uint32_t gy, int bits, uint32_t base,
+        struct query_info *query) {
+    if (lo >= hi)
+        return;
+    uint32_t side = (uint32_t)1 << bits;
+    uint32_t ex = gx + side - 1;
+    uint32_t ey = gy + side - 1;
+    if (ex < query->outer_x0 || gx > query->outer_x1 || ey < query->outer_y0 || gy > query->outer_y1)
+        return;
+    if (gx >= query->inner_x0 && ex <= query->inner_x1 && gy >= query->inner_y0 && ey <= query->inner_y1) {
+        for (MARKER_ID i = lo; i < hi; i++)
+            query->visit(entries[i].index, query->env);
+        return;
+    }
+    if (bits == 0 || hi - lo <= SMALL_QUAD_SIZE) {
+        visit_overlapping(entries, lo, hi, query);
+        return;
+    }
+    uint32_t child_codes = (uint32_t)1 << (2 * (bits - 1));
+    uint32_t half = side >> 1;
+    for (int q = 0; q < 4; q++) {
+        uint32_t child_base = base + q * child_codes;
+        MARKER_ID child_hi = q == 3 ? hi : lower_bound(entries, lo, hi, child_base + child_codes);
+        search(entries, lo, child_hi,
+                (q & 1) ? gx + half : gx, (q & 2) ? gy + half : gy, bits - 1, child_base, query);
+        lo = child_hi;
+    }
+}
+
+void si_in_box(SPATIAL_INDEX *index, MARKER *markers,
+        MARKER_COORD x0, MARKER_COORD y0, MARKER_COORD x1, MARKER_COORD y1,
+        void (*visit)(MARKER_ID i, void *env), void *env) {
+    MARKER_DISTANCE r = index->r_max;
+    double ox0 = to_grid(x0 - r, index->x, index->x_scale);
+    double oy0 = to_grid(y0 - r, index->y, index->y_scale);
+    double ox1 = to_grid(x1 + r, index->x, index->x_scale);
+    double oy1 = to_grid(y1 + r, index->y, index->y_scale);
+    if (index->size == 0 || x0 > x1 || y0 > y1 ||
+        ox1 < 0 || oy1 < 0 || ox0 > GRID_MAX || oy0 > GRID_MAX)
+        return;
+    struct query_info query[1] = {{
+        markers, x0, y0, x1, y1,
+        clamp_to_grid(ox0), clamp_to_grid(oy0), clamp_to_grid(ox1), clamp_to_grid(oy1),
+        to_grid(x0, index->x, index->x_scale) + 1,
+        to_grid(y0, index->y, index->y_scale) + 1,
+        to_grid(x1, index->x, index->x_scale) - 1,
+        to_grid(y1, index->y, index->y_scale) - 1,
+        visit, env
+    }};
+    search(index->entries, 0, index->size, 0, 0, SI_GRID_BITS, 0, query);
+}
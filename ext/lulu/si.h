@@ -0,0 +1,60 @@
+/*
+ * si.h
+ *
+ * A read-only spatial index of markers for box queries. Marker centers
+ * are sorted by Morton code, which makes the sorted array an implicit
+ * quadtree: each quad is a contiguous run found by binary search.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef SI_H_
+#define SI_H_
+
+#include <stdint.h>
+#include "namespace.h"
+#include "marker.h"
+
+// Bits of grid resolution in each of x and y.
+#define SI_GRID_BITS 16
+
+typedef struct si_entry_s {
+    uint32_t code;  // Morton code of the marker center's grid cell
+    MARKER_ID index; // index of the marker in its array
+} SI_ENTRY;
+
+typedef struct spatial_index_s {
+    MARKER_COORD x, y;              // origin of the grid
+    MARKER_DISTANCE x_scale, y_scale; // grid cells per unit distance
+    MARKER_DISTANCE r_max;          // largest radius of an indexed marker
+    SI_ENTRY *entries;              // entries sorted by code
+    MARKER_ID size;                 // number of entries
+    int built_p;                    // non-zero iff the index has been built
+} SPATIAL_INDEX;
+
+#define SPATIAL_INDEX_DECL(Name) SPATIAL_INDEX Name[1]; si_init(Name)
+
+#define si_init(Index)  NAME(si_init)(Index)
+void si_init(SPATIAL_INDEX *index);
+
+#define si_clear(Index) NAME(si_clear)(Index)
+void si_clear(SPATIAL_INDEX *index);
+
+// Build the index over all the undeleted markers in the given array. If
+// allocation fails with an allocation flag set, it's left unbuilt.
+#define si_build(Index, Markers, NMarkers)  NAME(si_build)(Index, Markers, NMarkers)
+void si_build(SPATIAL_INDEX *index, MARKER *markers, MARKER_ID n_markers);
+
+// Call visit with the index of each indexed marker whose bounding box
+// overlaps the given box, including the boundary. The markers must be
+// the same ones the index was built with.
+#define si_in_box(Index, Markers, X0, Y0, X1, Y1, Visit, Env) \
+    NAME(si_in_box)(Index, Markers, X0, Y0, X1, Y1, Visit, Env)
+void si_in_box(SPATIAL_INDEX *index, MARKER *markers,
+        MARKER_COORD x0, MARKER_COORD y0, MARKER_COORD x1, MARKER_COORD y1,
+        void (*visit)(MARKER_ID i, void *env), void *env);
+
+#define si_built_p(Index) ((Index)->built_p)
+
+#endif /* SI_H_ */
@@ -0,0 +1,52 @@
+/*
+ * stats.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifdef LULU_MERGE_STATS
+
+// The gem builds with -std=c99, which hides clock_gettime otherwise.
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+__thread MERGE_STATS merge_thread_stats;
+
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void stats_clear(MERGE_STATS *stats) {
+    *stats = (MERGE_STATS){ 0 };
+}
+
+void stats_flush(MERGE_STATS *dst) {
+    MERGE_STATS *src = &merge_thread_stats;
+    pthread_mutex_lock(&flush_mutex);
+    dst->nearest_searches += src->nearest_searches;
+    dst->nodes_visited += src->nodes_visited;
+    dst->candidates += src->candidates;
+    dst->distances += src->distances;
+    dst->heap_sifts += src->heap_sifts;
+    dst->inverse_lists += src->inverse_lists;
+    dst->inverse_total += src->inverse_total;
+    if (src->inverse_max > dst->inverse_max)
+        dst->inverse_max = src->inverse_max;
+    dst->index_nodes += src->index_nodes;
+    if (src->index_depth > dst->index_depth)
+        dst->index_depth = src->index_depth;
+    for (int i = 0; i < MERGE_PHASE_COUNT; i++)
+        dst->phase_ns[i] += src->phase_ns[i];
+    pthread_mutex_unlock(&flush_mutex);
+    stats_clear(src);
+}
+
+uint64_t stats_now_ns(void) {
+    struct timespec now[1];
+    clock_gettime(CLOCK_MONOTONIC, now);
+    return (uint64_t)now->tv_sec * 1000000000u + now->tv_nsec;
+}
+
+#endif
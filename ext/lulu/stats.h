@@ -0,0 +1,93 @@
+/*
+ * stats.h
+ *
+ * Counters of the work merges do, compiled in only with LULU_MERGE_STATS.
+ * Without it the macros below expand to nothing, so they cost nothing.
+ *
+ * Each thread counts in a thread-local MERGE_STATS, so counting needs no
+ * locks. Threads a merge starts move their counts to a MERGE_STATS shared
+ * with the thread that started them, which adds them to its own after
+ * joining them. Whoever calls a merge takes the total with stats_flush.
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: generessler
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "namespace.h"
+
+#ifdef LULU_MERGE_STATS
+
+#include <stdint.h>
+
+// Phases of a serial merge, timed in nanoseconds.
+typedef enum merge_phase_e {
+    PHASE_SETUP,        // workspace arrays and marker geometry
+    PHASE_INDEX,        // spatial index build
+    PHASE_NEAREST,      // initial nearest neighbors and the heap of them
+    PHASE_LOOP,         // merging nearest pairs
+    MERGE_PHASE_COUNT,
+} MERGE_PHASE;
+
+typedef struct merge_stats_s {
+    uint64_t nearest_searches;  // nearest neighbor queries of the spatial index
+    uint64_t nodes_visited;     // quadtree nodes or grid buckets they looked in
+    uint64_t candidates;        // markers in those, checked by vector scans
+    uint64_t distances;         // exact distances computed
+    uint64_t heap_sifts;        // levels priority queue entries moved
+    uint64_t inverse_lists;     // inverse neighbor lists read after merges
+    uint64_t inverse_total;     // their total length
+    uint64_t inverse_max;       // and greatest length
+    uint64_t index_nodes;       // quadtree nodes created
+    uint64_t index_depth;       // deepest quadtree or grid level a marker went in
+    uint64_t phase_ns[MERGE_PHASE_COUNT]; // summed over threads
+} MERGE_STATS;
+
+#define merge_thread_stats NAME(merge_thread_stats)
+extern __thread MERGE_STATS merge_thread_stats;
+
+#define STAT_ADD(Field, N)  (merge_thread_stats.Field += (N))
+#define STAT_MAX(Field, V)  do { \
+    uint64_t v_ = (V); \
+    if (v_ > merge_thread_stats.Field) \
+        merge_thread_stats.Field = v_; \
+} while (0)
+
+#define STATS_DECL(Name) MERGE_STATS Name[1]; stats_clear(Name)
+
+// Zero the counts of this thread, e.g. before a merge.
+#define stats_start() stats_clear(&merge_thread_stats)
+
+// After joining threads that flushed their counts to shared, add those to this thread's.
+#define stats_join(Shared) do { \
+    stats_flush(Shared); \
+    merge_thread_stats = *(Shared); \
+} while (0)
+
+// Move the counts of this thread to dst, which other threads may be moving theirs to.
+#define stats_flush(Dst) NAME(stats_flush)(Dst)
+void stats_flush(MERGE_STATS *dst);
+
+#define stats_clear(S) NAME(stats_clear)(S)
+void stats_clear(MERGE_STATS *stats);
+
+// Nanoseconds on a monotonic clock.
+#define stats_now_ns NAME(stats_now_ns)
+uint64_t stats_now_ns(void);
+
+#else
+
+// Counts are still evaluated, so variables kept only for them count as used,
+// but compile to nothing.
+#define STAT_ADD(Field, N)  ((void)(N))
+#define STAT_MAX(Field, V)  ((void)(V))
+#define STATS_DECL(Name)
+#define stats_start()
+#define stats_join(Shared)
+#define stats_flush(Dst)
+
+#endif
+
+#endif /* STATS_H_ */
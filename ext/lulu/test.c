@@ -12,6 +12,9 @@
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
+#include "merger.h"
+#include "pq.h"
+#include "qt.h"
 #include "test.h"
 #include "utility.h"
 
@@ -33,10 +36,10 @@ void emit_segment(FILE *f, MARKER *a, MARKER *b) {
             mr_x(a), mr_y(a), mr_x(b), mr_y(b));
 }
 
-int emit_marker_ptr_array(FILE *f, MARKER **markers, int n_markers) {
+int emit_marker_index_array(FILE *f, MARKER *markers, MARKER_ID *indices, int n_markers) {
     int n_emitted = 0;
     for (int i = 0; i < n_markers; ++i) {
-        MARKER *m = markers[i];
+        MARKER *m = markers + indices[i];
         if (!m->deleted_p) {
             fprintf(f, "  { kind: 'm', x: %.2f, y: %.2f, r: %.2f }, // %d\n", mr_x(m), mr_y(m), mr_r(m), i);
             n_emitted++;
@@ -112,7 +115,7 @@ int merge_test(int size) {
 
     gettimeofday(start, NULL);
 
-    size = merge_markers_fast(info, markers, size);
+    size = merge_markers_fast(info, markers, size, NULL);
 
     gettimeofday(stop, NULL);
 
@@ -136,12 +139,13 @@ void permute(PRIORITY_QUEUE_VALUE *a, int size) {
     }
 }
 
-// Run a unit test on a priority queue of random data with given size.
-int pq_test(int size) {
+// Check a priority queue of given arity on random data with given size.
+static int pq_check(int size, int arity) {
     PRIORITY_QUEUE q[1];
     pq_init(q);
+    pq_set_arity(q, arity);
 
-    fprintf(stderr, "test: heap_ops (n = %d):\n", size);
+    fprintf(stderr, "test: heap_ops (n = %d, arity = %d):\n", size, q->arity);
 
     // Build linear pointer array of random keys.
     PRIORITY_QUEUE_VALUE *dist;
@@ -192,35 +196,115 @@ int pq_test(int size) {
     fprintf(stderr, "  finished reverse deletions\n");
 
     pq_clear(q);
+    Free(dist);
+    return 0;
+}
+
+// Time a priority queue of given arity on the pattern of operations a merge of
+// the given number of markers makes: set up with a heap of about two thirds of
+// the indices, then repeatedly get the min, delete its neighbor, add a merged
+// index, and update or delete a couple of inverse neighbors. New keys are no
+// less than the last min, as merge distances are. The sum of the indices in
+// order of removal is returned in checksum.
+static double pq_bench(int size, int arity, unsigned *checksum) {
+    struct timeval start[1], stop[1], diff[1];
+    int max_size = 2 * size - 1;
+    PRIORITY_QUEUE q[1];
+    pq_init(q);
+    pq_set_arity(q, arity);
+    srand(size);
+
+    NewArrayDecl(PRIORITY_QUEUE_VALUE, values, max_size);
+    NewArrayDecl(PRIORITY_QUEUE_INDEX, heap, max_size);
+    int heap_size = 0;
+    for (int i = 0; i < size; i++) {
+        values[i] = rand_double();
+        if (i % 3 != 0)
+            heap[heap_size++] = i;
+    }
+
+    gettimeofday(start, NULL);
+    pq_set_up_heap(q, heap, heap_size, values, max_size, max_size);
+    int next = size;
+    unsigned sum = 0;
+    while (!pq_empty_p(q)) {
+        int a = pq_get_min(q);
+        PRIORITY_QUEUE_VALUE min = values[a];
+        sum = 31 * sum + a;
+        if ((a ^ 1) < next)
+            pq_delete(q, a ^ 1);
+        if (next < max_size) {
+            int aa = next++;
+            values[aa] = min + rand_double() * 0.01;
+            pq_add(q, aa);
+        }
+        for (int k = 0; k < 2; k++) {
+            int i = rand() % next;
+            if (rand() % 4 == 0)
+                pq_delete(q, i);
+            else {
+                values[i] = min + rand_double() * 0.01;
+                pq_update(q, i);
+            }
+        }
+    }
+    gettimeofday(stop, NULL);
+
+    pq_clear(q);
+    Free(values);
+    Free(heap);
+    *checksum = sum;
+    timersub(stop, start, diff);
+    return diff->tv_sec + 1.0e-6 * diff->tv_usec;
+}
+
+// Run unit tests on priority queues of random data with given size, then
+// compare their speeds on a merge-like workload. All must give the same order.
+int pq_test(int size) {
+    int arities[] = { 2, 4, 8 };
+    unsigned checksums[3];
+    for (int k = 0; k < 3; k++) {
+        int rtn = pq_check(size, arities[k]);
+        if (rtn)
+            return rtn;
+    }
+    for (int k = 0; k < 3; k++) {
+        double seconds = pq_bench(size, arities[k], checksums + k);
+        fprintf(stderr, "bench: arity %d: %.3f seconds (checksum %u)\n", arities[k], seconds, checksums[k]);
+        if (checksums[k] != checksums[0]) {
+            fprintf(stderr, "  fail 3: arity %d order differs\n", arities[k]);
+            return 424242;
+        }
+    }
     return 0;
 }
 
-static void draw(FILE *f, NODE *node, double x, double y, double w, double h) {
+static void draw(FILE *f, MARKER *markers, NODE *node, double x, double y, double w, double h) {
     emit_rectangle(f, x, y, w, h);
-    emit_marker_ptr_array(f, node->markers, node->marker_count);
+    emit_marker_index_array(f, markers, node->markers, node->marker_count);
     if (internal_p(node)) {
         for (int q = 0; q < 4; q++) {
             QUADRANT_DECL(q, qx, qy, qw, qh, x, y, w, h);
-            draw(f, node->children + q, qx, qy, qw, qh);
+            draw(f, markers, node->children + q, qx, qy, qw, qh);
         }
     }
 }
 
-static void draw_nearest(FILE *f, MARKER *markers, MARKER **nearest_markers, int n_markers) {
+static void draw_nearest(FILE *f, MARKER *markers, MARKER_ID *nearest_markers, int n_markers) {
     for (int i = 0; i < n_markers; i++) {
-        if (nearest_markers[i])
-            emit_segment(f, markers + i, nearest_markers[i]);
+        if (nearest_markers[i] >= 0)
+            emit_segment(f, markers + i, markers + nearest_markers[i]);
     }
 }
 
-int qt_draw(QUADTREE *qt, MARKER *markers, MARKER **nearest_markers, int n_markers, const char *name) {
+int qt_draw(QUADTREE *qt, MARKER *markers, MARKER_ID *nearest_markers, int n_markers, const char *name) {
     char buf[1024];
     sprintf(buf, "test/%s.js", name);
     FILE *f = fopen(buf, "w");
     if (!f)
         return -1;
     fprintf(f, "var %s = [\n", name);
-    draw(f, qt->root, qt->x, qt->y, qt->w, qt->h);
+    draw(f, markers, qt->root, qt->x, qt->y, qt->w, qt->h);
     draw_nearest(f, markers, nearest_markers, n_markers);
     fprintf(f, "];\n");
     fclose(f);
@@ -230,24 +314,29 @@ int qt_draw(QUADTREE *qt, MARKER *markers, MARKER **nearest_markers, int n_marke
 int qt_test(int size) {
     QUADTREE_DECL(qt);
     MARKER_INFO_DECL(info);
-    MARKER *markers, **nearest_markers;
+    MARKER_GEOMETRY_DECL(g);
+    MARKER *markers;
+    MARKER_ID *nearest_markers;
     NewArray(markers, size);
     NewArray(nearest_markers, size);
     set_random_markers(info, markers, size);
-    qt_setup(qt, 5, 0, 0, 1024, 724, info);
+    mg_reserve(g, size);
+    for (int i = 0; i < size; i++)
+        mg_set_marker(g, i, markers + i);
+    qt_setup(qt, 5, 0, 0, 1024, 724, info, g);
     fprintf(stderr, "inserting %d:\n", size);
     for (int i = 0; i < size; i++) {
-        qt_insert(qt, markers + i);
+        qt_insert(qt, i);
     }
     fprintf(stderr, "inserted %d\n", size);
     for (int i = 0; i < size; i++) {
-        nearest_markers[i] = qt_nearest(qt, markers + i);
+        nearest_markers[i] = qt_nearest(qt, i);
     }
     fprintf(stderr, "looked up %d\n", size);
     qt_draw(qt, markers, nearest_markers, size, "qt");
     fprintf(stderr, "drew %d\n", size);
     for (int i = 0; i < size; i++) {
-        qt_delete(qt, markers + i);
+        qt_delete(qt, i);
     }
     fprintf(stderr, "after delete all, root is %s\n",
             leaf_p(qt->root) ? "leaf (ok)" : "internal (not ok)");
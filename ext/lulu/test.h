@@ -16,7 +16,7 @@ int emit_markers(const char *name, MARKER *markers, int n_markers);
 void emit_rectangle(FILE *f, double x, double y, double w, double h);
 void emit_segment(FILE *f, MARKER *a, MARKER *b);
 int emit_marker_array(FILE *f, MARKER *markers, int n_markers);
-int emit_marker_ptr_array(FILE *f, MARKER **markers, int n_markers);
+int emit_marker_index_array(FILE *f, MARKER *markers, MARKER_ID *indices, int n_markers);
 double rand_double(void);
 void set_random_markers(MARKER_INFO *info, MARKER *markers, int n_markers);
 void qt_clear(QUADTREE *qt);
@@ -5,36 +5,405 @@
  *      Author: generessler
  */
 
+// The gem builds with -std=c99, which hides mkstemp, ftruncate, and
+// MAP_ANONYMOUS otherwise.
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define malloc_usable_size malloc_size
+#else
+#include <malloc.h>
+#endif
 #include "utility.h"
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 #ifdef LULU_STD_C
 
-void *safe_malloc(size_t size, const char *file, int line) {
-    void *p = malloc(size);
-    if (!p) {
+static void out_of_memory(const char *file, int line) {
+    fprintf(stderr, "%s:%d: out of memory\n", file, line);
+    exit(1);
+}
+
+#endif
+
+#ifdef LULU_GEM
+
+#include "ruby.h"
+
+// Raise NoMemoryError. Code running without the GVL sets an allocation flag,
+// so this is called only with the GVL, or on a thread that isn't Ruby's and
+// was started without the flag, which can't raise.
+static void out_of_memory(const char *file, int line) {
+    if (!ruby_native_thread_p()) {
         fprintf(stderr, "%s:%d: out of memory\n", file, line);
-        exit(1);
+        abort();
     }
+    rb_memerror();
+}
+
+#endif
+
+// The calling thread's allocation flag. See set_allocation_flag. The gem is
+// loaded with dlopen, so its thread-locals would otherwise be allocated on a
+// thread's first use, and glibc aborts if that fails. Initial-exec ones are
+// set up with the thread, so a thread started short of memory can still
+// note that allocation failed.
+#if defined(__GNUC__) && defined(__ELF__)
+static __thread volatile int *thread_allocation_flag __attribute__((tls_model("initial-exec")));
+#else
+static __thread volatile int *thread_allocation_flag;
+#endif
+
+void set_allocation_flag(volatile int *flag) {
+    thread_allocation_flag = flag;
+}
+
+volatile int *allocation_flag(void) {
+    return thread_allocation_flag;
+}
+
+int allocation_failed_p(void) {
+    return thread_allocation_flag && (*thread_allocation_flag & ALLOCATION_FAILED);
+}
+
+// Note that an allocation failed, returning only if the thread has a flag.
+static void allocation_failed(const char *file, int line) {
+    if (!thread_allocation_flag)
+        out_of_memory(file, line);
+    __sync_fetch_and_or(thread_allocation_flag, ALLOCATION_FAILED);
+}
+
+#ifdef LULU_BENCH
+
+size_t allocation_count, allocation_bytes;
+
+#define count_allocation(Size) do { allocation_count++; allocation_bytes += (Size); } while (0)
+
+double wall_seconds(void) {
+    struct timespec now[1];
+    clock_gettime(CLOCK_MONOTONIC, now);
+    return now->tv_sec + 1.0e-9 * now->tv_nsec;
+}
+
+#else
+
+#define count_allocation(Size)
+
+#endif
+
+// Bytes held by the allocators. See allocated_size.
+static size_t allocated_bytes;
+
+#define add_allocated(Size) __sync_fetch_and_add(&allocated_bytes, (Size))
+#define sub_allocated(Size) __sync_fetch_and_sub(&allocated_bytes, (Size))
+
+size_t allocated_size(void) {
+    return __sync_fetch_and_add(&allocated_bytes, 0);
+}
+
+// Large allocations in storage files. Each is the whole of an unlinked file,
+// mapped shared, so the kernel writes its pages back to the file rather than
+// to swap, and resident memory stays bounded by what's in use. The table of
+// blocks is small and is allocated with plain malloc. A forked child gets
+// copies of the blocks, in anonymous memory if it can't make new files.
+typedef struct storage_block_s {
+    void *p;
+    size_t size;
+    int fd;                     // the block's file, or -1 if it's anonymous memory
+} STORAGE_BLOCK;
+
+static struct storage_s {
+    char *dir;                  // where new blocks go, or NULL
+    size_t min_size;            // of allocations put in blocks
+    STORAGE_BLOCK *blocks;
+    int n_blocks, max_blocks;
+    volatile int active_p;      // whether there's a dir or blocks, so allocations must look
+    pthread_mutex_t mutex;
+} storage = { NULL, 0, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static void update_active(void) {
+    storage.active_p = storage.dir != NULL || storage.n_blocks > 0;
+}
+
+static int find_block(void *p) {
+    for (int k = 0; k < storage.n_blocks; k++)
+        if (storage.blocks[k].p == p)
+            return k;
+    return -1;
+}
+
+// Make an unlinked storage file of the given size, returning its descriptor,
+// or -1 on failure.
+static int new_storage_file(size_t size) {
+    char path[strlen(storage.dir) + sizeof "/lulu.XXXXXX"];
+    sprintf(path, "%s/lulu.XXXXXX", storage.dir);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Map a new storage file of the given size, returning NULL on failure.
+static void *new_block(size_t size) {
+    if (storage.n_blocks == storage.max_blocks) {
+        int max_blocks = 4 + 2 * storage.max_blocks;
+        STORAGE_BLOCK *blocks = realloc(storage.blocks, max_blocks * sizeof *blocks);
+        if (!blocks)
+            return NULL;
+        storage.blocks = blocks;
+        storage.max_blocks = max_blocks;
+    }
+    int fd = new_storage_file(size);
+    if (fd < 0)
+        return NULL;
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    STORAGE_BLOCK *block = storage.blocks + storage.n_blocks++;
+    block->p = p;
+    block->size = size;
+    block->fd = fd;
+    add_allocated(size);
+    update_active();
     return p;
 }
 
-void *safe_realloc(void *p, size_t size, const char *file, int line) {
-    p = realloc(p, size);
+// Resize block k by resizing its file and mapping it again, which copies
+// nothing, or by copying an anonymous block. Return the new address, or NULL
+// on failure.
+static void *resize_block(int k, size_t size) {
+    STORAGE_BLOCK *block = storage.blocks + k;
+    void *p;
+    if (block->fd < 0) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        memcpy(p, block->p, size < block->size ? size : block->size);
+    } else {
+        if (ftruncate(block->fd, size) != 0)
+            return NULL;
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, block->fd, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+    }
+    munmap(block->p, block->size);
+    sub_allocated(block->size);
+    add_allocated(size);
+    block->p = p;
+    block->size = size;
+    return p;
+}
+
+static void free_block(int k) {
+    munmap(storage.blocks[k].p, storage.blocks[k].size);
+    sub_allocated(storage.blocks[k].size);
+    if (storage.blocks[k].fd >= 0)
+        close(storage.blocks[k].fd);
+    storage.blocks[k] = storage.blocks[--storage.n_blocks];
+    update_active();
+}
+
+// Write all of a block to a file, returning 0, or -1 on failure.
+static int write_block(int fd, const char *p, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0) {
+            p += n;
+            size -= n;
+        }
+    }
+    return 0;
+}
+
+// Give a forked child its own copy of a block at the same address, so
+// parent and child don't write the same pages, and neither can shrink the
+// file under the other's mapping. The copy is in a new storage file if
+// there's a storage directory, else, or if that fails, in anonymous memory.
+static void copy_block_for_child(STORAGE_BLOCK *block) {
+    int fd = storage.dir ? new_storage_file(block->size) : -1;
+    if (fd >= 0 && write_block(fd, block->p, block->size) == 0 &&
+            mmap(block->p, block->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        close(block->fd);
+        block->fd = fd;
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+    void *copy = mmap(NULL, block->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy != MAP_FAILED) {
+        memcpy(copy, block->p, block->size);
+        if (mmap(block->p, block->size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            memcpy(block->p, copy, block->size);
+            munmap(copy, block->size);
+            close(block->fd);
+            block->fd = -1;
+            return;
+        }
+        munmap(copy, block->size);
+    }
+    // Out of memory. Keep the pages as they are, but privately, so at least
+    // the child's writes don't reach the parent.
+    mmap(block->p, block->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, block->fd, 0);
+}
+
+// Fork handlers. The storage lock is held across the fork, so the child's
+// table of blocks is whole and its lock is free.
+static void lock_storage(void) {
+    pthread_mutex_lock(&storage.mutex);
+}
+
+static void unlock_storage(void) {
+    pthread_mutex_unlock(&storage.mutex);
+}
+
+static void copy_blocks_for_child(void) {
+    for (int k = 0; k < storage.n_blocks; k++)
+        if (storage.blocks[k].fd >= 0)
+            copy_block_for_child(storage.blocks + k);
+    pthread_mutex_unlock(&storage.mutex);
+}
+
+static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+
+static void set_fork_handlers(void) {
+    pthread_atfork(lock_storage, unlock_storage, copy_blocks_for_child);
+}
+
+int set_storage(const char *dir, size_t min_size) {
+    struct stat st[1];
+    if (dir && stat(dir, st) != 0)
+        return -1;
+    if (dir && !S_ISDIR(st->st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    pthread_once(&fork_handlers_once, set_fork_handlers);
+    char *copy = NULL;
+    if (dir) {
+        copy = malloc(strlen(dir) + 1);
+        if (!copy)
+            return -1;
+        strcpy(copy, dir);
+    }
+    pthread_mutex_lock(&storage.mutex);
+    free(storage.dir);
+    storage.dir = copy;
+    storage.min_size = min_size;
+    update_active();
+    pthread_mutex_unlock(&storage.mutex);
+    return 0;
+}
+
+void *safe_malloc(size_t size, const char *file, int line) {
+    count_allocation(size);
+    void *p = NULL;
+    if (storage.active_p) {
+        pthread_mutex_lock(&storage.mutex);
+        if (storage.dir && size > 0 && size >= storage.min_size)
+            p = new_block(size);
+        pthread_mutex_unlock(&storage.mutex);
+    }
     if (!p) {
-        fprintf(stderr, "%s:%d: out of memory\n", file, line);
-        exit(1);
+        p = malloc(size);
+        if (p)
+            add_allocated(malloc_usable_size(p));
     }
+    if (!p && size > 0)
+        allocation_failed(file, line);
     return p;
 }
 
-#endif
+void *safe_realloc(void *p, size_t size, const char *file, int line) {
+    count_allocation(size);
+    if (storage.active_p) {
+        void *q = NULL;
+        int handled_p = 0;
+        pthread_mutex_lock(&storage.mutex);
+        int k = p ? find_block(p) : -1;
+        if (k >= 0) {
+            handled_p = 1;
+            if (size == 0)
+                free_block(k);
+            else
+                q = resize_block(k, size);
+        } else if (storage.dir && size > 0 && size >= storage.min_size) {
+            // Move a heap block to storage, copying what the heap holds.
+            q = new_block(size);
+            if (q && p) {
+                size_t old_size = malloc_usable_size(p);
+                memcpy(q, p, old_size < size ? old_size : size);
+                sub_allocated(old_size);
+                free(p);
+            }
+            handled_p = q != NULL;
+        }
+        pthread_mutex_unlock(&storage.mutex);
+        if (handled_p) {
+            if (!q && size > 0) {
+                allocation_failed(file, line);
+                return p;
+            }
+            return q;
+        }
+    }
+    size_t old_size = p ? malloc_usable_size(p) : 0;
+    void *q = realloc(p, size);
+    if (q || size == 0) {
+        sub_allocated(old_size);
+        if (q)
+            add_allocated(malloc_usable_size(q));
+    }
+    if (!q && size > 0) {
+        allocation_failed(file, line);
+        return p;
+    }
+    return q;
+}
+
+void safe_free(void *p) {
+    if (p && storage.active_p) {
+        pthread_mutex_lock(&storage.mutex);
+        int k = find_block(p);
+        if (k >= 0)
+            free_block(k);
+        pthread_mutex_unlock(&storage.mutex);
+        if (k >= 0)
+            return;
+    }
+    if (p)
+        sub_allocated(malloc_usable_size(p));
+    free(p);
+}
 
 /**
  * Return the 0-based position of highest bit or -1 of zero.
  */
-int high_bit_position(unsigned n) {
+int high_bit_position(size_t n) {
     int p = -1;
     while (n) {
         p++;
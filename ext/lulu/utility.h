@@ -12,9 +12,8 @@
 
 #define STATIC_ARRAY_SIZE(A) ((int)(sizeof A / sizeof A[0]))
 
-#ifdef LULU_STD_C
-
-// Our allocators.
+// Our allocators. The gem uses them too rather than Ruby's xmalloc, because
+// merges run without the GVL, when calling into the Ruby VM is not allowed.
 #define New(Ptr) do { \
     (Ptr) = safe_malloc(sizeof *(Ptr), __FILE__, __LINE__); \
 } while (0)
@@ -28,7 +27,7 @@
 } while (0)
 
 #define Free(Ptr) do { \
-    free(Ptr); \
+    safe_free(Ptr); \
     Ptr = NULL; \
 } while (0)
 
@@ -38,33 +37,54 @@ void *safe_malloc(size_t size, const char *file, int line);
 #define safe_realloc(P, Size, File, Line)   NAME(safe_realloc)(P, Size, File, Line)
 void *safe_realloc(void *p, size_t size, const char *file, int line);
 
-#endif
-
-#ifdef LULU_GEM
-
-#include "ruby.h"
-
-// Ruby allocators.  We can't use the macros without rewriting to include type parameters.
-#define New(Ptr) do { \
-    (Ptr) = (void*)xmalloc(sizeof *(Ptr)); \
-} while (0)
-
-#define NewArray(Ptr, Size) do { \
-    (Ptr) = (void*)xmalloc2((Size), sizeof *(Ptr)); \
-} while (0)
-
-#define RenewArray(Ptr, Size) do { \
-    (Ptr) = (void*)xrealloc2((char*)(Ptr), (Size), sizeof *(Ptr)); \
-} while (0)
+#define safe_free(P)    NAME(safe_free)(P)
+void safe_free(void *p);
+
+// Set in an allocation flag when allocation fails on a thread that has it.
+#define ALLOCATION_FAILED 2
+
+// Make allocation failures on the calling thread set ALLOCATION_FAILED in
+// *flag rather than raise NoMemoryError, or exit the C programs, which is
+// what they do again after a NULL flag. The allocators then return NULL, and
+// RenewArray leaves its array as it was, so code running with a flag checks
+// before using what it allocated. Merges without the GVL use their cancel
+// flag, so they stop as if canceled and unwind normally, and the caller
+// raises with the GVL. Threads they start set the same flag.
+#define set_allocation_flag(Flag)   NAME(set_allocation_flag)(Flag)
+void set_allocation_flag(volatile int *flag);
+
+// The calling thread's allocation flag, or NULL.
+#define allocation_flag NAME(allocation_flag)
+volatile int *allocation_flag(void);
+
+// Whether allocation has failed on a thread with the calling thread's flag.
+#define allocation_failed_p NAME(allocation_failed_p)
+int allocation_failed_p(void);
+
+// Put later allocations of at least min_size bytes in files in the given
+// directory, mapped into memory, or stop with a NULL dir. Blocks already in
+// files stay there until freed. Returns 0, or -1 with errno set if dir isn't
+// a directory.
+#define set_storage(Dir, MinSize)   NAME(set_storage)(Dir, MinSize)
+int set_storage(const char *dir, size_t min_size);
+
+// Bytes the allocators hold for all threads: heap blocks by their usable
+// size, and storage blocks. The gem reports changes in it to Ruby's GC.
+#define allocated_size NAME(allocated_size)
+size_t allocated_size(void);
 
-#define Free(Ptr) do { \
-    xfree(Ptr); \
-    Ptr = NULL; \
+#define NewDecl(Type, Ptr) Type *Ptr; New(Ptr)
+// Grow a dynamic array so it holds at least N elements. If allocation fails
+// with an allocation flag, Max stays as it was.
+#define EnsureArraySize(Ptr, Max, N) do { \
+    if ((Max) < (N)) { \
+        size_t new_max_ = 4 + 2 * (size_t)(Max) < (size_t)(N) ? (size_t)(N) : 4 + 2 * (size_t)(Max); \
+        RenewArray(Ptr, new_max_); \
+        if (!allocation_failed_p()) \
+            (Max) = new_max_; \
+    } \
 } while (0)
 
-#endif
-
-#define NewDecl(Type, Ptr) Type *Ptr; New(Ptr)
 #define NewArrayDecl(Type, Ptr, Size) Type *Ptr; NewArray(Ptr, Size)
 #define CopyArray(Dst, Src, N)   memcpy((Dst), (Src), (N) * sizeof *(Src))
 
@@ -77,7 +97,21 @@ void trace(const char *fmt, ...);
 #define TRACE(Args)
 #endif
 
+#ifdef LULU_BENCH
+
+// Calls to safe_malloc and safe_realloc, and the bytes they asked for. Only
+// the benchmark build counts them. See bench.c.
+#define allocation_count NAME(allocation_count)
+#define allocation_bytes NAME(allocation_bytes)
+extern size_t allocation_count, allocation_bytes;
+
+// Seconds on a monotonic clock.
+#define wall_seconds NAME(wall_seconds)
+double wall_seconds(void);
+
+#endif
+
 #define high_bit_position(N)    NAME(high_bit_position)(N)
-int high_bit_position(unsigned n);
+int high_bit_position(size_t n);
 
 #endif /* UTILITY_H_ */
@@ -2,13 +2,19 @@ require "lulu/version"
 require "lulu/lulu"
 
 module Lulu
-  class MarkerList
+  module MarkerListMethods
 
     def markers
-      list = []
-      length.times {|i| list << marker(i) unless deleted(i) }
-      list
+      packed_markers(:double).unpack('d*').each_slice(3).to_a
     end
 
   end
+
+  class MarkerList
+    include MarkerListMethods
+  end
+
+  class MarkerList32
+    include MarkerListMethods
+  end
 end
@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'tmpdir'
 
 # Test the Lulu API.
 describe Lulu::MarkerList do
@@ -9,10 +10,331 @@ describe Lulu::MarkerList do
     list.length.should == TEST_SIZE
   end
 
+  it 'should add arrays of triples like repeated add' do
+    triples = list.markers
+    bulk = Lulu::MarkerList.new
+    bulk.add_all(triples).should == TEST_SIZE
+    bulk.markers.should == triples
+    bulk.merge.should == 17362
+  end
+
+  it 'should add nothing if converting a triple changes the list' do
+    bulk = Lulu::MarkerList.new
+    grower = Object.new
+    grower.define_singleton_method(:to_f) { 1000.times { bulk.add(1, 2, 3) }; 4.0 }
+    bulk.add_all([[1, 2, 3], [grower, 5, 6]]).should == 1002
+    bulk.marker(1001).should == [4.0, 5.0, 6.0]
+    lambda { bulk.add_all([[1, 2, 3], [nil, 5, 6]]) }.should raise_error(TypeError)
+    bulk.length.should == 1002
+  end
+
+  it 'should add packed markers in all layouts' do
+    triples = list.markers
+    columns = triples.transpose.flatten
+    [[:double, triples.flatten.pack('d*')],
+     [:float, triples.flatten.pack('f*')],
+     [:double_columns, columns.pack('d*')],
+     [:float_columns, columns.pack('f*')]].each do |layout, str|
+      bulk = Lulu::MarkerList.new
+      bulk.add_packed(str, layout).should == TEST_SIZE
+      bulk.markers.should == triples
+    end
+  end
+
+  it 'should load markers from CSV and packed binary files' do
+    triples = list.markers
+    dir = Dir.tmpdir
+    csv, bin = File.join(dir, "lulu_#{Process.pid}.csv"), File.join(dir, "lulu_#{Process.pid}.bin")
+    begin
+      File.open(csv, 'w') do |f|
+        f.puts 'id,size,x,y'
+        triples.each_with_index {|(x, y, size), i| f.print "#{i},#{size}, #{x},#{y}\r\n" }
+      end
+      Lulu::MarkerList.load_csv(csv, cols: [2, 3, 1], header: true).markers.should == triples
+      lambda { Lulu::MarkerList.load_csv(csv, cols: [2, 3, 1]) }.should raise_error(ArgumentError)
+      File.binwrite(bin, triples.transpose.flatten.pack('d*'))
+      Lulu::MarkerList.load_binary(bin, layout: :double_columns).markers.should == triples
+      lambda { Lulu::MarkerList.load_binary(csv, layout: :double) }.should raise_error(ArgumentError)
+    ensure
+      [csv, bin].each {|path| File.delete(path) if File.exist?(path) }
+    end
+  end
+
+  it 'should reject packed strings with partial markers' do
+    lambda { Lulu::MarkerList.new.add_packed([1.0, 2.0].pack('d*'), :double) }.should raise_error(ArgumentError)
+  end
+
   it 'should merge to correct number of markers' do
     list.merge.should == 17362
   end
 
+  it 'should merge the same with any spatial index' do
+    [:circle, :square].each do |kind|
+      results = [:quadtree, :loose_quadtree, :grid].map do |index|
+        copy = list.dup
+        copy.set_info(kind, 1, index)
+        copy.merge
+        copy.packed_markers(:double)
+      end
+      results[1..-1].each { |result| result.should == results[0] }
+    end
+    lambda { list.set_info(:circle, 1, :octree) }.should raise_error(TypeError)
+  end
+
+  it 'should merge the same with any number of threads' do
+    [:circle, :square].each do |kind|
+      [1, 3].each do |scale|
+        results = [1, 2, 3, 8].map do |threads|
+          copy = list.dup
+          copy.set_info(kind, scale, :auto, threads)
+          [copy.merge, copy.packed_markers(:double), copy.packed_parts]
+        end
+        results[1..-1].each { |result| result.should == results[0] }
+      end
+    end
+    lambda { list.set_info(:circle, 1, :auto, 0) }.should raise_error(ArgumentError)
+  end
+
+  it 'should take the default thread count from LULU_THREADS' do
+    expected = list.dup
+    expected.merge
+    begin
+      ENV['LULU_THREADS'] = '4'
+      threaded = Lulu::MarkerList.new
+    ensure
+      ENV.delete('LULU_THREADS')
+    end
+    threaded.add_all(list.markers)
+    threaded.merge
+    threaded.packed_parts.should == expected.packed_parts
+  end
+
+  it 'should merge independent pairs in rounds the same as serially' do
+    rng = Random.new(3)
+    triples = []
+    100.times do |i|
+      100.times do |j|
+        x, y = 100 * i + rng.rand(20), 100 * j + rng.rand(20)
+        triples << [x, y, 10] << [x + 2 + rng.rand(3), y, 10]
+      end
+    end
+    triples.shuffle!(random: rng)
+    [:circle, :square].each do |kind|
+      serial, rounds = Lulu::MarkerList.new, Lulu::MarkerList.new
+      [serial, rounds].each {|l| l.add_all(triples); l.set_info(kind, 1, :auto, 4) }
+      rounds.merge_in_rounds.should == serial.merge
+      rounds.packed_parts.should == serial.packed_parts
+      rounds.packed_markers(:double).should == serial.packed_markers(:double)
+    end
+    sum = list.markers.inject(0) {|s, m| s + m[2] }
+    list.merge_in_rounds
+    list.markers.inject(0) {|s, m| s + m[2] }.should == sum
+  end
+
+  it 'should count merge work if built with merge stats' do
+    unmerged = list.merge_stats
+    (unmerged.nil? || unmerged.values.all?(&:zero?)).should == true
+    list.merge
+    stats = list.merge_stats
+    if stats
+      stats[:nearest_searches].should >= TEST_SIZE
+      stats[:distances].should > 0
+      stats[:heap_sifts].should > 0
+      stats[:inverse_total].should >= stats[:inverse_max]
+      stats[:loop_ns].should > 0
+      threaded = list.dup
+      threaded.set_info(:circle, 1, :auto, 4)
+      threaded.merge
+      threaded.merge_stats[:nearest_searches].should > 0
+    end
+  end
+
+  it 'should trace merges without changing them' do
+    path = File.join(Dir.tmpdir, "lulu_trace_#{Process.pid}.mt")
+    begin
+      expected = list.dup
+      expected.merge
+      list.set_info(:circle, 1, :auto, 4)
+      list.trace_merges(path).should be(list)
+      list.merge.should == expected.length
+      list.trace_merges(nil)
+      list.packed_parts.should == expected.packed_parts
+      trace = File.binread(path)
+      trace[0, 8].should == "LULUMT1\n"
+      trace.length.should > TEST_SIZE * 3 * 8
+    ensure
+      File.delete(path) if File.exist?(path)
+    end
+    lambda { list.trace_merges(File.join(path, 'none')) }.should raise_error(SystemCallError)
+  end
+
+  it 'should dump and load merged lists, also by Marshal' do
+    list.set_info(:square, 2, :grid)
+    list.merge
+    path = File.join(Dir.tmpdir, "lulu_dump_#{Process.pid}.mf")
+    begin
+      list.dump(path).should be(list)
+      [Lulu::MarkerList.load(path), Marshal.load(Marshal.dump(list))].each do |loaded|
+        loaded.markers.should == list.markers
+        loaded.packed_parts.should == list.packed_parts
+        loaded.remove(0)
+        loaded.remerge
+        copy = list.dup
+        copy.remove(0)
+        copy.remerge
+        loaded.markers.should == copy.markers
+      end
+      lambda { Lulu::MarkerList32.load(path) }.should raise_error(ArgumentError)
+    ensure
+      File.delete(path) if File.exist?(path)
+    end
+    lambda { Lulu::MarkerList.load(path) }.should raise_error(SystemCallError)
+    lambda { Lulu::MarkerList._load('not a marker list') }.should raise_error(ArgumentError)
+    # A list can't be loaded with more markers than can be added.
+    data = list._dump(-1)
+    data[40, 8] = [1 << 62].pack('q')
+    lambda { Lulu::MarkerList._load(data) }.should raise_error(ArgumentError, /corrupt/)
+  end
+
+  it 'should refuse to load markers with corrupt parts or deleted flags' do
+    list.merge
+    data = list._dump(-1)
+    marker_size = (data.length - 64) / list.length
+    index_size = [0].pack(Lulu::INDEX_FORMAT).length
+    root = (0...list.length).find { |i| list.parts(i)[0] == :root }
+    part = list.parts(root)[1]
+    corrupt = lambda do |i, offset, value|
+      bad = data.dup
+      bad[64 + i * marker_size + 48 + offset, index_size] = [value].pack(Lulu::INDEX_FORMAT)
+      bad
+    end
+    [corrupt[root, 0, 100000000],      # part past the list
+     corrupt[root, 0, root],           # part not of lower index
+     corrupt[root, 0, -3],             # no such part kind
+     corrupt[part, index_size, 0],     # part not deleted
+     corrupt[root, index_size, list.parts(root)[2] * 2 + 1]].each do |bad| # root deleted
+      lambda { Lulu::MarkerList._load(bad) }.should raise_error(ArgumentError, /corrupt/)
+      path = File.join(Dir.tmpdir, "lulu_corrupt_#{Process.pid}.mf")
+      begin
+        File.binwrite(path, bad)
+        lambda { Lulu::MarkerList.load(path) }.should raise_error(ArgumentError, /corrupt/)
+      ensure
+        File.delete(path) if File.exist?(path)
+      end
+    end
+    Lulu::MarkerList._load(data).packed_parts.should == list.packed_parts
+  end
+
+  it 'should count its memory toward garbage collection' do
+    packed = list.packed_markers(:double) * 20
+    GC.disable
+    begin
+      # A new list first reports frees of lists collected earlier.
+      added = Lulu::MarkerList.new
+      before = GC.stat(:malloc_increase_bytes)
+      added.add_packed(packed, :double)
+      GC.stat(:malloc_increase_bytes).should > before + packed.length
+    ensure
+      GC.enable
+    end
+  end
+
+  it 'should merge the same with large allocations in storage files' do
+    expected = list.dup
+    expected.merge
+    begin
+      Lulu.set_storage(Dir.tmpdir, 4096)
+      list.merge.should == expected.length
+      list.packed_parts.should == expected.packed_parts
+    ensure
+      Lulu.set_storage(nil)
+    end
+    lambda { Lulu.set_storage(File.join(Dir.tmpdir, 'lulu_none')) }.should raise_error(SystemCallError)
+  end
+
+  it 'should give forked children their own copies of storage files' do
+    begin
+      Lulu.set_storage(Dir.tmpdir, 4096)
+      list.merge
+      # Fork with a storage directory, then with storage stopped, when
+      # children copy the blocks into anonymous memory.
+      [true, false].each do |storage_p|
+        Lulu.set_storage(nil) unless storage_p
+        leaf = (0...list.length).find { |i| list.parts(i) == [:leaf] }
+        marker = list.marker(leaf)
+        parts = list.packed_parts
+        pid = fork do
+          same_p = list.packed_parts == parts
+          list.move(leaf, 777, 777)
+          list.remerge
+          list.add_all([[1, 2, 3]] * 10000)
+          exit!(same_p && list.marker(leaf) == [777.0, 777.0, marker[2]] ? 0 : 1)
+        end
+        Process.wait(pid)
+        $?.exitstatus.should == 0
+        list.marker(leaf).should == marker
+        list.packed_parts.should == parts
+        list.remerge.should == list.length
+      end
+    ensure
+      Lulu.set_storage(nil)
+    end
+  end
+
+  it 'should sort markers by locality without changing them' do
+    markers = list.markers
+    list.sort_by_locality.should == TEST_SIZE
+    list.markers.sort.should == markers.sort
+    list.markers.should_not == markers
+    list.merge
+    list.markers.inject(0) {|s, m| s + m[2] }.should == markers.inject(0) {|s, m| s + m[2] }
+  end
+
+  it 'should merge approximately in grid cells to non-overlapping clusters of all leaves' do
+    sum = list.markers.inject(0) {|s, m| s + m[2] }
+    n = list.merge_approximate(20)
+    list.approximation_error.should > 0
+    list.approximation_error.should < 1
+    list.markers.inject(0) {|s, m| s + m[2] }.should == sum
+    n.times.count {|i| [:leaf, :single].include?(list.parts(i)[0]) }.should == TEST_SIZE
+    # No markers are left overlapping, so an exact merge changes nothing.
+    length = list.compress
+    list.merge.should == length
+    list.approximation_error.should == 0
+    list.merge_approximate(10000).should == 2 * length - 1
+    lambda { list.merge_approximate(0) }.should raise_error(ArgumentError)
+  end
+
+  it 'should aggregate markers of no size at their midpoint' do
+    zeros = Lulu::MarkerList.new
+    zeros.add_all([[1, 1, 0], [3, 5, 0], [2, 2, 4]])
+    zeros.merge_approximate(10).should == 5
+    zeros.marker(3).should == [2.0, 3.0, 0.0]
+    zeros.marker(4).should == [2.0, 2.0, 4.0]
+  end
+
+  # The test markers have integer coordinates and sizes, which float holds
+  # exactly. Merged centers are then off by at most half a float ulp at the
+  # extent of 1000, and no merge decision changes, though near ties may be
+  # merged in another order. Sizes are summed in double, so they're exact.
+  it 'should merge nearly the same with float32 coordinates' do
+    [:circle, :square].each do |kind|
+      copy = list.dup
+      copy.set_info(kind, 1)
+      list32 = Lulu::MarkerList32.new
+      list32.add_all(list.markers)
+      list32.set_info(kind, 1)
+      list32.merge.should == copy.merge
+      markers, markers32 = copy.markers.sort, list32.markers.sort
+      markers32.size.should == markers.size
+      markers.zip(markers32).each do |m, m32|
+        (m32[0] - m[0]).abs.should < 1e-4
+        (m32[1] - m[1]).abs.should < 1e-4
+        m32[2].should == m[2]
+      end
+    end
+  end
+
   it 'should compress to correct number of markers after merge' do
     list.merge
     list.compress.should == 2638
@@ -23,12 +345,198 @@ describe Lulu::MarkerList do
     list.compress == list.merge
   end
 
+  it 'should merge the same reusing its workspace' do
+    [1, 3, 0.5, 2, :release, 1].each do |scale|
+      if scale == :release
+        list.release_workspace.should be(list)
+        next
+      end
+      fresh = list.dup
+      fresh.set_info(:circle, scale)
+      fresh.merge
+      list.set_info(:circle, scale)
+      list.merge
+      list.packed_markers(:double).should == fresh.packed_markers(:double)
+    end
+  end
+
   it 'should have correct number of non-merged nodes in parts' do
     n = 0
     list.merge.times{|i| n += 1 if [:root, :single].include? list.parts(i)[0] }
     n.should == list.compress
   end
 
+  it 'should export undeleted markers packed in all layouts' do
+    list.merge
+    triples = []
+    list.length.times {|i| triples << list.marker(i) unless list.deleted(i) }
+    list.packed_markers(:double).unpack('d*').each_slice(3).to_a.should == triples
+    list.packed_markers(:float).unpack('f*').should == triples.flatten.pack('f*').unpack('f*')
+    list.packed_markers(:double_columns).unpack('d*').should == triples.transpose.flatten
+  end
+
+  it 'should export packed parts matching parts' do
+    n = list.merge
+    packed = list.packed_parts.unpack("#{Lulu::INDEX_FORMAT}*").each_slice(3).to_a
+    packed.length.should == n
+    n.times do |i|
+      part_a, part_b, deleted = packed[i]
+      (deleted == 1).should == list.deleted(i)
+      list.parts(i)[1..2].should == [part_a, part_b] if part_a >= 0
+    end
+  end
+
+  it 'should build a zoom pyramid by merging each level into the next' do
+    list.set_info(:circle, 0.5)
+    finest = list.dup
+    list.merge_pyramid(3, 2).should == finest.merge
+    list.level_count.should == 3
+    list.markers.should == finest.markers
+    list.level(0).markers.should == finest.markers
+    expected = list.level(0)
+    (1...3).each do |z|
+      expected.set_info(:circle, 0.5 * 2 ** z)
+      expected.merge
+      expected.compress
+      list.level(z).markers.should == expected.markers
+    end
+    list.level(3).should be_nil
+  end
+
+  it 'should map markers of each pyramid level to the clusters of the next' do
+    inputs = list.markers
+    list.merge_pyramid(2, 3)
+    [0, 1].each do |z|
+      clusters = list.level_clusters(z).unpack("#{Lulu::INDEX_FORMAT}*")
+      clusters.length.should == inputs.length
+      outputs = list.level(z).markers
+      sums = Array.new(outputs.length, 0)
+      clusters.each_with_index {|c, i| sums[c] += inputs[i][2] }
+      sums.should == outputs.map {|m| m[2] }
+      inputs = outputs
+    end
+  end
+
+  it 'should find undeleted markers overlapping a box' do
+    list.merge
+    boxes = [[0, 0, 1000, 1000], [100, 200, 300, 250], [-50, -50, 10, 10], [500, 500, 500, 500], [2000, 0, 3000, 10]]
+    boxes.each do |x0, y0, x1, y1|
+      expected = []
+      list.length.times do |i|
+        next if list.deleted(i)
+        x, y, size = list.marker(i)
+        r = Math.sqrt(size / Math::PI)
+        expected << i if x + r >= x0 && x - r <= x1 && y + r >= y0 && y - r <= y1
+      end
+      list.in_box(x0, y0, x1, y1).sort.should == expected
+    end
+  end
+
+  it 'should rebuild the box index after markers change' do
+    list.merge
+    list.in_box(2000, 2000, 2010, 2010).should == []
+    list.add(2005, 2005, 1)
+    list.in_box(2000, 2000, 2010, 2010).should == [list.length - 1]
+  end
+
+  it 'should remerge changes to the same result as a full merge' do
+    rng = Random.new(7)
+    triples = Array.new(20000) { [rng.rand * 2000, rng.rand * 2000, 1 + rng.rand * 50] }
+    incremental = Lulu::MarkerList.new
+    incremental.add_all(triples)
+    incremental.merge
+    3.times do
+      20.times do
+        i = rng.rand(triples.length)
+        next unless triples[i]
+        if rng.rand < 0.5
+          incremental.remove(i)
+          triples[i] = nil
+        else
+          triples[i] = [rng.rand * 2000, rng.rand * 2000, triples[i][2]]
+          incremental.move(i, triples[i][0], triples[i][1])
+        end
+      end
+      20.times do
+        triples[incremental.length] = [rng.rand * 2000, rng.rand * 2000, 1 + rng.rand * 50]
+        incremental.add(*triples[incremental.length])
+      end
+      incremental.remerge
+      full = Lulu::MarkerList.new
+      full.add_all(triples.compact)
+      full.merge
+      incremental.markers.sort.should == full.markers.sort
+    end
+    leaves = 0
+    incremental.length.times {|i| leaves += 1 if [:leaf, :single].include?(incremental.parts(i)[0]) }
+    leaves.should == triples.compact.length
+  end
+
+  it 'should reuse the places of discarded merges when remerging' do
+    rng = Random.new(3)
+    list.merge
+    200.times do
+      i = rng.rand(10000)
+      next unless [:leaf, :single].include?(list.parts(i)[0])
+      list.move(i, rng.rand * 1000, rng.rand * 1000)
+      list.remerge
+    end
+    discarded = 0
+    list.length.times do |i|
+      kind, a, b = list.parts(i)
+      discarded += 1 if kind == :removed
+      [a, b].max.should < i if [:root, :merge].include?(kind)
+    end
+    discarded.should < 20
+  end
+
+  it 'should remove and move only leaves' do
+    list.merge
+    lambda { list.remove(list.length - 1) }.should raise_error(ArgumentError)
+    lambda { list.move(list.length, 0, 0) }.should raise_error(IndexError)
+    list.remove(0)
+    list.parts(0).should == [:removed]
+    lambda { list.remove(0) }.should raise_error(ArgumentError)
+  end
+
+  it 'should merge an empty list' do
+    Lulu::MarkerList.new.merge.should == 0
+  end
+
+  it 'should reject other calls during a merge and restore the list when interrupted' do
+    big = new_marker_list(200000)
+    merger = Thread.new { Thread.current.report_on_exception = false; big.merge }
+    # Other threads run during the merge, but can't touch the list.
+    busy = false
+    until busy || !merger.alive?
+      begin
+        big.length
+        Thread.pass
+      rescue RuntimeError
+        busy = true
+      end
+    end
+    busy.should == true
+    merger.raise(Interrupt)
+    lambda { merger.join }.should raise_error(Interrupt)
+    big.length.should == 200000
+    big.length.times.count {|i| big.deleted(i) }.should == 0
+  end
+
+  it 'should keep merging through interrupts that do not raise' do
+    expected = new_marker_list(20000).merge
+    big = new_marker_list(20000)
+    merger = Thread.new { big.merge }
+    wakeups = 0
+    while merger.alive?
+      merger.wakeup rescue ThreadError
+      wakeups += 1
+      sleep 0.001
+    end
+    wakeups.should > 1
+    merger.value.should == expected
+  end
+
   it 'should perform fine over multiple runs with unit increases in input length to provoke memory bugs' do
     1000.times { |i| new_marker_list(10000 + i).merge }
   end